@@ -0,0 +1,74 @@
+#include "message.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Encode/decode throughput of AppendEntriesArgs against batch size
+// Usage: message_benchmark [payload bytes] [total entries per batch size]
+
+double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    const size_t payload = argc > 1 ? std::stoul(argv[1]) : 64;
+    const size_t total = argc > 2 ? std::stoul(argv[2]) : (1 << 21);
+
+    std::printf("payload %zu bytes, %zu entries per batch size\n", payload, total);
+    std::printf("%8s %12s %16s %16s %12s\n", "batch", "head B/log", "encode Mlog/s", "decode Mlog/s", "decode MB/s");
+
+    for (const size_t batch : {1, 8, 64, 512, 4096})
+    {
+        raft::AppendEntriesArgs args;
+        args.term = 7;
+        args.leader_id = 1;
+        args.pre_log_index = 1000000;
+        args.pre_log_term = 7;
+        args.commit_index = 999990;
+        for (size_t i = 1; i <= batch; ++i)
+            args.log_vec.push_back(raft::Log{args.pre_log_index + (int)i, 7, false, std::string(payload, 'x')});
+        const raft::message msg = args;
+        const auto &rounds = std::max<size_t>(total / batch, 1);
+
+        // Encoding only writes the head, contents are referenced
+        std::string head;
+        std::vector<raft::buffer> contents;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i)
+        {
+            head.clear();
+            contents.clear();
+            raft::Encode(msg, head, contents);
+        }
+        const auto &encode = Seconds(start);
+
+        const auto &head_size = head.size();
+        for (const auto &c : contents)
+            head.append(c.data(), c.size());
+        const raft::buffer data(std::move(head));
+
+        // Decoded contents are slices of data
+        size_t checksum = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i)
+        {
+            raft::message out;
+            if (!raft::Decode(data, out))
+                return 1;
+            checksum += std::get<raft::AppendEntriesArgs>(out).log_vec.size();
+        }
+        const auto &decode = Seconds(start);
+        if (checksum != rounds * batch)
+            return 1;
+
+        const auto &logs = (double)rounds * batch;
+        std::printf("%8zu %12.2f %16.2f %16.2f %12.1f\n", batch, (double)head_size / batch,
+                    logs / encode / 1e6, logs / decode / 1e6, (double)rounds * data.size() / decode / (1 << 20));
+    }
+    return 0;
+}
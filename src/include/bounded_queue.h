@@ -0,0 +1,292 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <vector>
+
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 有界无锁多生产者多消费者队列（Vyukov），每个槽带序号，生产者和消费者只竞争各自的位置
+    // 放入和取出都不加锁，阻塞时在原子变量上等待（Linux上是futex），只有有人等待时才唤醒
+    // 满时提供三种选择：try_put立即失败，put阻塞，co_await async_put挂起协程
+    template <typename T>
+    class bounded_queue : public noncopyable
+    {
+    private:
+        struct cell
+        {
+            std::atomic<size_t> seq;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+
+    public:
+        // co_await queue.async_put(e)，满时挂起，有空位时在取出的线程里恢复，返回false表示队列已销毁
+        struct put_awaitable
+        {
+            bounded_queue *m_queue = nullptr;
+            T m_value;
+            std::coroutine_handle<> m_h = nullptr;
+            bool m_ok = true;
+
+            bool await_ready() { return m_queue->try_put(std::move(m_value)); }
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                m_h = h;
+                return m_queue->park(this);
+            }
+            bool await_resume() { return m_ok; }
+        };
+
+    private:
+        std::unique_ptr<cell[]> m_cells;
+        const size_t m_mask;
+
+        alignas(64) std::atomic<size_t> m_tail{0}; // 下一个放入的位置
+        alignas(64) std::atomic<size_t> m_head{0}; // 下一个取出的位置
+
+        alignas(64) std::atomic<unsigned int> m_not_empty{0}; // 放入后+1，等待取出的线程等它变化
+        std::atomic<unsigned int> m_not_full{0};              // 取出后+1，等待放入的线程等它变化
+        std::atomic<int> m_take_waiters{0};
+        std::atomic<int> m_put_waiters{0};
+        std::atomic<bool> m_destroyed{false};
+
+        // 挂起的协程，只在满时使用
+        std::mutex m_mutex;
+        std::deque<put_awaitable *> m_async;
+        std::atomic<int> m_async_count{0};
+
+    public:
+        explicit bounded_queue(size_t capacity) : m_mask(RoundUp(capacity) - 1)
+        {
+            m_cells.reset(new cell[m_mask + 1]);
+            for (size_t i = 0; i <= m_mask; ++i)
+                m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        ~bounded_queue()
+        {
+            while (try_take())
+                ;
+        }
+
+        size_t capacity() const { return m_mask + 1; }
+        bool empty() const { return m_tail.load(std::memory_order_relaxed) == m_head.load(std::memory_order_relaxed); } // 近似
+
+        // 满时返回false，e不变
+        bool try_put(T &&e) { return emplace(std::move(e)); }
+        bool try_put(const T &e) { return emplace(e); }
+
+        // 空时返回空
+        std::optional<T> try_take()
+        {
+            cell *c = nullptr;
+            auto pos = m_head.load(std::memory_order_relaxed);
+            while (true)
+            {
+                c = &m_cells[pos & m_mask];
+                const auto &seq = c->seq.load(std::memory_order_acquire);
+                const auto &dif = (long long)seq - (long long)(pos + 1);
+                if (dif == 0)
+                {
+                    if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (dif < 0)
+                {
+                    return {};
+                }
+                else
+                {
+                    pos = m_head.load(std::memory_order_relaxed);
+                }
+            }
+
+            T *p = std::launder(reinterpret_cast<T *>(c->storage));
+            std::optional<T> ret(std::move(*p));
+            p->~T();
+            c->seq.store(pos + m_mask + 1, std::memory_order_release);
+            NotifyNotFull();
+            return ret;
+        }
+
+        // 满时阻塞，销毁后返回false
+        bool put(T e)
+        {
+            if (m_destroyed.load(std::memory_order_acquire))
+                return false;
+
+            while (!try_put(std::move(e)))
+            {
+                m_put_waiters.fetch_add(1, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const auto &epoch = m_not_full.load(std::memory_order_seq_cst);
+                if (m_destroyed.load(std::memory_order_acquire))
+                {
+                    m_put_waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (try_put(std::move(e)))
+                {
+                    m_put_waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+                m_not_full.wait(epoch, std::memory_order_seq_cst);
+                m_put_waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return true;
+        }
+
+        // 空时阻塞，销毁后返回空（与thread_saft_queue一致，剩余的元素留给析构）
+        std::optional<T> take()
+        {
+            while (!m_destroyed.load(std::memory_order_acquire))
+            {
+                if (auto e = try_take())
+                    return e;
+
+                m_take_waiters.fetch_add(1, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const auto &epoch = m_not_empty.load(std::memory_order_seq_cst);
+                if (m_destroyed.load(std::memory_order_acquire))
+                {
+                    m_take_waiters.fetch_sub(1, std::memory_order_relaxed);
+                    break;
+                }
+                if (auto e = try_take())
+                {
+                    m_take_waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return e;
+                }
+                m_not_empty.wait(epoch, std::memory_order_seq_cst);
+                m_take_waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return {};
+        }
+
+        put_awaitable async_put(T e) { return put_awaitable{this, std::move(e)}; }
+
+        // 唤醒所有等待的线程和协程，之后put返回false，take返回空
+        void destroy()
+        {
+            m_destroyed.store(true, std::memory_order_seq_cst);
+            m_not_empty.fetch_add(1, std::memory_order_seq_cst);
+            m_not_empty.notify_all();
+            m_not_full.fetch_add(1, std::memory_order_seq_cst);
+            m_not_full.notify_all();
+
+            std::deque<put_awaitable *> waiters;
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                waiters.swap(m_async);
+                m_async_count.store(0, std::memory_order_relaxed);
+            }
+            for (auto w : waiters)
+            {
+                w->m_ok = false;
+                w->m_h.resume();
+            }
+        }
+
+    private:
+        static size_t RoundUp(size_t n)
+        {
+            size_t ret = 2;
+            while (ret < n)
+                ret <<= 1;
+            return ret;
+        }
+
+        template <typename U>
+        bool emplace(U &&e)
+        {
+            cell *c = nullptr;
+            auto pos = m_tail.load(std::memory_order_relaxed);
+            while (true)
+            {
+                c = &m_cells[pos & m_mask];
+                const auto &seq = c->seq.load(std::memory_order_acquire);
+                const auto &dif = (long long)seq - (long long)pos;
+                if (dif == 0)
+                {
+                    if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (dif < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = m_tail.load(std::memory_order_relaxed);
+                }
+            }
+
+            new (c->storage) T(std::forward<U>(e));
+            c->seq.store(pos + 1, std::memory_order_release);
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_take_waiters.load(std::memory_order_relaxed) > 0)
+            {
+                m_not_empty.fetch_add(1, std::memory_order_seq_cst);
+                m_not_empty.notify_one();
+            }
+            return true;
+        }
+
+        // 先登记再重试，与NotifyNotFull的先取出再检查登记数配对，不会丢失唤醒
+        // 返回false表示不用挂起
+        bool park(put_awaitable *w)
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            m_async_count.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_destroyed.load(std::memory_order_acquire))
+            {
+                m_async_count.fetch_sub(1, std::memory_order_relaxed);
+                w->m_ok = false;
+                return false;
+            }
+            if (try_put(std::move(w->m_value)))
+            {
+                m_async_count.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            m_async.push_back(w);
+            return true;
+        }
+
+        void NotifyNotFull()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_put_waiters.load(std::memory_order_relaxed) > 0)
+            {
+                m_not_full.fetch_add(1, std::memory_order_seq_cst);
+                m_not_full.notify_one();
+            }
+
+            if (m_async_count.load(std::memory_order_relaxed) > 0)
+            {
+                // 替挂起的协程放入，成功的在锁外恢复
+                std::vector<std::coroutine_handle<>> ready;
+                {
+                    std::unique_lock<std::mutex> _(m_mutex);
+                    while (!m_async.empty() && try_put(std::move(m_async.front()->m_value)))
+                    {
+                        ready.push_back(m_async.front()->m_h);
+                        m_async.pop_front();
+                        m_async_count.fetch_sub(1, std::memory_order_relaxed);
+                    }
+                }
+                for (auto h : ready)
+                    h.resume();
+            }
+        }
+    };
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace raft
+{
+    // 不可变的引用计数缓冲区，拷贝只增加引用计数，不复制内容
+    // 可以独占一块内存，也可以是某个共享内存段中的一段
+    class buffer
+    {
+    private:
+        std::shared_ptr<const void> m_owner; // 持有底层内存
+        const char *m_data = nullptr;
+        size_t m_size = 0;
+
+    public:
+        buffer() = default;
+        buffer(std::string str)
+        {
+            auto owner = std::make_shared<const std::string>(std::move(str));
+            m_data = owner->data();
+            m_size = owner->size();
+            m_owner = std::move(owner);
+        }
+        buffer(const char *str) : buffer(std::string(str)) {}
+        buffer(std::shared_ptr<const void> owner, const char *data, size_t size)
+            : m_owner(std::move(owner)), m_data(data), m_size(size) {}
+
+        const char *data() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        std::string_view view() const { return {m_data, m_size}; }
+        std::string str() const { return std::string(m_data, m_size); }
+
+        // 共享同一块内存的子区间
+        buffer slice(size_t offset, size_t size) const
+        {
+            offset = std::min(offset, m_size);
+            return buffer(m_owner, m_data + offset, std::min(size, m_size - offset));
+        }
+
+        friend bool operator==(const buffer &a, const buffer &b) { return a.view() == b.view(); }
+        friend bool operator!=(const buffer &a, const buffer &b) { return !(a == b); }
+        friend std::ostream &operator<<(std::ostream &o, const buffer &b) { return o << b.view(); }
+    };
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 协程帧和任务对象的内存池，按2的幂分级（64B~4KB），更大的直接用全局new
+    // 每个线程一组空闲链表，分配释放不加锁；帧常在别的线程释放，链表过长时整批交给全局仓库，空了再整批取回
+    // 仓库也满了才还给全局delete，稳定运行后不再调用全局new
+    class frame_pool : public noncopyable
+    {
+    private:
+        static constexpr size_t MIN_SHIFT = 6;
+        static constexpr size_t CLASSES = 7;
+        static constexpr size_t BATCH = 64;       // 线程和仓库之间每次转移的块数
+        static constexpr size_t MAX_BATCHES = 64; // 仓库每级最多保留的批数
+
+        struct node
+        {
+            node *next;
+            size_t count; // 只在批的第一块有效，批的块数
+        };
+
+        // 全局仓库，每级一把锁，一次转移一整批
+        struct depot
+        {
+            std::mutex mutex[CLASSES];
+            std::vector<node *> batches[CLASSES];
+
+            depot()
+            {
+                for (auto &b : batches)
+                    b.reserve(MAX_BATCHES);
+            }
+        };
+
+        struct cache
+        {
+            node *head[CLASSES] = {};
+            size_t count[CLASSES] = {};
+
+            ~cache()
+            {
+                for (size_t c = 0; c < CLASSES; ++c)
+                {
+                    if (head[c])
+                        Release(c, head[c], count[c]);
+                }
+            }
+        };
+
+        static depot &Depot()
+        {
+            // 不析构：其他静态对象析构时仍可能释放帧
+            static depot *d = new depot();
+            return *d;
+        }
+
+        // 线程退出时缓存已析构，之后的分配释放直接走全局
+        static cache *Local()
+        {
+            thread_local bool dead = false;
+            struct holder
+            {
+                cache c;
+                ~holder() { dead = true; }
+            };
+            if (dead)
+                return nullptr;
+            thread_local holder h;
+            return &h.c;
+        }
+
+        static size_t Class(size_t n) { return n <= (1u << MIN_SHIFT) ? 0 : std::bit_width(n - 1) - MIN_SHIFT; }
+        static size_t ClassSize(size_t c) { return (size_t)1 << (c + MIN_SHIFT); }
+
+        // 整批放回仓库，仓库满了则还给全局
+        static void Release(size_t c, node *head, size_t count)
+        {
+            head->count = count;
+            {
+                auto &d = Depot();
+                std::unique_lock<std::mutex> _(d.mutex[c]);
+                if (d.batches[c].size() < MAX_BATCHES)
+                {
+                    d.batches[c].push_back(head);
+                    return;
+                }
+            }
+            while (head)
+            {
+                auto next = head->next;
+                ::operator delete(head);
+                head = next;
+            }
+        }
+
+        static node *Acquire(size_t c, size_t &count)
+        {
+            auto &d = Depot();
+            std::unique_lock<std::mutex> _(d.mutex[c]);
+            if (d.batches[c].empty())
+                return nullptr;
+            auto head = d.batches[c].back();
+            d.batches[c].pop_back();
+            count = head->count;
+            return head;
+        }
+
+    public:
+        static void *allocate(size_t n)
+        {
+            const auto &c = Class(n);
+            auto local = Local();
+            if (c >= CLASSES || !local)
+                return ::operator new(c >= CLASSES ? n : ClassSize(c));
+
+            if (!local->head[c])
+                local->head[c] = Acquire(c, local->count[c]);
+            if (!local->head[c])
+                return ::operator new(ClassSize(c));
+
+            auto p = local->head[c];
+            local->head[c] = p->next;
+            --local->count[c];
+            return p;
+        }
+
+        static void deallocate(void *p, size_t n) noexcept
+        {
+            const auto &c = Class(n);
+            auto local = Local();
+            if (c >= CLASSES || !local)
+            {
+                ::operator delete(p);
+                return;
+            }
+
+            // 满一批时把已有的整批交出，当前块留下
+            if (local->count[c] >= BATCH)
+            {
+                Release(c, local->head[c], local->count[c]);
+                local->head[c] = nullptr;
+                local->count[c] = 0;
+            }
+            auto node_p = static_cast<node *>(p);
+            node_p->next = local->head[c];
+            local->head[c] = node_p;
+            ++local->count[c];
+        }
+    };
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 默认的块，条目整个存放在数组里
+    // 块需要提供capacity、get(k)、set(k, e)、copy(other, n)（复制other的前n条）
+    template <typename T, size_t N = 1024>
+    struct array_segment
+    {
+        static constexpr size_t capacity = N;
+        T items[N];
+
+        const T &get(size_t k) const { return items[k]; }
+        void set(size_t k, T e) { items[k] = std::move(e); }
+        void copy(const array_segment &other, size_t n)
+        {
+            for (size_t k = 0; k < n; ++k)
+                items[k] = other.items[k];
+        }
+    };
+
+    // 按固定大小的块存放的日志，用法同vector：只有一个写者（由使用者加锁），读者取得视图后不加锁
+    // 追加只写新位置再发布条数，已发布的条目不再修改；块满时换一份新的块目录，已有的块共享，不搬动已有的条目
+    // 截断和丢弃开头也换一份新的目录，被截断的块复制后再写，旧视图引用的块不受影响
+    // 块的布局由S决定，可以按列存放，get返回值而不是引用
+    template <typename T, typename S = array_segment<T>>
+    class log_store : public noncopyable
+    {
+    private:
+        static constexpr size_t CHUNK = S::capacity;
+        using reference = decltype(std::declval<const S &>().get(0));
+
+        // 块目录，读者看到的是某个目录和它发布过的条数
+        struct state
+        {
+            std::vector<std::shared_ptr<S>> chunks;
+            size_t start = 0;             // 第一条在chunks[0]中的位置
+            std::atomic<size_t> count{0}; // 已发布的条数
+
+            std::pair<const S *, size_t> locate(size_t i) const
+            {
+                const auto &pos = start + i;
+                return {chunks[pos / CHUNK].get(), pos % CHUNK};
+            }
+            reference at(size_t i) const
+            {
+                const auto &pos = start + i;
+                return chunks[pos / CHUNK]->get(pos % CHUNK);
+            }
+        };
+
+        std::shared_ptr<state> m_state; // 写者使用的当前目录
+        std::atomic<std::shared_ptr<const state>> m_published;
+
+    public:
+        // 某一时刻的日志，持有期间写者追加、截断都不影响
+        class view
+        {
+        private:
+            std::shared_ptr<const state> m_state;
+            size_t m_count = 0;
+
+        public:
+            class iterator
+            {
+            private:
+                const view *m_view = nullptr;
+                size_t m_pos = 0;
+
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = T;
+                using difference_type = std::ptrdiff_t;
+                using reference = log_store::reference;
+
+                iterator() = default;
+                iterator(const view *v, size_t pos) : m_view(v), m_pos(pos) {}
+
+                reference operator*() const { return (*m_view)[m_pos]; }
+                iterator &operator++()
+                {
+                    ++m_pos;
+                    return *this;
+                }
+                iterator operator++(int)
+                {
+                    auto ret = *this;
+                    ++m_pos;
+                    return ret;
+                }
+                bool operator==(const iterator &o) const { return m_pos == o.m_pos; }
+                bool operator!=(const iterator &o) const { return m_pos != o.m_pos; }
+            };
+
+            view() = default;
+            explicit view(std::shared_ptr<const state> s) : m_state(std::move(s)), m_count(m_state->count.load(std::memory_order_acquire)) {}
+
+            size_t size() const { return m_count; }
+            bool empty() const { return m_count == 0; }
+            reference operator[](size_t i) const { return m_state->at(i); }
+            reference front() const { return m_state->at(0); }
+            reference back() const { return m_state->at(m_count - 1); }
+            iterator begin() const { return iterator(this, 0); }
+            iterator end() const { return iterator(this, m_count); }
+
+            // 第i条所在的块和块内位置，按列存放时只读需要的列
+            std::pair<const S *, size_t> locate(size_t i) const { return m_state->locate(i); }
+        };
+
+        log_store() { Publish(std::make_shared<state>()); }
+
+        // 以下只能由写者调用
+        size_t size() const { return m_state->count.load(std::memory_order_relaxed); }
+        bool empty() const { return size() == 0; }
+        reference operator[](size_t i) const { return m_state->at(i); }
+        reference front() const { return m_state->at(0); }
+        reference back() const { return m_state->at(size() - 1); }
+        std::pair<const S *, size_t> locate(size_t i) const { return m_state->locate(i); }
+
+        void push_back(T e)
+        {
+            const auto &n = size();
+            const auto &pos = m_state->start + n;
+            if (pos / CHUNK == m_state->chunks.size())
+            {
+                auto next = Copy(m_state->chunks.size(), n);
+                next->chunks.push_back(std::make_shared<S>());
+                Publish(std::move(next));
+            }
+            m_state->chunks[pos / CHUNK]->set(pos % CHUNK, std::move(e));
+            m_state->count.store(n + 1, std::memory_order_release);
+        }
+
+        // 只保留前n条
+        void truncate(size_t n)
+        {
+            if (n >= size())
+                return;
+
+            const auto &pos = m_state->start + n;
+            auto next = Copy(pos / CHUNK, n);
+            if (pos % CHUNK != 0)
+            {
+                // 截断处所在的块可能还被旧视图读，复制一份再往后写
+                auto tail = std::make_shared<S>();
+                tail->copy(*m_state->chunks[pos / CHUNK], pos % CHUNK);
+                next->chunks.push_back(std::move(tail));
+            }
+            Publish(std::move(next));
+        }
+
+        // 丢弃前n条，整块不再使用时释放
+        void pop_front(size_t n)
+        {
+            if (n == 0)
+                return;
+            if (n >= size())
+            {
+                clear();
+                return;
+            }
+
+            const auto &pos = m_state->start + n;
+            auto next = std::make_shared<state>();
+            next->chunks.assign(m_state->chunks.begin() + pos / CHUNK, m_state->chunks.end());
+            next->start = pos % CHUNK;
+            next->count.store(size() - n, std::memory_order_relaxed);
+            Publish(std::move(next));
+        }
+
+        void clear() { Publish(std::make_shared<state>()); }
+
+        // 替换为只有一条
+        void assign(T e)
+        {
+            clear();
+            push_back(std::move(e));
+        }
+
+        // 任意线程调用
+        view snapshot() const { return view(m_published.load(std::memory_order_acquire)); }
+
+    private:
+        // 前chunks个块和n条的新目录
+        std::shared_ptr<state> Copy(size_t chunks, size_t n) const
+        {
+            auto next = std::make_shared<state>();
+            next->chunks.assign(m_state->chunks.begin(), m_state->chunks.begin() + chunks);
+            next->start = m_state->start;
+            next->count.store(n, std::memory_order_relaxed);
+            return next;
+        }
+
+        void Publish(std::shared_ptr<state> next)
+        {
+            m_state = next;
+            m_published.store(std::move(next), std::memory_order_release);
+        }
+    };
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "noncopyable.h"
+
+// 记录一条日志，fmt必须是字符串字面量，按顺序替换其中的{}
+#define RAFT_LOG(fmt, ...)                                          \
+    do                                                              \
+    {                                                               \
+        static constexpr ::raft::log_site raft_log_site{fmt};       \
+        ::raft::logger::get().Log(raft_log_site, ##__VA_ARGS__);    \
+    } while (0)
+
+namespace raft
+{
+    // 一条日志语句，地址即格式id，记录里只存指针
+    struct log_site
+    {
+        const char *fmt;
+    };
+
+    // 静态存储的字符串（如__func__），只存指针不复制
+    struct log_literal
+    {
+        const char *str;
+    };
+
+    // 异步日志
+    // 每个线程写自己的无锁环形缓冲区（单生产者单消费者），记录是二进制的：时间、格式id和参数
+    // 后台线程定期取出所有缓冲区的记录，按时间排序后格式化输出
+    // 缓冲区满时丢弃新记录并计数，输出时报告丢了多少条
+    class logger : noncopyable
+    {
+    public:
+        static constexpr size_t MAX_RECORD = 1024; // 单条记录的字节上限，超出的参数丢弃
+        static constexpr size_t MAX_STRING = 256;  // 字符串参数的字节上限，超出部分截断
+
+        explicit logger(size_t ring_size = 1 << 18, std::chrono::milliseconds interval = std::chrono::milliseconds(10));
+        ~logger();
+
+        // 全局日志，进程退出时输出剩余的记录
+        static logger &get();
+
+        template <typename... Args>
+        void Log(const log_site &site, const Args &...args)
+        {
+            char rec[MAX_RECORD];
+            char *p = rec + sizeof(header);
+            (Encode(p, rec + MAX_RECORD, args), ...);
+
+            header h;
+            h.size = (uint32_t)(p - rec);
+            h.time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            h.site = &site;
+            memcpy(rec, &h, sizeof(h));
+            Write(rec, h.size);
+        }
+
+        void SetOutput(FILE *file);         // 默认stdout
+        void Flush();                       // 等待调用前写入的记录全部输出
+        void Stop();                        // 输出剩余的记录并停止后台线程，之后的记录留在缓冲区
+        unsigned long long Dropped() const; // 因缓冲区满丢弃的记录数
+
+    private:
+        struct header
+        {
+            uint32_t size = 0;  // 整条记录的字节数
+            long long time = 0; // 微秒
+            const log_site *site = nullptr;
+        };
+
+        enum tag : char
+        {
+            TAG_INT = 'i',
+            TAG_UINT = 'u',
+            TAG_DOUBLE = 'd',
+            TAG_CHAR = 'c',
+            TAG_STRING = 's',
+            TAG_LITERAL = 'l',
+        };
+
+        static bool Put(char *&p, char *end, const void *data, size_t size)
+        {
+            if ((size_t)(end - p) < size)
+            {
+                p = end; // 放不下则后面的参数都不要了
+                return false;
+            }
+            memcpy(p, data, size);
+            p += size;
+            return true;
+        }
+
+        template <typename V>
+        static void PutValue(char *&p, char *end, tag t, const V &v)
+        {
+            if ((size_t)(end - p) < 1 + sizeof(V))
+            {
+                p = end;
+                return;
+            }
+            *p++ = t;
+            memcpy(p, &v, sizeof(V));
+            p += sizeof(V);
+        }
+
+        static void PutString(char *&p, char *end, std::string_view s)
+        {
+            if ((size_t)(end - p) < 1 + sizeof(uint16_t))
+            {
+                p = end;
+                return;
+            }
+            const uint16_t len = (uint16_t)std::min({s.size(), MAX_STRING, (size_t)(end - p) - 1 - sizeof(uint16_t)});
+            *p++ = TAG_STRING;
+            Put(p, end, &len, sizeof(len));
+            Put(p, end, s.data(), len);
+        }
+
+        template <typename T>
+        static void Encode(char *&p, char *end, const T &t)
+        {
+            using U = std::decay_t<T>;
+            if constexpr (std::is_same_v<U, log_literal>)
+                PutValue(p, end, TAG_LITERAL, t.str);
+            else if constexpr (requires { typename U::value_type; { t.load() } -> std::same_as<typename U::value_type>; })
+                Encode(p, end, t.load(std::memory_order_relaxed)); // 原子变量记录当时的值
+            else if constexpr (std::is_same_v<U, bool>)
+                PutValue(p, end, TAG_INT, (long long)t); // 与ostream一样输出0/1
+            else if constexpr (std::is_same_v<U, char>)
+                PutValue(p, end, TAG_CHAR, t);
+            else if constexpr (std::is_enum_v<U>)
+                PutValue(p, end, TAG_INT, (long long)t);
+            else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>)
+                PutValue(p, end, TAG_INT, (long long)t);
+            else if constexpr (std::is_integral_v<U>)
+                PutValue(p, end, TAG_UINT, (unsigned long long)t);
+            else if constexpr (std::is_floating_point_v<U>)
+                PutValue(p, end, TAG_DOUBLE, (double)t);
+            else if constexpr (std::is_array_v<T>)
+                PutString(p, end, std::string_view(t)); // 字符数组不会是空指针
+            else if constexpr (std::is_same_v<U, const char *> || std::is_same_v<U, char *>)
+                PutString(p, end, t ? std::string_view(t) : std::string_view("(null)"));
+            else if constexpr (std::is_convertible_v<const T &, std::string_view>)
+                PutString(p, end, t);
+            else if constexpr (requires { { t.view() } -> std::convertible_to<std::string_view>; })
+                PutString(p, end, t.view());
+            else
+                static_assert(!sizeof(T), "unsupported log argument");
+        }
+
+        // 每个线程一个，生产者是所属线程，消费者是后台线程
+        struct ring
+        {
+            explicit ring(size_t size) : data(size), mask(size - 1) {}
+
+            std::vector<char> data;
+            const size_t mask;
+            alignas(64) std::atomic<size_t> tail{0}; // 生产者推进
+            size_t cached_head = 0;                  // 生产者看到的head，空间不够时才重新读
+            alignas(64) std::atomic<size_t> head{0}; // 消费者推进
+            unsigned long long reported = 0;         // 消费者已报告的丢弃数
+            std::atomic<unsigned long long> dropped{0};
+            std::atomic<bool> closed{false}; // 所属线程已退出
+
+            bool Push(const char *rec, size_t size);
+            void Copy(size_t pos, char *dst, size_t size) const;
+        };
+
+        void Write(const char *rec, size_t size);
+        void Run();
+        void Drain(std::string &out);
+        static void Format(const char *rec, std::string &out);
+
+        const unsigned long long m_uid; // 区分不同的logger，线程按它找自己的缓冲区
+        const size_t m_ring_size;
+        const std::chrono::milliseconds m_interval;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::vector<std::shared_ptr<ring>> m_rings;
+        FILE *m_file = stdout;
+        unsigned long long m_flush = 0; // Flush等待的轮数，没到就不休眠
+        bool m_stop = false;
+        bool m_exited = false;         // 后台线程已退出
+        unsigned long long m_pass = 0; // 后台线程完成的轮数
+        std::atomic<unsigned long long> m_dropped{0};
+
+        // 只由后台线程使用
+        std::vector<char> m_batch;
+        std::vector<std::pair<long long, size_t>> m_order; // (时间, 记录在m_batch中的位置)
+
+        std::thread m_thread;
+    };
+}
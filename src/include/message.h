@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "buffer.h"
+
+namespace raft
+{
+    struct Log
+    {
+        int index = -1;         // 日志记录的索引
+        int term = 0;           // 日志记录的任期
+        bool is_server = false; // 是否是服务器自己的日志
+        buffer content;         // 内容，只读共享，同步时不复制
+    };
+
+    // 请求投票
+    struct VoteArgs
+    {
+        int term = 0;            // 候选人的任期
+        int candidate_id = 0;    // 候选人的id
+        int last_log_index = -1; // 候选人最新log的index
+        int last_log_term = 0;   // 候选人最新log的任期
+    };
+    struct VoteReply
+    {
+        int id = 0;                // 投票者的id
+        int term = 0;              // 返回的任期
+        bool vote_granted = false; // 是否投票
+    };
+
+    // 追加条目（可作心跳）
+    struct AppendEntriesArgs
+    {
+        int term = 0;             // 领导的任期
+        int leader_id = 0;        // 领导的id
+        int pre_log_index = 0;    // 跟随者的同步进度索引
+        int pre_log_term = 0;     // 跟随者的同步进度任期
+        int commit_index = 0;     // 领导的最新提交索引
+        int epoch = 0;            // 领导记录的同步轮次，原样返回
+        int read_seq = 0;         // 领导确认自己地位的轮次，非0时心跳也要应答
+        std::vector<Log> log_vec; // 要同步的日志
+    };
+    struct AppendEntriesReply
+    {
+        int id = 0;           // 返回的id
+        int term = 0;         // 返回的任期
+        int log_count = 0;    // 要同步的日志数量
+        bool success = false; // 是否同步成功
+        int commit_index = 0; // 返回的最新提交索引
+        int match_index = 0;  // 成功时与领导一致的最后索引
+        int epoch = 0;        // 请求的同步轮次
+        int read_seq = 0;     // 请求的确认轮次，success表示承认领导的任期
+
+        // 失败时的冲突提示
+        int conflict_term = -1; // pre_log_index处我的日志的任期，日志不够长则为-1
+        int conflict_index = 0; // 冲突任期在我日志中的第一条，日志不够长则为我的日志长度
+    };
+
+    // 安装快照，分块按顺序发送
+    struct InstallSnapshotArgs
+    {
+        int term = 0;       // 领导的任期
+        int leader_id = 0;  // 领导的id
+        int last_index = 0; // 快照包含的最后一条日志的索引
+        int last_term = 0;  // 快照包含的最后一条日志的任期
+        int offset = 0;     // 这一块在快照中的位置
+        bool done = false;  // 是否最后一块
+        int epoch = 0;      // 领导记录的同步轮次，原样返回
+        buffer data;        // 这一块的数据，引用领导的快照
+    };
+    struct InstallSnapshotReply
+    {
+        int id = 0;         // 返回的id
+        int term = 0;       // 返回的任期
+        int last_index = 0; // 请求的快照索引
+        int offset = 0;     // 已收到的字节数，领导从这里继续发送
+        bool done = false;  // 快照已安装（或日志已提交到快照之后）
+        int epoch = 0;      // 请求的同步轮次
+    };
+
+    // 跟随者向领导要读索引，领导确认地位后返回
+    struct ReadIndexArgs
+    {
+        int id = 0;  // 请求者的id
+        int seq = 0; // 请求者的编号，原样返回
+    };
+    struct ReadIndexReply
+    {
+        int id = 0;           // 返回的id
+        int term = 0;         // 返回的任期
+        int seq = 0;          // 请求的编号
+        bool success = false; // 是否确认了领导地位
+        int index = 0;        // 读索引，请求者应用到这里后可以读
+        int leader_id = 0;    // 失败时我知道的领导
+    };
+
+    // server之间的所有消息
+    using message = std::variant<VoteArgs, VoteReply, AppendEntriesArgs, AppendEntriesReply, InstallSnapshotArgs, InstallSnapshotReply, ReadIndexArgs, ReadIndexReply>;
+
+    // 编码的版本，写在每条消息的开头，解码不认识的版本返回false
+    constexpr unsigned int WIRE_VERSION = 2;
+
+    // 编码：字段变长编码写进head，日志内容和快照数据按顺序放进contents，不复制，发送时和head一起writev
+    void Encode(const message &msg, std::string &head, std::vector<buffer> &contents);
+    // 解码head和紧随其后的contents，数据不完整或格式错误返回false，msg不变
+    // 日志内容和快照数据是data的子区间，和data共享内存，不复制
+    bool Decode(const buffer &data, message &msg);
+}
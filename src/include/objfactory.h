@@ -2,41 +2,112 @@
 
 #include "noncopyable.h"
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
 #include <functional>
-#include <map>
-#include <set>
 #include <memory>
+#include <vector>
 
 namespace raft
 {
+    // 对象按id创建和查找
+    // 成员表是不可变的快照，增删对象时复制一份再整体替换（RCU），查找不加锁
     template <typename T>
     class objfactory : public std::enable_shared_from_this<objfactory<T>>, noncopyable
     {
     private:
-        std::mutex m_mutex;
-        std::map<int, std::weak_ptr<T>> m_map;
-        std::set<int> m_set;
+        // 某一时刻的所有对象，keys有序，objs与keys一一对应
+        struct snapshot
+        {
+            std::vector<int> keys;
+            std::vector<std::weak_ptr<T>> objs;
+        };
+
+        std::mutex m_mutex; // 只有增删对象加锁
+        std::atomic<std::shared_ptr<const snapshot>> m_snapshot{std::make_shared<const snapshot>()};
+        std::atomic<unsigned long long> m_version{0}; // 快照的版本，全局唯一
 
     public:
+        // 遍历某一时刻的所有id，遍历期间增删对象不影响
+        class key_view
+        {
+        private:
+            std::shared_ptr<const snapshot> m_snapshot;
+
+        public:
+            explicit key_view(std::shared_ptr<const snapshot> s) : m_snapshot(std::move(s)) {}
+            std::vector<int>::const_iterator begin() const { return m_snapshot->keys.begin(); }
+            std::vector<int>::const_iterator end() const { return m_snapshot->keys.end(); }
+            size_t size() const { return m_snapshot->keys.size(); }
+        };
+
         template <typename... Args>
         std::shared_ptr<T> Get(int id, Args &&...args)
         {
+            // 快速路径：只读本线程缓存的快照
+            if (auto ret = Find(Load(), id))
+                return ret;
+
             std::unique_lock<std::mutex> _(m_mutex);
-            std::weak_ptr<T> &ptr = m_map[id];
-            std::shared_ptr<T> ret = ptr.lock();
-            if (!ret)
+            auto current = m_snapshot.load(std::memory_order_acquire);
+            if (auto ret = Find(*current, id))
+                return ret;
+
+            std::shared_ptr<T> ret(new T(id, std::forward<Args>(args)...), std::bind(&objfactory::DeleteObj, this->shared_from_this(), std::placeholders::_1));
+            auto next = std::make_shared<snapshot>(*current);
+            const auto &pos = std::lower_bound(next->keys.begin(), next->keys.end(), id) - next->keys.begin();
+            if (pos < (int)next->keys.size() && next->keys[pos] == id)
+            {
+                next->objs[pos] = ret; // 旧对象已经析构，id还没来得及移除
+            }
+            else
             {
-                ret.reset(new T(id, std::forward<Args>(args)...), std::bind(&objfactory::DeleteObj, this->shared_from_this(), std::placeholders::_1));
-                ptr = ret;
-                m_set.insert(id);
+                next->keys.insert(next->keys.begin() + pos, id);
+                next->objs.insert(next->objs.begin() + pos, ret);
             }
+            Publish(std::move(next));
             return ret;
         }
 
-        const std::set<int> &GetAllObjKey() const { return m_set; }
+        key_view GetAllObjKey() const { return key_view(m_snapshot.load(std::memory_order_acquire)); }
 
     private:
+        static std::shared_ptr<T> Find(const snapshot &s, int id)
+        {
+            const auto &it = std::lower_bound(s.keys.begin(), s.keys.end(), id);
+            if (it == s.keys.end() || *it != id)
+                return nullptr;
+            return s.objs[it - s.keys.begin()].lock();
+        }
+
+        // 本线程缓存的快照，版本没变时只有一次原子读
+        const snapshot &Load() const
+        {
+            struct cache
+            {
+                unsigned long long version = 0;
+                std::shared_ptr<const snapshot> s;
+            };
+            thread_local cache c;
+
+            const auto &version = m_version.load(std::memory_order_acquire);
+            if (c.version != version || !c.s)
+            {
+                c.s = m_snapshot.load(std::memory_order_acquire);
+                c.version = version;
+            }
+            return *c.s;
+        }
+
+        // 先换快照再换版本，看到新版本的线程一定能读到新快照
+        void Publish(std::shared_ptr<const snapshot> next)
+        {
+            static std::atomic<unsigned long long> s_version{0};
+            m_snapshot.store(std::move(next), std::memory_order_release);
+            m_version.store(++s_version, std::memory_order_release);
+        }
+
         static void DeleteObj(const std::weak_ptr<objfactory<T>> &factory, T *ptr)
         {
             if (!ptr)
@@ -46,12 +117,18 @@ namespace raft
 
         void RemoveObj(T *ptr)
         {
-            std::unique_lock<std::mutex> _(m_mutex);
-            auto it = m_map.find(ptr->key());
-            if (it != m_map.end() && it->second.expired())
             {
-                m_map.erase(ptr->key());
-                m_set.erase(ptr->key());
+                std::unique_lock<std::mutex> _(m_mutex);
+                auto current = m_snapshot.load(std::memory_order_acquire);
+                const auto &it = std::lower_bound(current->keys.begin(), current->keys.end(), ptr->key());
+                const auto &pos = it - current->keys.begin();
+                if (it != current->keys.end() && *it == ptr->key() && current->objs[pos].expired())
+                {
+                    auto next = std::make_shared<snapshot>(*current);
+                    next->keys.erase(next->keys.begin() + pos);
+                    next->objs.erase(next->objs.begin() + pos);
+                    Publish(std::move(next));
+                }
             }
             delete ptr;
         }
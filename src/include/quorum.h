@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if _HAS_CXX20
+#include <coroutine>
+#endif
+
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 等待一组成员的应答，够数、不可能够数或超时时结果确定，只确定一次
+    // 联合共识时等两组成员，两组都够数才算够数，任意一组不可能够数就失败；同时在两组的成员应答一次两组都算
+    // 应答只修改原子计数，不加锁；结果在确定它的线程里回调，之后的应答直接忽略
+    // C++20下也可以co_await等待结果，挂起期间不占用线程
+    class quorum : public std::enable_shared_from_this<quorum>, public noncopyable
+    {
+    public:
+        enum class result
+        {
+            pending = 0,
+            reached = 1, // 同意的够数了
+            failed = 2,  // 拒绝的太多，不可能够数了
+            timeout = 3, // 超时
+        };
+        using callback = std::function<void(result)>;
+
+    private:
+        std::vector<int> m_members;                   // 排序后的成员id，联合时是两组的并集
+        std::unique_ptr<unsigned char[]> m_groups;    // 每个成员属于哪几组，第g位表示第g组
+        int m_size[2] = {0, 0};                       // 每组的成员数
+        int m_needed[2] = {0, 0};                     // 每组需要的同意数
+        const int m_tag;                              // 调用者的标记（如任期），原样返回
+        std::unique_ptr<std::atomic<bool>[]> m_acked; // 每个成员只算一次
+        std::atomic<int> m_ok[2] = {0, 0};
+        std::atomic<int> m_fail[2] = {0, 0};
+        std::atomic<result> m_result{result::pending};
+        callback m_done;
+
+#if _HAS_CXX20
+        std::mutex m_mutex;
+        std::vector<std::coroutine_handle<>> m_waiters;
+#endif
+
+    public:
+        quorum(std::vector<int> members, int needed, int tag = 0, callback done = nullptr);
+        quorum(std::vector<int> members, int needed, std::vector<int> old_members, int old_needed, int tag = 0, callback done = nullptr);
+
+        // 成员的多数同意
+        static std::shared_ptr<quorum> when_majority(std::vector<int> members, int tag = 0, callback done = nullptr);
+        // 全部成员同意
+        static std::shared_ptr<quorum> when_all(std::vector<int> members, int tag = 0, callback done = nullptr);
+        // 指定数量的成员同意
+        static std::shared_ptr<quorum> when_count(std::vector<int> members, int needed, int tag = 0, callback done = nullptr);
+        // 两组成员各自有指定数量同意（联合共识），old_members为空时与when_count相同
+        static std::shared_ptr<quorum> when_joint(std::vector<int> members, int needed, std::vector<int> old_members, int old_needed, int tag = 0, callback done = nullptr);
+
+        int tag() const { return m_tag; }
+        result get() const { return m_result.load(std::memory_order_acquire); }
+
+        void ack(int member, bool ok);                       // 任意线程调用，非成员和重复的应答忽略
+        void expire();                                       // 还没有结果则超时
+        void expire_after(std::chrono::milliseconds delay); // 在线程池的定时器上超时
+
+#if _HAS_CXX20
+        // co_await *q，返回结果
+        struct awaiter
+        {
+            quorum *m_q = nullptr;
+
+            bool await_ready() const { return m_q->get() != result::pending; }
+            bool await_suspend(std::coroutine_handle<> h) { return m_q->Park(h); }
+            result await_resume() const { return m_q->get(); }
+        };
+        awaiter operator co_await() { return awaiter{this}; }
+#endif
+
+    private:
+        bool Reached() const;
+        void Resolve(result r);
+#if _HAS_CXX20
+        bool Park(std::coroutine_handle<> h); // 返回false表示已有结果，不用挂起
+#endif
+    };
+}
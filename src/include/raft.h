@@ -1,16 +1,118 @@
 #pragma once
 
+#include "buffer.h"
+#include "log_store.h"
+#include "logger.h"
+#include "message.h"
 #include "objfactory.h"
+#include "quorum.h"
 #include "thread_pool.h"
+#include "transport.h"
+#include "wal.h"
 
 namespace raft
 {
-    struct Log
+    // 日志的块，按列存放：索引、任期、标记各是一个连续数组，一致性检查、计算提交只读这几列
+    // 短内容复制到块的内存区里，一次分配存放很多条；长内容直接引用，不复制
+    struct log_segment
     {
-        int index = -1;         // 日志记录的索引
-        int term = 0;           // 日志记录的任期
-        bool is_server = false; // 是否是服务器自己的日志
-        std::string content;    // 内容
+        static constexpr size_t capacity = 1024;
+        static constexpr size_t SMALL_CONTENT = 256;    // 不超过这么长的内容复制到内存区
+        static constexpr size_t ARENA_SIZE = 64 * 1024; // 每块内存区的大小
+
+        int indexes[capacity];
+        int terms[capacity];
+        bool servers[capacity];
+        buffer contents[capacity];
+
+        // 当前写入的内存区，写满换新的，旧的由引用它的内容持有
+        std::shared_ptr<char[]> arena;
+        size_t arena_used = ARENA_SIZE;
+
+        Log get(size_t k) const { return Log{indexes[k], terms[k], servers[k], contents[k]}; }
+        void set(size_t k, Log e);
+        void copy(const log_segment &other, size_t n);
+    };
+    using log_entries = log_store<Log, log_segment>;
+
+    // 状态机，由server在持有自己的锁时调用
+    class state_machine
+    {
+    public:
+        virtual ~state_machine() = default;
+
+        virtual buffer Apply(const Log &log) = 0;        // 按索引顺序应用已提交的日志，返回应用的结果
+        virtual buffer Snapshot() = 0;                   // 生成包含所有已应用日志的快照
+        virtual void Restore(const buffer &snapshot) = 0; // 用快照替换全部状态，空快照表示初始状态
+    };
+
+    // 默认的状态机，记录应用过的客户端日志，任意线程可以不加锁读
+    class log_state_machine : public state_machine
+    {
+    private:
+        log_entries m_log_vec;
+
+    public:
+        log_entries::view LogVec() const { return m_log_vec.snapshot(); }
+
+        buffer Apply(const Log &log) override;
+        buffer Snapshot() override;
+        void Restore(const buffer &snapshot) override;
+    };
+
+    // 同步参数
+    struct Config
+    {
+        int max_entries_per_rpc = 64;        // 每次同步的最大日志条数
+        int max_bytes_per_rpc = 1024 * 1024; // 每次同步的最大字节数（至少发一条）
+        int max_inflight = 4;                // 每个跟随者最多未确认的同步请求数
+
+        std::string wal_dir;                 // 预写日志目录，每个server一个子目录，为空则不持久化
+        int wal_segment_size = 64 << 20;     // 单个段文件的大小上限
+        int wal_max_batch_bytes = 1 << 20;   // 攒够这么多字节立即落盘
+        int wal_max_delay = 0;               // 组提交最多等待的时间(ms)，0则上一次落盘结束就继续
+
+        int snapshot_threshold = 1024;       // 快照之后已应用的日志达到这么多条时生成新快照，0则不压缩
+        int snapshot_chunk_size = 64 * 1024; // InstallSnapshot每次发送的字节数
+
+        bool lease_read = false; // 租约读：领导每次心跳都确认地位，租约内的读不再等一轮确认；跟随者在领导有效期内拒绝投票，集群要一致开启
+        std::vector<int> learners; // 初始的学习者id：接收日志、可以读，不参加选举，不计入投票和提交的多数，集群要一致；日志里有成员配置后以日志为准
+
+        std::shared_ptr<raft::transport> transport; // 收发消息的方式，为空则是进程内的直接调用（所有server共用一个）
+    };
+
+    // 提议或读的结果
+    struct ApplyResult
+    {
+        enum class Status
+        {
+            Ok = 0,
+            NotLeader = 1,     // 不是领导，日志没有添加
+            LeaderChanged = 2, // 添加后失去了领导地位，日志可能提交也可能被覆盖
+            Rejected = 3,      // 上一次成员变更还没完成，这次没有开始
+        };
+
+        Status status = Status::Ok;
+        int index = -1;      // 日志的索引，读时是读索引
+        int term = 0;        // 日志的任期
+        int leader_hint = 0; // 不是领导时，我知道的领导
+        buffer result;       // 状态机应用的结果
+    };
+
+    // 集群成员，作为日志保存，添加到日志时就生效（不等提交），日志被截断时回退到之前的
+    // 变更走联合共识：先添加新旧两组成员的联合配置，期间选举、提交、确认地位都要两组各自够数，联合配置提交后再添加新配置
+    // 日志里还没有成员配置时，对象池里的server都是成员，Config::learners是学习者
+    struct Membership
+    {
+        std::vector<int> voters;     // 有投票权的成员，排序
+        std::vector<int> old_voters; // 联合配置里旧的成员，为空表示不在变更中
+        std::vector<int> learners;   // 学习者，排序
+
+        bool IsJoint() const { return !old_voters.empty(); }
+        bool IsVoter(int id) const;   // 在新旧任意一组里
+        bool IsLearner(int id) const; // 是学习者且没有投票权
+        std::string Encode() const;   // 日志内容
+        static bool Decode(const buffer &content, Membership &m); // 不是成员配置的日志返回false
     };
 
     enum class State
@@ -21,45 +123,168 @@ namespace raft
         Folower = 3,   // 跟随者
     };
 
+    // 同步方式：
+    // m_mutex保护选举状态、日志的写入、应用进度和快照，修改都在这把锁里
+    // 任期、状态、提交进度等是原子变量，在锁里修改，外部不加锁读
+    // 日志是log_store，读者取视图不加锁；领导给每个跟随者的同步状态各有一把锁，应答不加m_mutex
+    // 加锁顺序：m_mutex在前，跟随者的锁在后
     class server : public noncopyable
     {
     private:
         std::mutex m_mutex;
         std::shared_ptr<objfactory<server>> m_factory;
+        const Config m_config;
+        std::shared_ptr<transport> m_transport;
+
+        int m_id = 0;                       // server_id
+        std::atomic<bool> m_is_stop{true};  // 停服
+        std::atomic<bool> m_learner{false}; // 当前的成员配置里我是学习者
+        std::atomic<int> m_leader_id{0};    // 当前任期我知道的领导，0表示不知道
+
+        std::atomic<std::shared_ptr<quorum>> m_vote_quorum; // 当前这一轮选举的投票计数，投票返回时不加锁读
 
-        int m_id = 0;          // server_id
-        bool m_is_stop = true; // 停服
-        int m_heartbeat = 0;   // 心跳超时计数
-        int m_vote_count = 0;  // 拥有的投票数
+        timer_wheel::timer_id m_timer_id = 0;                       // 定时器
+        std::chrono::steady_clock::time_point m_election_deadline; // 选举超时时刻
 
         // 需要持久化的数据
-        State m_state = State::None; // 状态
-        int m_term = 0;              // 任期
-        int m_votedfor = 0;          // 给谁投票
-        std::vector<Log> m_log_vec;  // 日志
+        std::atomic<State> m_state{State::None}; // 状态
+        std::atomic<int> m_term{0};              // 任期
+        int m_votedfor = 0;                      // 给谁投票
+        log_entries m_log;                       // 日志，m_log[0]是快照的最后一条
+        std::vector<std::pair<int, int>> m_term_vec; // 日志中每个任期的第一条索引(term, index)，任期递增
+
+        // 成员配置
+        std::vector<std::pair<int, Membership>> m_memberships; // 快照和日志里的成员配置(index, 配置)，索引递增，最后一个生效
+        Membership m_initial_membership;                       // 还没有成员配置时用：对象池里的server，除去配置的学习者
+        std::optional<std::promise<ApplyResult>> m_membership_promise; // 正在进行的变更，添加新配置后转为等待应用
+
+        // 快照，包含m_snapshot_index及之前的所有日志
+        struct Snapshot
+        {
+            int index = 0;
+            int term = 0;
+            buffer data;
+        };
+        int m_snapshot_index = 0;
+        int m_snapshot_term = 0;
+        buffer m_snapshot;
+        std::atomic<std::shared_ptr<const Snapshot>> m_snapshot_ref; // 最新的快照，先于日志压缩发布，发送快照时不加锁读
+        std::shared_ptr<state_machine> m_state_machine;
+
+        // 跟随者正在接收的快照
+        int m_recv_snapshot_index = -1;
+        int m_recv_snapshot_term = 0;
+        std::string m_recv_snapshot;
+
+        std::shared_ptr<wal> m_wal;   // 预写日志
+        int m_persist_term = 0;      // 已写入预写日志的任期
+        int m_persist_votedfor = 0;  // 已写入预写日志的投票
 
         // 临时数据
-        int m_commit_index = 0; // 自己的提交进度索引
-        int m_last_applied = 0; // 自己的保存进度索引
+        std::atomic<int> m_commit_index{0}; // 自己的提交进度索引
+        int m_last_applied = 0;             // 自己的保存进度索引
+
+        // 领导记录的每个跟随者的同步状态，由mutex保护，match_index在计算提交进度时不加锁读
+        struct Progress
+        {
+            std::mutex mutex;
+            bool retired = false;            // 已不是这一任的领导，不再发送
+            int next_index = 0;              // 将要同步的进度索引，发送后即乐观推进
+            std::atomic<int> match_index{0}; // 已经同步的进度索引
+            int inflight = 0;                // 已发送未确认的同步请求数
+            int epoch = 0;                   // 回退时+1，忽略回退前发出请求的返回
+            int stall = 0;                   // 有未确认请求时经过的心跳数，过久则认为请求丢失
+            int sent_from = std::numeric_limits<int>::max(); // 本轮发出的第一条日志，之后的日志本轮都已发出
+
+            // 正在发送的快照，发送期间领导再次压缩也不影响
+            int snapshot_index = -1;
+            int snapshot_term = 0;
+            buffer snapshot;
+            int snapshot_offset = 0; // 跟随者已收到的字节数
+        };
 
-        // 只属于leader的临时数据
-        std::vector<int> m_next_index_vec;  // 所有serve将要同步的进度索引
-        std::vector<int> m_match_index_vec; // 所有server已经同步的进度索引
+        // 提议先攒成一批，由一个任务一次添加
+        struct Proposal
+        {
+            buffer content;
+            std::promise<ApplyResult> promise;
+        };
+        std::mutex m_propose_mutex;
+        std::vector<Proposal> m_proposals;
+        bool m_proposing = false; // 添加任务已提交或正在执行
+
+        // 已添加、等待应用的提议，按索引排序
+        struct ApplyWaiter
+        {
+            int index = -1;
+            int term = 0;
+            std::promise<ApplyResult> promise;
+        };
+        std::deque<ApplyWaiter> m_apply_waiters;
+
+        // 线性一致读：记下读索引，领导确认地位后等状态机应用到读索引
+        // 一轮心跳确认一批读，确认期间到达的读等下一轮
+        // 跟随者和学习者的读先向领导要读索引，再等自己应用到那里
+        struct ReadWaiter
+        {
+            int index = -1; // 读索引
+            std::promise<ApplyResult> promise;
+            int from = -1; // 跟随者转来的读，确认后把读索引返回给它，不等应用；-1是本地的读
+            int seq = 0;   // 跟随者的编号
+        };
+        std::vector<ReadWaiter> m_read_pending;                 // 等下一轮确认
+        std::vector<ReadWaiter> m_read_confirming;              // 本轮确认中
+        std::vector<ReadWaiter> m_read_waiters;                 // 已确认，等应用到读索引
+        int m_read_seq = 0;                                     // 确认的轮次，只增不减
+        std::chrono::steady_clock::time_point m_read_start;     // 本轮心跳发出的时刻
+        std::chrono::steady_clock::time_point m_lease_deadline; // 租约到期的时刻
+        std::atomic<std::shared_ptr<quorum>> m_read_quorum;     // 本轮的应答计数，应答时不加锁读
+        std::map<int, ReadWaiter> m_read_forwarded;             // 向领导要读索引的读，按编号
+        int m_forward_seq = 0;
+
+        // 一任领导的同步状态，当选时创建，卸任时作废，应答取用时不加m_mutex
+        // 只在成员变化时重建，留下的server沿用原来的同步状态，心跳和应答不分配内存
+        struct Replication
+        {
+            const int term;
+            const std::vector<int> ids;                  // 要同步的server，包括自己，排序
+            std::vector<std::shared_ptr<Progress>> peers; // 与ids一一对应
+            std::vector<int> voters;                     // 有投票权的成员在ids中的下标
+            std::vector<int> old_voters;                 // 联合配置时旧成员在ids中的下标
+
+            Replication(int t, std::vector<int> i) : term(t), ids(std::move(i)), peers(ids.size()) {}
+            Progress *Find(int id) const; // 不同步的id返回nullptr
+        };
+        std::atomic<std::shared_ptr<Replication>> m_replication;
+        std::vector<int> m_quorum_vec; // 计算过半同步进度用的临时数组
 
     public:
         server() = delete;
-        server(int id, std::shared_ptr<objfactory<server>> factory);
+        server(int id, std::shared_ptr<objfactory<server>> factory, const Config &config = {});
         ~server() = default;
 
+        // 以下任意线程调用，不加锁
         int key() const { return m_id; }
-        bool IsLeader() const { return m_state == State::Leader; }
-        int Term() const { return m_term; }
-        State GetState() const { return m_state; }
-        bool IsStop() const { return m_is_stop; }
-        const std::vector<Log> &LogVec() const { return m_log_vec; }
-        const std::vector<Log> ApplyLogVec();
+        bool IsLearner() const { return m_learner.load(std::memory_order_relaxed); }
+        bool IsLeader() const { return m_state.load(std::memory_order_relaxed) == State::Leader; }
+        int Term() const { return m_term.load(std::memory_order_relaxed); }
+        State GetState() const { return m_state.load(std::memory_order_relaxed); }
+        bool IsStop() const { return m_is_stop.load(std::memory_order_relaxed); }
+        int LeaderId() const { return m_leader_id.load(std::memory_order_relaxed); }
+        int CommitIndex() const { return m_commit_index.load(std::memory_order_relaxed); }
+        log_entries::view LogVec() const { return m_log.snapshot(); }
+        log_entries::view ApplyLogVec() const; // 默认状态机应用过的日志
+        int SnapshotIndex() const { return m_snapshot_ref.load(std::memory_order_acquire)->index; }
+
+        void SetStateMachine(std::shared_ptr<state_machine> sm); // Start之前设置，默认为log_state_machine
 
-        int AddLog(const std::string &str); // 添加日志
+        int AddLog(buffer content); // 添加日志，不是领导时返回我知道的领导
+        future<ApplyResult> Propose(buffer content); // 添加日志，应用后返回结果，多个调用者的提议合并添加
+        future<ApplyResult> Read();                  // 线性一致读，不写日志，返回时状态机已应用读索引之前的所有日志；任何成员都可以读
+
+        // 在线变更成员，只能由领导发起，同一时间只有一个变更；新配置应用后返回，新配置里没有的领导随后卸任
+        future<ApplyResult> ChangeMembership(std::vector<int> voters, std::vector<int> learners = {});
+        Membership GetMembership(); // 当前生效的成员配置（最新添加的，不一定已提交），加锁
 
         void Start();
         void Stop();
@@ -68,54 +293,87 @@ namespace raft
     private:
         void Update();   // 定时器
         void Election(); // 选举
+        void Schedule(std::chrono::milliseconds delay);
+        int ResetElectionTimer(int min_ms, int max_ms); // 返回本次的超时时长(ms)
+        void BroadcastAppendEntries(bool heartbeat);    // 向所有跟随者同步，heartbeat时没有日志可发也发0条
+        // 在窗口允许时向跟随者分批同步日志，调用时持有该跟随者的锁，日志从视图读
+        void SendAppendEntries(Replication &rep, int id, Progress &progress, const log_entries::view &log, bool heartbeat);
+        bool SendSnapshot(Replication &rep, int id, Progress &progress); // 跟随者需要的日志已被压缩，逐块发送快照
+        void AdvanceCommit(int match_index);                             // 同步进度推进后立即计算提交进度，推进了就通知跟随者
+        void TryCommit(Replication &rep, int match_index);               // 应答里调用，不加锁先算，能推进时才加m_mutex
+        static int QuorumMatch(const Replication &rep, const std::vector<int> &group, std::vector<int> &buf); // 一组成员过半的同步进度，组为空时不限制
+        std::shared_ptr<Replication> MakeReplication(); // 按当前的成员配置创建同步状态
+        void RebuildReplication();                      // 领导的成员配置变化，换一份同步状态
+        void RetireReplication();                       // 不再是领导，作废同步状态
+        void ApplyLog();                                // 应用已提交的日志
+        void FlushProposals();                          // 把攒下的提议一次添加到日志
+        void FailProposals(ApplyResult::Status status); // 等待应用的提议全部失败
+        void StartRead(ReadWaiter waiter);              // 领导记下读索引，租约内直接确认，否则等下一轮心跳
+        void ConfirmLeadership();                       // 没有正在确认的轮次时发一轮心跳，带上等待的读
+        void FinishReadRound(int term, int seq, bool ok);
+        void ReadConfirmed(ReadWaiter waiter);                          // 本地的读等应用，转来的读返回读索引
+        void ReadFailed(ReadWaiter &waiter, ApplyResult::Status status);
+        void ApplyReads();                          // 已应用到读索引的读返回
+        void FailReads(ApplyResult::Status status); // 还没返回的读全部失败
+
+        // 成员配置
+        const Membership &CurrentMembership();   // 最新添加的成员配置
+        void MembershipChanged();                // 添加或回退了成员配置
+        void AdvanceMembership();                // 领导应用日志后，联合配置已提交则添加新配置，新配置已提交且没有我则卸任
+        void RestoreStateMachine();              // 用m_snapshot恢复状态机和其中的成员配置
+
+        // 日志，索引从m_snapshot_index开始
+        int LastLogIndex() const { return m_snapshot_index + (int)m_log.size() - 1; }
+        int LastLogTerm() const { return TermAt(LastLogIndex()); }
+        int TermAt(int index) const; // 不在内存中返回-1
+        Log LogAt(int index) const { return m_log[index - m_snapshot_index]; }
+        void AppendLog(Log log);             // 追加一条日志，维护任期边界和成员配置
+        void TruncateLog(int index);         // 删除index及之后的日志
+        void RebuildLogIndex();              // 日志整体替换后重新计算任期边界和快照之后的成员配置
+        int FirstIndexOfTerm(int term) const; // 日志中没有这个任期返回-1
+
+        // 日志视图上的查询，不加锁
+        static int FirstIndex(const log_entries::view &log);
+        static int LastIndex(const log_entries::view &log);
+        static int TermAt(const log_entries::view &log, int index); // 不在视图中返回-1
+        static int LastIndexOfTerm(const log_entries::view &log, int term);
+
+        // 快照
+        void TakeSnapshot();                                    // 在m_last_applied处生成快照并截断日志
+        void RestoreSnapshot(int index, int term, buffer data); // 用收到的快照替换index及之前的日志
+        void PublishSnapshot();                                 // 快照变化后发布给不加锁的读者
+
+        // 持久化
+        void OpenWal();                               // 打开预写日志并恢复数据
+        void PersistState();                          // 任期或投票变化则写入
+        void PersistLog(int from);                    // 写入from之后的日志，领导落盘后更新自己的同步进度
+        void AfterPersist(int to, message msg, lane l = lane::data); // 已写入的数据落盘后发给to（应答、请求投票）
+        void LogPersisted(int term, int index);
+
+        void Receive(const message &msg); // 传输层收到的消息，在我所在的分片上执行
+        static std::shared_ptr<transport> DefaultTransport();
 
         // 请求投票
-        struct VoteArgs // 参数
-        {
-            int term = 0;            // 候选人的任期
-            int candidate_id = 0;    // 候选人的id
-            int last_log_index = -1; // 候选人最新log的index
-            int last_log_term = 0;   // 候选人最新log的任期
-        };
-        struct VoteReply
-        {
-            int term = 0;              // 返回的任期
-            bool vote_granted = false; // 是否投票
-        };
         void RequestVote(const VoteArgs &args);
         void ReplyVote(const VoteReply &reply);
 
         // 追加条目（可作心跳）
-        struct AppendEntriesArgs
-        {
-            int term = 0;             // 领导的任期
-            int leader_id = 0;        // 领导的id
-            int pre_log_index = 0;    // 跟随者的同步进度索引
-            int pre_log_term = 0;     // 跟随者的同步进度任期
-            int commit_index = 0;     // 领导的最新提交索引
-            std::vector<Log> log_vec; // 要同步的日志
-        };
-        struct AppendEntriesReply
-        {
-            int id = 0;           // 返回的id
-            int term = 0;         // 返回的任期
-            int log_count = 0;    // 要同步的日志数量
-            bool success = false; // 是否同步成功
-            int commit_index = 0; // 返回的最新提交索引
-        };
         void RequestAppendEntries(const AppendEntriesArgs &args);
         void ReplyAppendEntries(const AppendEntriesReply &reply);
 
+        // 安装快照，分块按顺序发送
+        void RequestInstallSnapshot(const InstallSnapshotArgs &args);
+        void ReplyInstallSnapshot(const InstallSnapshotReply &reply);
+
+        // 跟随者的读向领导要读索引
+        void RequestReadIndex(const ReadIndexArgs &args);
+        void ReplyReadIndex(const ReadIndexReply &reply);
+
         void ToLeader();
         void ToFollower(int term, int votedfor);
-
-        // Print
-    private:
-        std::map<long long, std::queue<std::string>> m_print_map;
+        void FollowLeader(int term, int leader_id); // 收到领导（任期不比我小）的消息时调用
 
     public:
-        void Print();
-        void AddPrint(const std::string &str);
         void PrintAllLog();
         void PrintAllApplyLog();
     };
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <optional>
+
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 有界无锁单生产者单消费者队列，用作两个线程之间的通道
+    // 生产者和消费者各自缓存对方的位置，只有看起来满或空时才读对方的缓存行
+    // T必须可以平凡复制（指针、协程句柄）
+    template <typename T>
+    class spsc_queue : public noncopyable
+    {
+    private:
+        std::unique_ptr<T[]> m_buf;
+        const size_t m_mask;
+
+        alignas(64) std::atomic<size_t> m_tail{0}; // 生产者写
+        size_t m_head_cache = 0;                   // 生产者看到的m_head
+
+        alignas(64) std::atomic<size_t> m_head{0}; // 消费者写
+        size_t m_tail_cache = 0;                   // 消费者看到的m_tail
+
+    public:
+        explicit spsc_queue(size_t capacity = 64) : m_mask(RoundUp(capacity) - 1) { m_buf.reset(new T[m_mask + 1]); }
+
+        size_t capacity() const { return m_mask + 1; }
+        bool empty() const { return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire); }
+
+        // 只能由生产者调用，满时返回false
+        bool try_push(T e)
+        {
+            const auto tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_head_cache > m_mask)
+            {
+                m_head_cache = m_head.load(std::memory_order_acquire);
+                if (tail - m_head_cache > m_mask)
+                    return false;
+            }
+            m_buf[tail & m_mask] = e;
+            m_tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // 只能由消费者调用
+        std::optional<T> try_pop()
+        {
+            const auto head = m_head.load(std::memory_order_relaxed);
+            if (head == m_tail_cache)
+            {
+                m_tail_cache = m_tail.load(std::memory_order_acquire);
+                if (head == m_tail_cache)
+                    return {};
+            }
+            T e = m_buf[head & m_mask];
+            m_head.store(head + 1, std::memory_order_release);
+            return e;
+        }
+
+    private:
+        static size_t RoundUp(size_t n)
+        {
+            size_t ret = 2;
+            while (ret < n)
+                ret <<= 1;
+            return ret;
+        }
+    };
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "transport.h"
+
+namespace raft
+{
+    // 基于epoll的非阻塞TCP传输，可以让每个server跑在单独的进程里
+    // 每个远端server一条发出的连接，第一次发送时建立，断开后等reconnect_delay重连；收到的连接只读
+    // 帧格式：[长度 u32][目标id i32][车道 u8][消息]，长度不含自己，消息的编码见message.h
+    // 发送线程只编码和入队，同一个远端攒下的帧由事件循环一次writev发出（日志内容不复制，直接作为iovec），多次发送只唤醒一次
+    // 发给本进程登记过的server不走网络
+    class tcp_transport : public transport
+    {
+    public:
+        struct Options
+        {
+            std::string host = "127.0.0.1";                 // 监听地址
+            int port = 0;                                    // 监听端口，0则由系统分配
+            int max_iov = 64;                                // 一次writev最多的块数
+            size_t max_queue_bytes = 64 << 20;               // 一个远端未发出的字节数上限，超出则丢弃新的消息
+            std::chrono::milliseconds reconnect_delay{100}; // 连接失败后多久重连
+        };
+
+    private:
+        // 发往一个远端server的连接和待发送的数据，由mutex保护
+        struct peer
+        {
+            int id = 0;
+            sockaddr_in addr{};
+            std::mutex mutex;
+            int fd = -1;
+            bool connecting = false;            // 非阻塞连接还没完成
+            bool scheduled = false;             // 已在m_dirty中或在等可写，Send不用再唤醒
+            std::deque<buffer> queue;           // 待发送的块
+            size_t offset = 0;                  // 第一块已发出的字节数
+            size_t bytes = 0;                   // 待发送的字节数
+            std::chrono::steady_clock::time_point retry_at; // 断开后下次重连的时刻
+        };
+
+        // 收到的连接，直接读进引用计数的块，解出的日志内容引用块里的数据，不复制
+        // 块写满后换一块，只把没凑完的帧搬过去；旧块在引用它的消息都释放后回收
+        struct inbound
+        {
+            std::shared_ptr<char[]> block;
+            size_t capacity = 0;
+            size_t begin = 0; // 还没凑成完整帧的数据的开始
+            size_t end = 0;   // 已收到的数据的结尾
+        };
+
+        const Options m_options;
+        int m_listen_fd = -1;
+        int m_epoll_fd = -1;
+        int m_wake_fd = -1; // eventfd，有新数据待发送或要停止时唤醒事件循环
+        int m_port = 0;
+
+        std::mutex m_mutex;                                // 保护m_peers的增加、m_dirty和m_stop
+        std::map<int, std::shared_ptr<peer>> m_peers;      // 按id
+        std::map<int, std::shared_ptr<peer>> m_peer_fds;   // 按连接，只有事件循环访问
+        std::vector<std::shared_ptr<peer>> m_dirty;        // 有新数据待发送的远端
+        std::vector<std::shared_ptr<peer>> m_waiting;      // 等重连的远端，只有事件循环访问
+        std::map<int, inbound> m_inbounds;                 // 按连接，只有事件循环访问
+        bool m_stop = false;
+        std::thread m_loop;
+
+    public:
+        tcp_transport() : tcp_transport(Options()) {}
+        explicit tcp_transport(const Options &options);
+        ~tcp_transport() override;
+
+        int port() const { return m_port; } // 实际监听的端口
+        void AddPeer(int id, const std::string &host, int port); // 远端server的地址
+
+        void Send(int to, message msg, lane l = lane::data) override;
+
+    private:
+        std::shared_ptr<peer> FindPeer(int id);
+        void Loop();
+        void Accept();
+        void Read(int fd);
+        bool Parse(inbound &in); // 交出所有完整的帧，帧长度错误返回false
+        void Renew(inbound &in); // 块写满时调用
+        void Connect(peer &p);
+        void Flush(const std::shared_ptr<peer> &p); // 事件循环里调用，尽量发出待发送的数据
+        void ClosePeer(peer &p);                   // 持有p.mutex时调用，丢弃待发送的数据
+        void Watch(int fd, unsigned int events, bool add);
+    };
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <future>
+#include <optional>
 #include <stdexcept>
 
 #if _HAS_CXX20
@@ -13,7 +14,12 @@
 #include <functional>
 #endif
 
+#include "frame_pool.h"
 #include "noncopyable.h"
+#include "logger.h"
+#include "timer_wheel.h"
+#include "work_stealing_queue.h"
+#include "worker_group.h"
 
 namespace raft
 {
@@ -72,8 +78,17 @@ namespace raft
             std::future<T> get_return_object() { return this->get_future(); }
             std::suspend_never initial_suspend() { return {}; }
             std::suspend_never final_suspend() noexcept { return {}; }
-            void return_void() {}
+            void return_void()
+            {
+                // 返回值由协程体自己set_value，void在结束时才算完成
+                if constexpr (std::is_void_v<T>)
+                    this->set_value();
+            }
             void unhandled_exception() {}
+
+            // 协程帧从内存池分配
+            static void *operator new(size_t n) { return frame_pool::allocate(n); }
+            static void operator delete(void *p, size_t n) { frame_pool::deallocate(p, n); }
         };
 
         future(std::future<T> &&f) : std::future<T>(std::move(f)) {}
@@ -83,24 +98,73 @@ namespace raft
 #endif
     };
 
+    // 工作窃取调度：工作线程提交的任务进自己的队列，外部线程提交的进全局队列
+    // queue_capacity不为0时全局队列有界：满时submit阻塞提交的线程，try_submit返回空
+    // 提交时可指定车道，控制面的任务优先调度，且不受全局队列容量限制
+    // 线程数在[min_threads, max_threads]之间伸缩，见worker_group
+    // 可以分出shards个分片，post_to按key把任务固定交给一个常驻线程，同一个key的任务总在同一个核上执行
     class thread_pool : public noncopyable
     {
+    public:
+        struct Options
+        {
+            int min_threads = 4;                           // 常驻的线程数
+            int max_threads = 64;                          // 最多的线程数
+            std::chrono::milliseconds idle_timeout{5000}; // 超出min_threads的线程空闲这么久后退出
+            size_t queue_capacity = 0;                     // 全局队列的容量，0为不限
+            int shards = 0;                                // 分片数，不超过min_threads，0为不分片
+            bool pin_threads = false;                      // 工作线程绑定CPU
+        };
+
     private:
-        thread_saft_queue<std::coroutine_handle<>> m_queue;
-        std::queue<std::jthread> m_threads;
+        using queue_type = work_stealing_queue<std::coroutine_handle<>>;
+        using group_type = worker_group<queue_type>;
+
+        const Options m_options;
+        queue_type m_queue;
+        // 定时任务已经等过了延迟，走控制面，不再排在普通任务后面
+        timer_wheel m_timer{[this](timer_wheel::callback cb)
+                            { this->post(lane::control, std::move(cb)); }};
+        group_type m_group;
 
     public:
-        static thread_pool &get(int thread_num)
+        // 第一次调用时创建，之后的参数不同则写日志并忽略
+        static thread_pool &get(const Options &options)
         {
-            static thread_pool tp{thread_num};
+            auto &tp = Instance(options);
+            tp.CheckOptions(options);
             return tp;
         }
 
+        // thread_num为常驻的线程数，为0时只取已创建的线程池
+        static thread_pool &get(int thread_num, size_t queue_capacity = 0)
+        {
+            const auto &options = FromCount(thread_num, queue_capacity);
+            auto &tp = Instance(options);
+            if (thread_num > 0)
+                tp.CheckOptions(options);
+            return tp;
+        }
+
+        // 工作线程里长时间阻塞的调用放在这个作用域里，阻塞期间线程池补充线程
+        using blocking_region = group_type::blocking_region;
+        using Stats = group_type::Stats;
+        Stats stats() const { return m_group.stats(); }
+
+        int shards() const { return m_queue.shards(); }
+        // key所在的分片，不分片时返回-1
+        int shard_of(int key) const
+        {
+            const auto &n = shards();
+            return n > 0 ? (key % n + n) % n : -1;
+        }
+
         template <typename T>
         struct awaitable
         {
             using PT = future<T>::promise_type;
             std::coroutine_handle<PT> m_h = nullptr;
+            lane m_lane = lane::data;
 
             bool await_ready()
             {
@@ -109,17 +173,40 @@ namespace raft
             void await_suspend(std::coroutine_handle<PT> h)
             {
                 m_h = h;
-                thread_pool::get(0).submit_coroutine(h);
+                thread_pool::get(0).submit_coroutine(h, m_lane);
             }
             std::coroutine_handle<PT> await_resume() { return m_h; }
         };
 
+        // 放入失败时不挂起，协程继续执行，await_resume返回空句柄
+        // 放入成功后协程可能已在其他线程恢复，不能再写成员
+        template <typename T>
+        struct try_awaitable
+        {
+            using PT = future<T>::promise_type;
+            std::coroutine_handle<PT> m_h = nullptr;
+
+            bool await_ready() { return false; }
+            bool await_suspend(std::coroutine_handle<PT> h)
+            {
+                m_h = h;
+                if (thread_pool::get(0).m_queue.try_put(h))
+                    return true;
+                m_h = nullptr;
+                return false;
+            }
+            std::coroutine_handle<PT> await_resume() { return m_h; }
+        };
+
+        template <std::invocable F>
+        future<std::invoke_result_t<F>> submit(F task) { return submit(lane::data, std::move(task)); }
+
         template <std::invocable F>
-        future<std::invoke_result_t<F>> submit(F task)
+        future<std::invoke_result_t<F>> submit(lane l, F task)
         {
             using RT = std::invoke_result_t<F>;
             using PT = future<RT>::promise_type;
-            std::coroutine_handle<PT> h = co_await awaitable<RT>();
+            std::coroutine_handle<PT> h = co_await awaitable<RT>{nullptr, l};
 
             if constexpr (std::is_void_v<RT>)
             {
@@ -131,116 +218,590 @@ namespace raft
             }
         }
 
-        void submit_coroutine(std::coroutine_handle<> h) { m_queue.put(h); }
+        // 不需要结果的任务，不创建promise和future，稳定后不调用全局new；已停止时任务丢弃
+        template <std::invocable F>
+        void post(F task) { Post(lane::data, std::move(task)); }
+        template <std::invocable F>
+        void post(lane l, F task) { Post(l, std::move(task)); }
+
+        // 交给key所在分片的线程执行，不被其他线程偷走，排在控制面之后、数据面之前，不进批量作用域
+        // 不分片时同post(l, task)
+        template <std::invocable F>
+        void post_to(int key, F task) { post_to(key, lane::data, std::move(task)); }
+        template <std::invocable F>
+        void post_to(int key, lane l, F task)
+        {
+            if (const auto &s = shard_of(key); s >= 0)
+                PostTo(s, std::move(task));
+            else
+                Post(l, std::move(task));
+        }
+
+        // 会长时间阻塞的任务（磁盘同步），只交给不属于分片的线程执行，不占用分片线程，不进批量作用域
+        // 不分片时同post(task)
+        template <std::invocable F>
+        void post_blocking(F task) { PostGeneral(std::move(task)); }
+
+        // 全局队列满或已停止时返回空，任务不执行
+        template <std::invocable F>
+        std::optional<future<std::invoke_result_t<F>>> try_submit(F task)
+        {
+            bool rejected = false;
+            auto ret = try_run(std::move(task), &rejected);
+            if (rejected)
+                return {};
+            return ret;
+        }
+
+        void submit_coroutine(std::coroutine_handle<> h, lane l = lane::data)
+        {
+            if (auto b = batch::current(); b && &b->m_pool == this)
+            {
+                b->m_tasks[(int)l].push_back(h);
+                return;
+            }
+            if (!m_queue.put(h, l))
+                h.destroy(); // 已停止
+        }
+
+        // 作用域内本线程提交的任务先攒着，离开作用域时每个车道一次放入，按任务数唤醒工作线程
+        // 作用域内不能等待这些任务的结果
+        class batch : public noncopyable
+        {
+        private:
+            friend class thread_pool;
+            thread_pool &m_pool;
+            batch *m_prev;
+            std::vector<std::coroutine_handle<>> m_own[2];
+            std::vector<std::coroutine_handle<>> *m_tasks; // 最外层用线程的缓存，容量保留下来，不重复分配
+
+            static batch *&current()
+            {
+                thread_local batch *b = nullptr;
+                return b;
+            }
+
+            static std::vector<std::coroutine_handle<>> *spare()
+            {
+                thread_local std::vector<std::coroutine_handle<>> v[2];
+                return v;
+            }
+
+        public:
+            explicit batch(thread_pool &pool) : m_pool(pool), m_prev(current()), m_tasks(m_prev ? m_own : spare()) { current() = this; }
+            ~batch()
+            {
+                current() = m_prev;
+                for (int l = 0; l < 2; ++l)
+                {
+                    const auto &n = m_pool.m_queue.put_bulk(m_tasks[l], (lane)l);
+                    for (auto i = n; i < m_tasks[l].size(); ++i)
+                        m_tasks[l][i].destroy(); // 已停止
+                    m_tasks[l].clear();
+                }
+            }
+        };
+
+        // 一次提交多个任务
+        template <std::invocable F>
+        std::vector<future<std::invoke_result_t<F>>> submit_bulk(lane l, std::vector<F> tasks)
+        {
+            std::vector<future<std::invoke_result_t<F>>> ret;
+            ret.reserve(tasks.size());
+            batch b(*this);
+            for (auto &task : tasks)
+                ret.push_back(submit(l, std::move(task)));
+            return ret;
+        }
+
+        // 延迟执行任务，返回的id可用于取消
+        template <std::invocable F>
+        timer_wheel::timer_id submit_after(std::chrono::milliseconds delay, F task) { return m_timer.add(delay, std::move(task)); }
+        bool cancel(timer_wheel::timer_id id) { return m_timer.cancel(id); }
+
+        // 延迟后交给key所在的分片执行
+        template <std::invocable F>
+        timer_wheel::timer_id submit_after_to(int key, std::chrono::milliseconds delay, F task)
+        {
+            if (shard_of(key) < 0)
+                return submit_after(delay, std::move(task));
+            return submit_after(delay, [this, key, task = std::move(task)]() mutable
+                                { this->post_to(key, lane::control, std::move(task)); });
+        }
+
+        // co_await thread_pool::delay{ms}，不占用线程，定时结束后在线程池中恢复
+        struct delay
+        {
+            std::chrono::milliseconds m_ms;
+
+            bool await_ready() { return m_ms.count() <= 0; }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                thread_pool::get(0).m_timer.add(m_ms, [h]
+                                                { thread_pool::get(0).submit_coroutine(h, lane::control); });
+            }
+            void await_resume() {}
+        };
 
     private:
+        // post使用的协程，没有返回值
+        struct detached
+        {
+            struct promise_type
+            {
+                detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() {}
+
+                static void *operator new(size_t n) { return frame_pool::allocate(n); }
+                static void operator delete(void *p, size_t n) { frame_pool::deallocate(p, n); }
+            };
+        };
+
+        struct schedule
+        {
+            lane m_lane = lane::data;
+
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) { thread_pool::get(0).submit_coroutine(h, m_lane); }
+            void await_resume() {}
+        };
+
+        template <std::invocable F>
+        detached Post(lane l, F task)
+        {
+            co_await schedule{l};
+            task();
+        }
+
+        struct schedule_to
+        {
+            int m_shard = 0;
+
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                if (!thread_pool::get(0).m_queue.put_to(m_shard, h))
+                    h.destroy(); // 已停止
+            }
+            void await_resume() {}
+        };
+
+        template <std::invocable F>
+        detached PostTo(int s, F task)
+        {
+            co_await schedule_to{s};
+            task();
+        }
+
+        struct schedule_general
+        {
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                if (!thread_pool::get(0).m_queue.put_general(h))
+                    h.destroy(); // 已停止
+            }
+            void await_resume() {}
+        };
+
+        template <std::invocable F>
+        detached PostGeneral(F task)
+        {
+            co_await schedule_general{};
+            task();
+        }
+
         thread_pool() = delete;
-        thread_pool(int thread_num)
+        explicit thread_pool(const Options &options)
+            : m_options(options),
+              m_queue(group_type::slots(GroupOptions(options)), options.queue_capacity, std::min(options.shards, options.min_threads)),
+              m_group(m_queue, [this](int index)
+                      { this->worker(index); }, GroupOptions(options))
+        {
+        }
+
+        static thread_pool &Instance(const Options &options)
         {
-            while (thread_num-- > 0)
+            static thread_pool tp{options};
+            return tp;
+        }
+
+        static Options FromCount(int thread_num, size_t queue_capacity)
+        {
+            Options options;
+            options.min_threads = thread_num;
+            options.max_threads = std::max(thread_num, options.max_threads);
+            options.queue_capacity = queue_capacity;
+            return options;
+        }
+
+        static group_type::Options GroupOptions(const Options &options)
+        {
+            group_type::Options ret;
+            ret.min_threads = options.min_threads;
+            ret.max_threads = options.max_threads;
+            ret.idle_timeout = options.idle_timeout;
+            ret.pin_threads = options.pin_threads;
+            return ret;
+        }
+
+        void CheckOptions(const Options &options) const
+        {
+            if (options.min_threads != m_options.min_threads || options.max_threads != m_options.max_threads ||
+                options.idle_timeout != m_options.idle_timeout || options.queue_capacity != m_options.queue_capacity ||
+                options.shards != m_options.shards || options.pin_threads != m_options.pin_threads)
             {
-                m_threads.emplace(std::jthread([this]
-                                               { this->worker(); }));
+                RAFT_LOG("thread_pool->get ignored min_threads:{} max_threads:{}, already created with min_threads:{} max_threads:{}",
+                         options.min_threads, options.max_threads, m_options.min_threads, m_options.max_threads);
             }
         }
 
-        ~thread_pool()
+        // 被拒绝时rejected在返回前写入，接受后不再访问rejected
+        template <std::invocable F>
+        future<std::invoke_result_t<F>> try_run(F task, bool *rejected)
         {
-            auto &q = m_queue.destroy();
-            while (!m_threads.empty())
+            using RT = std::invoke_result_t<F>;
+            using PT = future<RT>::promise_type;
+            std::coroutine_handle<PT> h = co_await try_awaitable<RT>();
+            if (!h)
             {
-                m_threads.pop();
+                *rejected = true;
+                co_return;
             }
 
-            while (!q.empty())
+            if constexpr (std::is_void_v<RT>)
+            {
+                task();
+            }
+            else
             {
-                q.front().destroy();
-                q.pop();
+                h.promise().set_value(task());
             }
         }
 
-        void worker()
+        ~thread_pool()
+        {
+            m_timer.stop(); // 先停定时器，不再产生新任务
+            m_queue.stop();
+            m_group.stop();
+
+            for (auto &h : m_queue.drain())
+                h.destroy();
+        }
+
+        void worker(int index)
         {
-            while (auto task = m_queue.take())
+            while (auto task = m_queue.take(index))
             {
                 task.value().resume();
             }
         }
     };
 #else
+    template <typename T>
+    using future = std::future<T>;
+
+    // 工作窃取调度：工作线程提交的任务进自己的队列，外部线程提交的进全局队列
+    // queue_capacity不为0时全局队列有界：满时submit阻塞提交的线程，try_submit返回空
+    // 提交时可指定车道，控制面的任务优先调度，且不受全局队列容量限制
+    // 线程数在[min_threads, max_threads]之间伸缩，见worker_group
+    // 可以分出shards个分片，post_to按key把任务固定交给一个常驻线程，同一个key的任务总在同一个核上执行
     class thread_pool : public noncopyable
     {
+    public:
+        struct Options
+        {
+            int min_threads = 4;                           // 常驻的线程数
+            int max_threads = 64;                          // 最多的线程数
+            std::chrono::milliseconds idle_timeout{5000}; // 超出min_threads的线程空闲这么久后退出
+            size_t queue_capacity = 0;                     // 全局队列的容量，0为不限
+            int shards = 0;                                // 分片数，不超过min_threads，0为不分片
+            bool pin_threads = false;                      // 工作线程绑定CPU
+        };
+
     private:
-        std::mutex m_mutex;
-        std::condition_variable m_cv;
-        bool m_stop;
-        std::queue<std::function<void()>> m_queue;
-        std::vector<std::thread> m_threads;
+        // 任务对象从内存池分配，执行后释放
+        struct task_type
+        {
+            virtual ~task_type() = default;
+            virtual void run() = 0;
+
+            // 分配和释放成对声明在基类，派生类的new和经基类指针的delete都走这一对
+            static void *operator new(size_t n) { return frame_pool::allocate(n); }
+            static void operator delete(void *p, size_t n) { frame_pool::deallocate(p, n); }
+        };
+
+        template <typename F>
+        struct task_impl : task_type
+        {
+            F m_f;
+
+            explicit task_impl(F f) : m_f(std::move(f)) {}
+            void run() override { m_f(); }
+        };
+
+        using queue_type = work_stealing_queue<task_type *>;
+        using group_type = worker_group<queue_type>;
+
+        const Options m_options;
+        queue_type m_queue;
+        // 定时任务已经等过了延迟，走控制面，不再排在普通任务后面
+        timer_wheel m_timer{[this](timer_wheel::callback cb)
+                            { this->post(lane::control, std::move(cb)); }};
+        group_type m_group;
 
     public:
-        static thread_pool &get(int thread_num)
+        // 第一次调用时创建，之后的参数不同则写日志并忽略
+        static thread_pool &get(const Options &options)
         {
-            static thread_pool tp(thread_num);
+            auto &tp = Instance(options);
+            tp.CheckOptions(options);
             return tp;
         }
 
+        // thread_num为常驻的线程数，为0时只取已创建的线程池
+        static thread_pool &get(int thread_num, size_t queue_capacity = 0)
+        {
+            const auto &options = FromCount(thread_num, queue_capacity);
+            auto &tp = Instance(options);
+            if (thread_num > 0)
+                tp.CheckOptions(options);
+            return tp;
+        }
+
+        // 工作线程里长时间阻塞的调用放在这个作用域里，阻塞期间线程池补充线程
+        using blocking_region = group_type::blocking_region;
+        using Stats = group_type::Stats;
+        Stats stats() const { return m_group.stats(); }
+
+        int shards() const { return m_queue.shards(); }
+        // key所在的分片，不分片时返回-1
+        int shard_of(int key) const
+        {
+            const auto &n = shards();
+            return n > 0 ? (key % n + n) % n : -1;
+        }
+
         template <typename F, typename... Args>
         auto submit(F &&f, Args &&...args) -> std::future<typename std::result_of<F(Args...)>::type>
+        {
+            return submit(lane::data, std::forward<F>(f), std::forward<Args>(args)...);
+        }
+
+        template <typename F, typename... Args>
+        auto submit(lane l, F &&f, Args &&...args) -> std::future<typename std::result_of<F(Args...)>::type>
         {
             using RT = typename std::result_of<F(Args...)>::type;
 
-            auto task = std::make_shared<std::packaged_task<RT()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-            std::future<RT> res = task->get_future();
+            std::packaged_task<RT()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            std::future<RT> res = task.get_future();
+            if (!Enqueue(new task_impl<std::packaged_task<RT()>>(std::move(task)), l))
+                throw std::runtime_error("enqueue on stopped thread_pool");
+            return res;
+        }
+
+        // 不需要结果的任务，不创建promise和future，稳定后不调用全局new；已停止时任务丢弃
+        template <typename F>
+        void post(F &&f) { post(lane::data, std::forward<F>(f)); }
+        template <typename F>
+        void post(lane l, F &&f) { Enqueue(new task_impl<std::decay_t<F>>(std::forward<F>(f)), l); }
+
+        // 交给key所在分片的线程执行，不被其他线程偷走，排在控制面之后、数据面之前，不进批量作用域
+        // 不分片时同post(l, f)
+        template <typename F>
+        void post_to(int key, F &&f) { post_to(key, lane::data, std::forward<F>(f)); }
+        template <typename F>
+        void post_to(int key, lane l, F &&f)
+        {
+            const auto &s = shard_of(key);
+            if (s < 0)
             {
-                std::unique_lock<std::mutex> _(m_mutex);
-                if (m_stop)
-                    throw std::runtime_error("enqueue on stopped thread_pool");
+                post(l, std::forward<F>(f));
+                return;
+            }
+            auto task = new task_impl<std::decay_t<F>>(std::forward<F>(f));
+            if (!m_queue.put_to(s, task))
+                delete task; // 已停止
+        }
 
-                m_queue.emplace([task]()
-                                { (*task)(); });
+        // 会长时间阻塞的任务（磁盘同步），只交给不属于分片的线程执行，不占用分片线程，不进批量作用域
+        // 不分片时同post(f)
+        template <typename F>
+        void post_blocking(F &&f)
+        {
+            auto task = new task_impl<std::decay_t<F>>(std::forward<F>(f));
+            if (!m_queue.put_general(task))
+                delete task; // 已停止
+        }
+
+        // 作用域内本线程提交的任务先攒着，离开作用域时每个车道一次放入，按任务数唤醒工作线程
+        // 作用域内不能等待这些任务的结果
+        class batch : public noncopyable
+        {
+        private:
+            friend class thread_pool;
+            thread_pool &m_pool;
+            batch *m_prev;
+            std::vector<task_type *> m_own[2];
+            std::vector<task_type *> *m_tasks; // 最外层用线程的缓存，容量保留下来，不重复分配
+
+            static batch *&current()
+            {
+                thread_local batch *b = nullptr;
+                return b;
+            }
+
+            static std::vector<task_type *> *spare()
+            {
+                thread_local std::vector<task_type *> v[2];
+                return v;
+            }
+
+        public:
+            explicit batch(thread_pool &pool) : m_pool(pool), m_prev(current()), m_tasks(m_prev ? m_own : spare()) { current() = this; }
+            ~batch()
+            {
+                current() = m_prev;
+                for (int l = 0; l < 2; ++l)
+                {
+                    // 已停止时放不进去的任务不执行，future得到broken_promise
+                    const auto &n = m_pool.m_queue.put_bulk(m_tasks[l], (lane)l);
+                    for (auto i = n; i < m_tasks[l].size(); ++i)
+                        delete m_tasks[l][i];
+                    m_tasks[l].clear();
+                }
+            }
+        };
+
+        // 一次提交多个任务
+        template <typename F>
+        auto submit_bulk(lane l, std::vector<F> tasks) -> std::vector<std::future<typename std::result_of<F()>::type>>
+        {
+            std::vector<std::future<typename std::result_of<F()>::type>> ret;
+            ret.reserve(tasks.size());
+            batch b(*this);
+            for (auto &task : tasks)
+                ret.push_back(submit(l, std::move(task)));
+            return ret;
+        }
+
+        // 全局队列满或已停止时返回空，任务不执行
+        template <typename F, typename... Args>
+        auto try_submit(F &&f, Args &&...args) -> std::optional<std::future<typename std::result_of<F(Args...)>::type>>
+        {
+            using RT = typename std::result_of<F(Args...)>::type;
+
+            std::packaged_task<RT()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            std::future<RT> res = task.get_future();
+            auto wrapper = new task_impl<std::packaged_task<RT()>>(std::move(task));
+            if (!m_queue.try_put(wrapper))
+            {
+                delete wrapper;
+                return {};
             }
-            m_cv.notify_one();
             return res;
         }
 
+        // 延迟执行任务，返回的id可用于取消
+        template <typename F>
+        timer_wheel::timer_id submit_after(std::chrono::milliseconds delay, F task) { return m_timer.add(delay, std::move(task)); }
+        bool cancel(timer_wheel::timer_id id) { return m_timer.cancel(id); }
+
+        // 延迟后交给key所在的分片执行
+        template <typename F>
+        timer_wheel::timer_id submit_after_to(int key, std::chrono::milliseconds delay, F task)
+        {
+            if (shard_of(key) < 0)
+                return submit_after(delay, std::move(task));
+            return submit_after(delay, [this, key, task = std::move(task)]() mutable
+                                { this->post_to(key, lane::control, std::move(task)); });
+        }
+
     private:
         thread_pool() = delete;
-        thread_pool(int thread_num) : m_stop(false)
+        explicit thread_pool(const Options &options)
+            : m_options(options),
+              m_queue(group_type::slots(GroupOptions(options)), options.queue_capacity, std::min(options.shards, options.min_threads)),
+              m_group(m_queue, [this](int index)
+                      { this->worker(index); }, GroupOptions(options))
+        {
+        }
+
+        static thread_pool &Instance(const Options &options)
+        {
+            static thread_pool tp{options};
+            return tp;
+        }
+
+        static Options FromCount(int thread_num, size_t queue_capacity)
+        {
+            Options options;
+            options.min_threads = thread_num;
+            options.max_threads = std::max(thread_num, options.max_threads);
+            options.queue_capacity = queue_capacity;
+            return options;
+        }
+
+        static group_type::Options GroupOptions(const Options &options)
+        {
+            group_type::Options ret;
+            ret.min_threads = options.min_threads;
+            ret.max_threads = options.max_threads;
+            ret.idle_timeout = options.idle_timeout;
+            ret.pin_threads = options.pin_threads;
+            return ret;
+        }
+
+        void CheckOptions(const Options &options) const
         {
-            while (thread_num-- > 0)
+            if (options.min_threads != m_options.min_threads || options.max_threads != m_options.max_threads ||
+                options.idle_timeout != m_options.idle_timeout || options.queue_capacity != m_options.queue_capacity ||
+                options.shards != m_options.shards || options.pin_threads != m_options.pin_threads)
             {
-                m_threads.emplace_back(std::thread([this]
-                                                   { this->worker(); }));
+                RAFT_LOG("thread_pool->get ignored min_threads:{} max_threads:{}, already created with min_threads:{} max_threads:{}",
+                         options.min_threads, options.max_threads, m_options.min_threads, m_options.max_threads);
             }
         }
 
-        ~thread_pool()
+        // 有批量作用域时先攒着，已停止时释放任务并返回false
+        bool Enqueue(task_type *task, lane l)
         {
+            if (auto b = batch::current(); b && &b->m_pool == this)
             {
-                std::unique_lock<std::mutex> _(m_mutex);
-                m_stop = true;
+                b->m_tasks[(int)l].push_back(task);
+                return true;
             }
-            m_cv.notify_all();
-            for (auto &worker : m_threads)
-                worker.join();
+            if (!m_queue.put(task, l))
+            {
+                delete task;
+                return false;
+            }
+            return true;
         }
 
-        void worker()
+        ~thread_pool()
         {
-            while (true)
+            m_timer.stop(); // 先停定时器，不再产生新任务
+            m_queue.stop();
+            m_group.stop();
+
+            // 已提交的任务仍然执行完
+            for (auto task : m_queue.drain())
             {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> _(m_mutex);
-                    m_cv.wait(_, [this]
-                              { return this->m_stop || !this->m_queue.empty(); });
-                    if (m_stop && m_queue.empty())
-                        return;
-                    task = std::move(m_queue.front());
-                    m_queue.pop();
-                }
+                task->run();
+                delete task;
+            }
+        }
 
-                task();
+        void worker(int index)
+        {
+            while (auto task = m_queue.take(index))
+            {
+                task.value()->run();
+                delete task.value();
             }
         }
     };
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 分层时间轮，由单个线程驱动，精度1ms
+    // 到期的回调不在驱动线程里执行，而是交给dispatch（通常是投递到线程池）
+    class timer_wheel : public noncopyable
+    {
+    public:
+        using timer_id = unsigned long long; // 0表示无效
+        using callback = std::function<void()>;
+
+    private:
+        static constexpr int LEVEL_BITS = 8;
+        static constexpr int LEVEL_SIZE = 1 << LEVEL_BITS; // 每层的槽数
+        static constexpr int LEVEL_MASK = LEVEL_SIZE - 1;
+        static constexpr int LEVEL_COUNT = 4; // 层数，共可表示2^32ms
+        static constexpr unsigned long long MAX_SPAN = (1ull << (LEVEL_BITS * LEVEL_COUNT)) - 1;
+
+        struct node
+        {
+            unsigned long long expire = 0; // 到期的tick
+            callback cb;
+        };
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_stop = false;
+        std::function<void(callback)> m_dispatch;
+        std::chrono::steady_clock::time_point m_start;
+
+        unsigned long long m_tick = 0;                                            // 下一个待处理的tick
+        unsigned long long m_wake = std::numeric_limits<unsigned long long>::max(); // 驱动线程计划醒来的tick
+        timer_id m_next_id = 0;
+        std::unordered_map<timer_id, node> m_nodes; // 被取消的定时器只从这里删除，槽里残留的id到期时忽略
+        std::array<std::array<std::vector<timer_id>, LEVEL_SIZE>, LEVEL_COUNT> m_slots;
+
+        std::thread m_thread;
+
+    public:
+        timer_wheel() = delete;
+        explicit timer_wheel(std::function<void(callback)> dispatch)
+            : m_dispatch(std::move(dispatch)), m_start(std::chrono::steady_clock::now())
+        {
+            m_thread = std::thread([this]
+                                   { this->worker(); });
+        }
+
+        ~timer_wheel() { stop(); }
+
+        // delay后执行cb，停止后返回0且丢弃cb
+        timer_id add(std::chrono::milliseconds delay, callback cb)
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            if (m_stop)
+                return 0;
+
+            // 向上取整，保证不会早于delay触发
+            const auto &elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+            const auto &due = elapsed + std::chrono::duration_cast<std::chrono::microseconds>(std::max(delay, std::chrono::milliseconds(0))).count();
+            const unsigned long long expire = (due + 999) / 1000;
+
+            const auto id = ++m_next_id;
+            m_nodes.emplace(id, node{expire, std::move(cb)});
+            place(id, expire);
+
+            if (expire < m_wake)
+                m_cv.notify_one();
+            return id;
+        }
+
+        // 取消未触发的定时器，已触发或不存在返回false
+        bool cancel(timer_id id)
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            return m_nodes.erase(id) > 0;
+        }
+
+        // 停止驱动线程，未触发的定时器全部丢弃
+        void stop()
+        {
+            std::unordered_map<timer_id, node> nodes;
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                if (m_stop)
+                    return;
+                m_stop = true;
+                m_cv.notify_all();
+            }
+            if (m_thread.joinable())
+                m_thread.join();
+
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                nodes.swap(m_nodes);
+            }
+            // 回调可能持有对象的最后引用，在锁外析构
+        }
+
+    private:
+        unsigned long long now_tick() const
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count();
+        }
+
+        void place(timer_id id, unsigned long long expire)
+        {
+            if (expire < m_tick)
+                expire = m_tick;
+            if (expire - m_tick > MAX_SPAN)
+                expire = m_tick + MAX_SPAN; // 超出范围的先放到最高层，下次降级时重新计算
+
+            int level = 0;
+            while (level + 1 < LEVEL_COUNT && expire - m_tick >= (1ull << (LEVEL_BITS * (level + 1))))
+                ++level;
+            m_slots[level][(expire >> (LEVEL_BITS * level)) & LEVEL_MASK].push_back(id);
+        }
+
+        // 把高层的一个槽降级到低层
+        void cascade(int level, int index)
+        {
+            auto ids = std::move(m_slots[level][index]);
+            m_slots[level][index].clear();
+            for (const auto &id : ids)
+            {
+                auto it = m_nodes.find(id);
+                if (it != m_nodes.end())
+                    place(id, it->second.expire);
+            }
+        }
+
+        // 处理到now为止的所有tick，收集到期的回调
+        void advance(unsigned long long now, std::vector<callback> &due)
+        {
+            for (; m_tick <= now; ++m_tick)
+            {
+                const int index = m_tick & LEVEL_MASK;
+                if (index == 0)
+                {
+                    for (int level = 1; level < LEVEL_COUNT; ++level)
+                    {
+                        const int up = (m_tick >> (LEVEL_BITS * level)) & LEVEL_MASK;
+                        cascade(level, up);
+                        if (up != 0)
+                            break;
+                    }
+                }
+
+                auto ids = std::move(m_slots[0][index]);
+                m_slots[0][index].clear();
+                for (const auto &id : ids)
+                {
+                    auto it = m_nodes.find(id);
+                    if (it == m_nodes.end())
+                        continue;
+                    due.push_back(std::move(it->second.cb));
+                    m_nodes.erase(it);
+                }
+            }
+        }
+
+        // 下一个需要处理的tick：最近的非空槽，或者下一次降级的时刻
+        unsigned long long next_tick() const
+        {
+            for (int i = 0; i < LEVEL_SIZE; ++i)
+            {
+                const auto &tick = m_tick + i;
+                if (i > 0 && (tick & LEVEL_MASK) == 0)
+                    return tick;
+                if (!m_slots[0][tick & LEVEL_MASK].empty())
+                    return tick;
+            }
+            return m_tick + LEVEL_SIZE;
+        }
+
+        void worker()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stop)
+            {
+                std::vector<callback> due;
+                const auto &now = now_tick();
+                if (m_nodes.empty())
+                    m_tick = std::max(m_tick, now + 1); // 没有定时器，直接跳过空转的tick
+                else
+                    advance(now, due);
+
+                if (!due.empty())
+                {
+                    lock.unlock();
+                    for (auto &cb : due)
+                        m_dispatch(std::move(cb));
+                    due.clear();
+                    lock.lock();
+                    continue;
+                }
+
+                if (m_nodes.empty())
+                {
+                    m_wake = std::numeric_limits<unsigned long long>::max();
+                    m_cv.wait(lock, [this]
+                              { return m_stop || !m_nodes.empty(); });
+                }
+                else
+                {
+                    m_wake = next_tick();
+                    m_cv.wait_until(lock, m_start + std::chrono::milliseconds(m_wake));
+                }
+            }
+        }
+    };
+}
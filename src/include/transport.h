@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "message.h"
+#include "noncopyable.h"
+#include "thread_pool.h"
+
+namespace raft
+{
+    // server之间收发消息的方式
+    // 本进程的server用Bind登记接收函数，消息在目标server所在的分片上执行
+    // Send不阻塞，对方不在或连接断开时直接丢弃，由raft的超时重传处理
+    class transport : public noncopyable
+    {
+    public:
+        using handler = std::function<void(message)>;
+
+    private:
+        // 接收函数表是不可变的快照，登记时复制一份再整体替换，查找不加锁
+        struct table
+        {
+            std::vector<int> ids; // 有序
+            std::vector<std::shared_ptr<const handler>> handlers;
+        };
+        std::mutex m_mutex; // 只有登记加锁
+        std::atomic<std::shared_ptr<const table>> m_table{std::make_shared<const table>()};
+
+    public:
+        virtual ~transport() = default;
+
+        // 同一个id再次登记则替换
+        void Bind(int id, handler h)
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            auto next = std::make_shared<table>(*m_table.load());
+            const auto &pos = std::lower_bound(next->ids.begin(), next->ids.end(), id) - next->ids.begin();
+            auto value = std::make_shared<const handler>(std::move(h));
+            if (pos < (int)next->ids.size() && next->ids[pos] == id)
+            {
+                next->handlers[pos] = std::move(value);
+            }
+            else
+            {
+                next->ids.insert(next->ids.begin() + pos, id);
+                next->handlers.insert(next->handlers.begin() + pos, std::move(value));
+            }
+            m_table.store(std::move(next));
+        }
+
+        void Unbind(int id)
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            auto next = std::make_shared<table>(*m_table.load());
+            const auto &it = std::lower_bound(next->ids.begin(), next->ids.end(), id);
+            if (it == next->ids.end() || *it != id)
+                return;
+            next->handlers.erase(next->handlers.begin() + (it - next->ids.begin()));
+            next->ids.erase(it);
+            m_table.store(std::move(next));
+        }
+
+        virtual void Send(int to, message msg, lane l = lane::data) = 0;
+
+    protected:
+        // 交给本进程的server，没有登记返回false
+        bool Deliver(int to, message &msg, lane l)
+        {
+            const auto &t = m_table.load(std::memory_order_acquire);
+            const auto &it = std::lower_bound(t->ids.begin(), t->ids.end(), to);
+            if (it == t->ids.end() || *it != to)
+                return false;
+            thread_pool::get(0).post_to(to, l, [h = t->handlers[it - t->ids.begin()], msg = std::move(msg)]() mutable
+                                        { (*h)(std::move(msg)); });
+            return true;
+        }
+    };
+
+    // 进程内的直接调用，不编码
+    class local_transport : public transport
+    {
+    public:
+        void Send(int to, message msg, lane l = lane::data) override { Deliver(to, msg, l); }
+    };
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 分段的预写日志，持久化任期、投票、日志和快照
+    // 写入先进入内存批次，由线程池中的落盘任务一次write+fdatasync（组提交），落盘任务不在分片所属的线程上执行
+    // 快照落盘后，日志都在快照之内的旧段文件被删除
+    class wal : public std::enable_shared_from_this<wal>, noncopyable
+    {
+    public:
+        struct Options
+        {
+            std::string dir;                        // 目录
+            size_t segment_size = 64 << 20;         // 单个段文件的大小上限
+            size_t max_batch_bytes = 1 << 20;       // 攒够这么多字节立即落盘
+            std::chrono::milliseconds max_delay{0}; // 组提交最多等待的时间，0则上一次落盘结束就继续
+        };
+
+        using snapshot_handler = std::function<void(int index, int term, buffer data)>;
+        using state_handler = std::function<void(int term, int votedfor)>;
+        using log_handler = std::function<void(int index, int term, bool is_server, buffer content)>;
+
+    private:
+        std::mutex m_mutex;
+        const Options m_options;
+        std::string m_pending;                        // 待落盘的记录
+        std::string m_pending_state;                  // 待落盘记录中最新的任期和投票
+        int m_pending_index = -1;                     // 待落盘记录中日志的最大索引
+        std::vector<std::function<void()>> m_waiters; // 待落盘后的回调
+        bool m_flushing = false;                      // 落盘任务已提交或正在执行
+
+        struct Snapshot
+        {
+            int index = -1;
+            int term = 0;
+            buffer data;
+        };
+        Snapshot m_pending_snapshot; // 待落盘的快照，只保留最新的
+
+        // 只由落盘任务访问
+        int m_fd = -1;
+        unsigned long long m_segment_seq = 0;
+        size_t m_segment_bytes = 0;
+        std::string m_state_record;                         // 最新的任期和投票，写在每个新段的开头
+        std::map<unsigned long long, int> m_segment_index; // 每个段中日志的最大索引
+
+    public:
+        wal() = delete;
+        explicit wal(Options options);
+        ~wal();
+
+        // 先回放最新的快照，再按写入顺序回放已有数据，之后的写入追加到新的段文件
+        bool Load(const snapshot_handler &on_snapshot, const state_handler &on_state, const log_handler &on_log);
+
+        void SaveState(int term, int votedfor);
+        void SaveLog(int index, int term, bool is_server, const buffer &content); // index及之后的旧日志作废
+        void SaveSnapshot(int index, int term, buffer data);                      // 包含index及之前的所有日志
+
+        // 之前写入的数据全部落盘后调用done，没有待落盘的数据时在当前线程直接调用
+        void Sync(std::function<void()> done);
+
+    private:
+        void Schedule();
+        void Flush();
+        void Write(const std::string &data, const std::string &state, int index);
+        void WriteSnapshot(const Snapshot &snapshot);
+        void OpenSegment();
+    };
+}
@@ -0,0 +1,675 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "noncopyable.h"
+#include "spsc_queue.h"
+
+namespace raft
+{
+    // Chase-Lev双端队列，所属线程在底部放入和取出（后进先出），其他线程从顶部偷（先进先出）
+    // T必须可以平凡复制（指针、协程句柄）
+    template <typename T>
+    class chase_lev_deque : public noncopyable
+    {
+    private:
+        struct array
+        {
+            explicit array(long long n) : cap(n), mask(n - 1), buf(new std::atomic<T>[n]) {}
+
+            const long long cap;
+            const long long mask;
+            std::unique_ptr<std::atomic<T>[]> buf;
+
+            T get(long long i) const { return buf[i & mask].load(std::memory_order_relaxed); }
+            void put(long long i, T e) { buf[i & mask].store(e, std::memory_order_relaxed); }
+        };
+
+        alignas(64) std::atomic<long long> m_top{0};
+        alignas(64) std::atomic<long long> m_bottom{0};
+        std::atomic<array *> m_array;
+        std::vector<std::unique_ptr<array>> m_arrays; // 扩容前的数组可能还在被偷取的线程读，析构时才释放
+
+    public:
+        explicit chase_lev_deque(long long cap = 256)
+        {
+            m_arrays.emplace_back(new array(cap));
+            m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+        }
+
+        bool empty() const { return m_bottom.load(std::memory_order_acquire) <= m_top.load(std::memory_order_acquire); }
+
+        // 只能由所属线程调用
+        void push(T e)
+        {
+            const auto b = m_bottom.load(std::memory_order_relaxed);
+            const auto t = m_top.load(std::memory_order_acquire);
+            auto a = m_array.load(std::memory_order_relaxed);
+            if (b - t > a->cap - 1)
+            {
+                auto bigger = new array(a->cap * 2);
+                for (auto i = t; i < b; ++i)
+                    bigger->put(i, a->get(i));
+                m_arrays.emplace_back(bigger);
+                m_array.store(bigger, std::memory_order_release);
+                a = bigger;
+            }
+            a->put(b, e);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // 只能由所属线程调用
+        std::optional<T> pop()
+        {
+            const auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+            const auto a = m_array.load(std::memory_order_relaxed);
+            m_bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto t = m_top.load(std::memory_order_relaxed);
+
+            if (t > b)
+            {
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+                return {};
+            }
+
+            T e = a->get(b);
+            if (t == b)
+            {
+                // 最后一个，和偷取的线程竞争
+                const bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+                if (!won)
+                    return {};
+            }
+            return e;
+        }
+
+        // 任意线程调用，竞争失败也返回空
+        std::optional<T> steal()
+        {
+            auto t = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const auto b = m_bottom.load(std::memory_order_acquire);
+            if (t >= b)
+                return {};
+
+            const auto a = m_array.load(std::memory_order_acquire);
+            T e = a->get(t);
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return {};
+            return e;
+        }
+    };
+
+    // 只增长不收缩的环形队列，由使用者加锁，容量稳定后放入取出都不分配内存
+    template <typename T>
+    class ring_queue
+    {
+    private:
+        std::vector<T> m_buf;
+        size_t m_head = 0;
+        size_t m_size = 0;
+
+    public:
+        bool empty() const { return m_size == 0; }
+
+        void push_back(T e)
+        {
+            if (m_size == m_buf.size())
+            {
+                std::vector<T> bigger(std::max<size_t>(16, m_buf.size() * 2));
+                for (size_t i = 0; i < m_size; ++i)
+                    bigger[i] = m_buf[(m_head + i) & (m_buf.size() - 1)];
+                m_buf.swap(bigger);
+                m_head = 0;
+            }
+            m_buf[(m_head + m_size) & (m_buf.size() - 1)] = e;
+            ++m_size;
+        }
+
+        T pop_front()
+        {
+            T e = m_buf[m_head];
+            m_head = (m_head + 1) & (m_buf.size() - 1);
+            --m_size;
+            return e;
+        }
+
+        // 全部取出追加到out
+        void drain_to(std::vector<T> &out)
+        {
+            while (!empty())
+                out.push_back(pop_front());
+        }
+    };
+
+    // 任务的车道，控制面（投票、心跳、定时器）总是先于数据面（日志复制等）调度
+    enum class lane
+    {
+        control = 0,
+        data = 1,
+    };
+
+    // 工作窃取的任务队列
+    // 每个工作线程有自己的Chase-Lev队列，工作线程放入的任务进自己的队列（后进先出，缓存热）
+    // 外部线程放入的任务进全局队列，工作线程自己没有任务时先取全局队列，再随机偷其他线程的
+    // 都没有时休眠，放入任务时只在有线程休眠时才唤醒
+    // 全局队列默认不限长度（加锁），指定容量时换成有界无锁队列，满时外部线程的put阻塞、try_put失败
+    // 工作线程自己的队列不限长度，工作线程不会因为队列满而阻塞（它们就是消费者）
+    // 工作线程数可以变化：构造时按最多的线程数准备队列，retire让空闲的线程退出
+    // 控制面的任务单独一个不限长度的全局队列，工作线程优先取，连续取CONTROL_BURST个后先看一次数据面，数据面不会饿死
+    // 可以分出若干分片，第i个分片的任务只由第i个工作线程执行，不被偷走，该线程也不会退出
+    // 工作线程发往分片的任务走两者之间的单生产者单消费者通道，外部线程和通道满时走分片的加锁收件箱
+    // 会长时间阻塞的任务用put_general放入，只由不属于分片的线程执行，不耽误分片的任务
+    template <typename T>
+    class work_stealing_queue : public noncopyable
+    {
+    private:
+        std::vector<std::unique_ptr<chase_lev_deque<T>>> m_workers;
+
+        // 一个分片，由同序号的工作线程消费
+        struct shard
+        {
+            std::vector<std::atomic<spsc_queue<T> *>> channels; // 按发送的工作线程，第一次发送时由发送者创建
+            std::vector<std::unique_ptr<spsc_queue<T>>> owned;   // 析构时释放channels
+            std::mutex mutex;
+            ring_queue<T> inbox;               // 外部线程的任务和通道满时溢出的任务
+            std::atomic<int> size{0};          // 通道和收件箱里的任务数，为0时不扫描
+            std::atomic<bool> parked{false};   // 所属线程正在（准备）休眠
+            int next = 0;                      // 下次从哪个通道开始取，轮流取避免饿死
+
+            explicit shard(int worker_num) : channels(worker_num), owned(worker_num) {}
+        };
+        std::vector<std::unique_ptr<shard>> m_shards;
+
+        std::unique_ptr<bounded_queue<T>> m_bounded; // 有界的全局队列，为空则用m_inject
+
+        static constexpr int CONTROL_BURST = 8;
+        std::mutex m_control_mutex;
+        ring_queue<T> m_control;            // 控制面的全局队列
+        std::atomic<int> m_control_size{0}; // 控制面队列为空时不加锁
+
+        std::mutex m_general_mutex;
+        ring_queue<T> m_general;            // 只由不属于分片的线程执行的任务
+        std::atomic<int> m_general_size{0}; // 为空时不加锁
+
+        std::mutex m_mutex;
+        ring_queue<T> m_inject;               // 全局队列
+        std::atomic<int> m_inject_size{0};    // 全局队列为空时不加锁
+        std::atomic<int> m_sleepers{0};       // 正在休眠（或准备休眠）的工作线程数
+        std::atomic<int> m_retire{0};         // 还要退出的工作线程数，空闲的线程领取后退出
+        std::atomic<unsigned int> m_epoch{0}; // 每次唤醒+1，休眠的线程等它变化
+        std::atomic<bool> m_stop{false};
+
+        // 当前线程是哪个队列的第几个工作线程
+        struct worker_slot
+        {
+            const void *owner = nullptr;
+            int index = -1;
+            unsigned int seed = 0;
+            int burst = 0; // 连续取了多少个控制面任务
+        };
+        static worker_slot &local()
+        {
+            thread_local worker_slot slot;
+            return slot;
+        }
+
+    public:
+        // inject_capacity为0时全局队列不限长度，shard_num不超过worker_num
+        explicit work_stealing_queue(int worker_num, size_t inject_capacity = 0, int shard_num = 0)
+        {
+            for (int i = 0; i < worker_num; ++i)
+                m_workers.emplace_back(new chase_lev_deque<T>());
+            if (inject_capacity > 0)
+                m_bounded.reset(new bounded_queue<T>(inject_capacity));
+            for (int i = 0; i < std::min(shard_num, worker_num); ++i)
+                m_shards.emplace_back(new shard(worker_num));
+        }
+
+        int shards() const { return (int)m_shards.size(); }
+
+        // 放入第s个分片，不受全局队列容量限制，停止后返回false，任务没有放入
+        bool put_to(int s, T e)
+        {
+            if (m_stop.load(std::memory_order_relaxed))
+                return false;
+
+            auto &sh = *m_shards[s];
+            sh.size.fetch_add(1, std::memory_order_relaxed); // 先计数再放入，取的线程不会减成负数
+            const auto &slot = local();
+            bool sent = false;
+            if (slot.owner == this)
+            {
+                auto ch = sh.channels[slot.index].load(std::memory_order_relaxed);
+                if (!ch)
+                {
+                    ch = new spsc_queue<T>();
+                    sh.owned[slot.index].reset(ch);
+                    sh.channels[slot.index].store(ch, std::memory_order_release);
+                }
+                sent = ch->try_push(e);
+            }
+            if (!sent)
+            {
+                std::unique_lock<std::mutex> _(sh.mutex);
+                sh.inbox.push_back(e);
+            }
+
+            // 与take的先登记休眠再检查一次配对；别的线程取不了分片的任务，只能叫醒所属的线程
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sh.parked.load(std::memory_order_relaxed))
+            {
+                m_epoch.fetch_add(1, std::memory_order_seq_cst);
+                m_epoch.notify_all();
+            }
+            return true;
+        }
+
+        // 放入只由不属于分片的线程执行的任务（会长时间阻塞的，如磁盘同步），分片所属的线程不取，不占用分片的控制面
+        // 不受全局队列容量限制，停止后返回false；不分片时同put
+        bool put_general(T e)
+        {
+            if (shards() == 0)
+                return put(e);
+            if (m_stop.load(std::memory_order_relaxed))
+                return false;
+
+            {
+                std::unique_lock<std::mutex> _(m_general_mutex);
+                m_general.push_back(e);
+                m_general_size.fetch_add(1, std::memory_order_relaxed);
+            }
+            // 叫醒一个可能是分片所属的线程，取不了又睡下，所以全部叫醒
+            wake(m_workers.size());
+            return true;
+        }
+
+        // 全局队列满时阻塞，停止后返回false，任务没有放入
+        bool put(T e, lane l = lane::data) { return push(e, true, l); }
+
+        // 全局队列满或已停止时返回false，任务没有放入
+        bool try_put(T e, lane l = lane::data) { return push(e, false, l); }
+
+        // 一次放入多个任务，全局队列只加一次锁，按任务数唤醒休眠的工作线程
+        // 返回放入的个数，停止后剩下的没有放入
+        size_t put_bulk(const std::vector<T> &tasks, lane l = lane::data)
+        {
+            if (tasks.empty() || m_stop.load(std::memory_order_relaxed))
+                return 0;
+
+            auto n = tasks.size();
+            const auto &slot = local();
+            if (l == lane::control)
+            {
+                std::unique_lock<std::mutex> _(m_control_mutex);
+                for (const auto &e : tasks)
+                    m_control.push_back(e);
+                m_control_size.fetch_add((int)n, std::memory_order_relaxed);
+            }
+            else if (slot.owner == this)
+            {
+                for (const auto &e : tasks)
+                    m_workers[slot.index]->push(e);
+            }
+            else if (m_bounded)
+            {
+                // 满时要先叫醒工作线程来取，再阻塞
+                n = 0;
+                for (const auto &e : tasks)
+                {
+                    if (!m_bounded->try_put(e))
+                    {
+                        wake(n + 1);
+                        if (!m_bounded->put(e))
+                            break;
+                    }
+                    ++n;
+                }
+            }
+            else
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                for (const auto &e : tasks)
+                    m_inject.push_back(e);
+                m_inject_size.fetch_add((int)n, std::memory_order_relaxed);
+            }
+            wake(n);
+            return n;
+        }
+
+        // 第index个工作线程取任务，没有任务时休眠，停止或领取到退出时返回空
+        // index可以在线程退出后给新的线程使用，线程退出时自己的队列一定是空的
+        std::optional<T> take(int index)
+        {
+            auto &slot = local();
+            if (slot.owner != this)
+                slot = worker_slot{this, index, (unsigned int)index * 2654435761u + 1, 0};
+
+            while (!m_stop.load(std::memory_order_acquire))
+            {
+                if (auto e = find(index))
+                    return e;
+
+                // 先登记休眠再检查一次，与put的先放入再检查休眠数配对，不会丢失唤醒
+                Park(index, true);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const auto &epoch = m_epoch.load(std::memory_order_seq_cst);
+                if (m_stop.load(std::memory_order_acquire))
+                {
+                    Park(index, false);
+                    break;
+                }
+                if (auto e = find(index))
+                {
+                    Park(index, false);
+                    // 可能还有任务，让下一个线程也起来看看
+                    wake();
+                    return e;
+                }
+                // 分片所属的线程不退出
+                if (index >= shards() && TakeRetire())
+                {
+                    Park(index, false);
+                    break;
+                }
+                m_epoch.wait(epoch, std::memory_order_seq_cst);
+                Park(index, false);
+            }
+            return {};
+        }
+
+        bool stopped() const { return m_stop.load(std::memory_order_acquire); }
+        int sleepers() const { return m_sleepers.load(std::memory_order_relaxed); }
+        int retiring() const { return m_retire.load(std::memory_order_relaxed); }
+
+        // 休眠的线程里不属于分片的个数（近似），只有它们会领取退出
+        int idle_general() const
+        {
+            auto n = m_sleepers.load(std::memory_order_relaxed);
+            for (const auto &sh : m_shards)
+            {
+                if (sh->parked.load(std::memory_order_relaxed))
+                    --n;
+            }
+            return std::max(n, 0);
+        }
+
+        // 是否有任意线程都能执行的等待任务（近似），分片的任务增加线程也帮不上，不算
+        bool has_pending() const
+        {
+            if (m_control_size.load(std::memory_order_relaxed) > 0 || m_inject_size.load(std::memory_order_relaxed) > 0)
+                return true;
+            if (m_bounded && !m_bounded->empty())
+                return true;
+            for (const auto &w : m_workers)
+            {
+                if (!w->empty())
+                    return true;
+            }
+            return false;
+        }
+
+        // 是否有只能由不属于分片的线程执行的等待任务（近似）
+        bool has_general_pending() const { return m_general_size.load(std::memory_order_relaxed) > 0; }
+
+        // 让n个空闲的工作线程退出
+        void retire(int n)
+        {
+            m_retire.fetch_add(n, std::memory_order_seq_cst);
+            m_epoch.fetch_add(1, std::memory_order_seq_cst);
+            m_epoch.notify_all();
+        }
+
+        // 取消还没有线程领取的退出，返回取消的个数
+        int cancel_retire() { return m_retire.exchange(0, std::memory_order_relaxed); }
+
+        // 唤醒所有工作线程，之后take返回空，put返回false
+        void stop()
+        {
+            m_stop.store(true, std::memory_order_seq_cst);
+            m_epoch.fetch_add(1, std::memory_order_seq_cst);
+            m_epoch.notify_all();
+            if (m_bounded)
+                m_bounded->destroy(); // 阻塞在put上的外部线程返回
+        }
+
+        // 工作线程全部退出后取出剩余的任务
+        std::vector<T> drain()
+        {
+            std::vector<T> ret;
+            {
+                std::unique_lock<std::mutex> _(m_control_mutex);
+                m_control.drain_to(ret);
+                m_control_size.store(0, std::memory_order_relaxed);
+            }
+            if (m_bounded)
+            {
+                while (auto e = m_bounded->try_take())
+                    ret.push_back(e.value());
+            }
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                m_inject.drain_to(ret);
+                m_inject_size.store(0, std::memory_order_relaxed);
+            }
+            {
+                std::unique_lock<std::mutex> _(m_general_mutex);
+                m_general.drain_to(ret);
+                m_general_size.store(0, std::memory_order_relaxed);
+            }
+            for (auto &w : m_workers)
+            {
+                while (auto e = w->steal())
+                    ret.push_back(e.value());
+            }
+            for (int s = 0; s < shards(); ++s)
+            {
+                while (auto e = TakeShard(s))
+                    ret.push_back(e.value());
+            }
+            return ret;
+        }
+
+    private:
+        bool push(T e, bool block, lane l)
+        {
+            if (m_stop.load(std::memory_order_relaxed))
+                return false;
+
+            const auto &slot = local();
+            if (l == lane::control)
+            {
+                // 工作线程的也放全局队列，不排在它自己的数据面任务后面
+                std::unique_lock<std::mutex> _(m_control_mutex);
+                m_control.push_back(e);
+                m_control_size.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (slot.owner == this)
+            {
+                m_workers[slot.index]->push(e);
+            }
+            else if (m_bounded)
+            {
+                if (!(block ? m_bounded->put(e) : m_bounded->try_put(e)))
+                    return false;
+            }
+            else
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                m_inject.push_back(e);
+                m_inject_size.fetch_add(1, std::memory_order_relaxed);
+            }
+            wake();
+            return true;
+        }
+
+        // 最多唤醒n个休眠的工作线程
+        void wake(size_t n = 1)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const auto &sleepers = m_sleepers.load(std::memory_order_relaxed);
+            if (sleepers <= 0 || n == 0)
+                return;
+
+            m_epoch.fetch_add(1, std::memory_order_seq_cst);
+            if (n >= (size_t)sleepers)
+            {
+                m_epoch.notify_all();
+                return;
+            }
+            for (size_t i = 0; i < n; ++i)
+                m_epoch.notify_one();
+        }
+
+        void Park(int index, bool parked)
+        {
+            if (parked)
+                m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+            else
+                m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            if (index < shards())
+                m_shards[index]->parked.store(parked, std::memory_order_seq_cst);
+        }
+
+        // 分片的任务排在控制面之后、数据面之前；不属于分片的线程在同样的位置取只由它们执行的任务
+        std::optional<T> find(int index)
+        {
+            auto &slot = local();
+            if (slot.burst < CONTROL_BURST)
+            {
+                if (auto e = TakeControl())
+                {
+                    ++slot.burst;
+                    return e;
+                }
+            }
+            slot.burst = 0;
+            if (index < shards())
+            {
+                if (auto e = TakeShard(index))
+                    return e;
+            }
+            else if (auto e = TakeGeneral())
+            {
+                return e;
+            }
+            if (auto e = FindData(index))
+                return e;
+            return TakeControl();
+        }
+
+        // 只能由分片所属的线程（或停止后的drain）调用
+        std::optional<T> TakeShard(int s)
+        {
+            auto &sh = *m_shards[s];
+            if (sh.size.load(std::memory_order_relaxed) <= 0)
+                return {};
+
+            const auto &n = (int)sh.channels.size();
+            for (int i = 0; i < n; ++i)
+            {
+                const auto &from = (sh.next + i) % n;
+                auto ch = sh.channels[from].load(std::memory_order_acquire);
+                if (!ch)
+                    continue;
+                if (auto e = ch->try_pop())
+                {
+                    sh.next = (from + 1) % n;
+                    sh.size.fetch_sub(1, std::memory_order_relaxed);
+                    return e;
+                }
+            }
+
+            std::unique_lock<std::mutex> _(sh.mutex);
+            if (sh.inbox.empty())
+                return {};
+            T e = sh.inbox.pop_front();
+            sh.size.fetch_sub(1, std::memory_order_relaxed);
+            return e;
+        }
+
+        std::optional<T> TakeGeneral()
+        {
+            if (m_general_size.load(std::memory_order_relaxed) <= 0)
+                return {};
+            std::unique_lock<std::mutex> _(m_general_mutex);
+            if (m_general.empty())
+                return {};
+            T e = m_general.pop_front();
+            m_general_size.fetch_sub(1, std::memory_order_relaxed);
+            return e;
+        }
+
+        bool TakeRetire()
+        {
+            auto n = m_retire.load(std::memory_order_relaxed);
+            while (n > 0)
+            {
+                if (m_retire.compare_exchange_weak(n, n - 1, std::memory_order_relaxed))
+                    return true;
+            }
+            return false;
+        }
+
+        std::optional<T> TakeControl()
+        {
+            if (m_control_size.load(std::memory_order_relaxed) == 0)
+                return {};
+
+            std::unique_lock<std::mutex> _(m_control_mutex);
+            if (m_control.empty())
+                return {};
+            T e = m_control.pop_front();
+            m_control_size.fetch_sub(1, std::memory_order_relaxed);
+            return e;
+        }
+
+        std::optional<T> FindData(int index)
+        {
+            if (auto e = m_workers[index]->pop())
+                return e;
+
+            if (m_bounded)
+            {
+                if (auto e = m_bounded->try_take())
+                    return e;
+            }
+            else if (m_inject_size.load(std::memory_order_relaxed) > 0)
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                if (!m_inject.empty())
+                {
+                    T e = m_inject.pop_front();
+                    m_inject_size.fetch_sub(1, std::memory_order_relaxed);
+                    return e;
+                }
+            }
+
+            // 从随机位置开始偷一圈
+            const auto &n = (int)m_workers.size();
+            auto &seed = local().seed;
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            const auto &start = (int)(seed % n);
+            for (int i = 0; i < n; ++i)
+            {
+                const auto &victim = (start + i) % n;
+                if (victim == index)
+                    continue;
+                if (auto e = m_workers[victim]->steal())
+                    return e;
+            }
+            return {};
+        }
+    };
+}
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "logger.h"
+#include "noncopyable.h"
+
+namespace raft
+{
+    // 线程池的工作线程，线程数在[min_threads, max_threads]之间伸缩
+    // 工作线程进入阻塞区后不算可运行，可运行的不足min_threads且有任务时补充线程（阻塞补偿）
+    // 有任务等待且没有空闲线程、持续两次检查时增加一个线程；超出min_threads的线程空闲超过idle_timeout时减少一个
+    // 分片所属的线程不退出，只有不属于分片的线程空闲时才减少；积压时取消还没执行的减少
+    // 只能由不属于分片的线程执行的任务在等、又没有这样的空闲线程时，立即增加一个
+    // 由一个监控线程定期检查，伸缩的决定写日志
+    // pin_threads时第index个槽位的线程绑定到进程可用的第index个CPU（超出则取模），分片所属的线程因此固定在一个核上
+    // Q需要提供take(index)、retire(n)、cancel_retire()、retiring()、sleepers()、idle_general()、has_pending()、has_general_pending()、stopped()
+    template <typename Q>
+    class worker_group : public noncopyable
+    {
+    public:
+        struct Options
+        {
+            int min_threads = 4;                           // 常驻的线程数
+            int max_threads = 64;                          // 阻塞补偿和任务积压时最多增加到的线程数
+            std::chrono::milliseconds idle_timeout{5000}; // 超出min_threads的线程空闲这么久后退出
+            std::chrono::milliseconds tick{10};            // 监控线程的检查间隔
+            bool pin_threads = false;                      // 工作线程按槽位绑定CPU
+        };
+
+        struct Stats
+        {
+            int threads = 0;                 // 当前的线程数
+            int blocked = 0;                 // 在阻塞区中的线程数
+            int idle = 0;                    // 空闲（休眠）的线程数
+            unsigned long long grown = 0;    // 累计增加的线程数
+            unsigned long long shrunk = 0;   // 累计减少的线程数
+        };
+
+    private:
+        Q &m_queue;
+        const std::function<void(int)> m_run; // 第index个工作线程的主循环，take返回空时返回
+        const Options m_options;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_stop = false;
+        std::vector<std::thread> m_threads; // 按槽位，退出的线程在槽位复用时回收
+        std::vector<int> m_free;            // 空闲的槽位
+        std::atomic<int> m_active{0};
+        std::atomic<int> m_blocked{0};
+        std::atomic<unsigned long long> m_grown{0};
+        std::atomic<unsigned long long> m_shrunk{0};
+        bool m_backlog = false; // 上次检查时已经积压
+        int m_idle_ticks = 0;   // 连续有空闲线程的检查次数
+        std::vector<int> m_cpus; // pin_threads时可用的CPU
+        std::thread m_monitor;
+
+        static worker_group *&current()
+        {
+            thread_local worker_group *g = nullptr;
+            return g;
+        }
+
+    public:
+        // 槽位数为max_threads，Q要按它准备每个线程的队列
+        worker_group(Q &queue, std::function<void(int)> run, const Options &options)
+            : m_queue(queue), m_run(std::move(run)), m_options(Normalize(options))
+        {
+            if (m_options.pin_threads)
+                m_cpus = AvailableCpus();
+
+            std::unique_lock<std::mutex> _(m_mutex);
+            m_threads.resize(m_options.max_threads);
+            for (int i = m_options.max_threads - 1; i >= 0; --i)
+                m_free.push_back(i);
+            for (int i = 0; i < m_options.min_threads; ++i)
+                Spawn();
+            m_monitor = std::thread([this]
+                                    { Monitor(); });
+        }
+
+        ~worker_group() { stop(); }
+
+        static int slots(const Options &options) { return Normalize(options).max_threads; }
+        const Options &options() const { return m_options; }
+
+        // 队列停止后调用，等所有线程退出
+        void stop()
+        {
+            {
+                std::unique_lock<std::mutex> _(m_mutex);
+                if (m_stop)
+                    return;
+                m_stop = true;
+            }
+            m_cv.notify_all();
+            if (m_monitor.joinable())
+                m_monitor.join();
+
+            // 退出的线程不再修改m_threads
+            for (auto &t : m_threads)
+            {
+                if (t.joinable())
+                    t.join();
+            }
+        }
+
+        Stats stats() const
+        {
+            Stats ret;
+            ret.threads = m_active.load(std::memory_order_relaxed);
+            ret.blocked = m_blocked.load(std::memory_order_relaxed);
+            ret.idle = m_queue.sleepers();
+            ret.grown = m_grown.load(std::memory_order_relaxed);
+            ret.shrunk = m_shrunk.load(std::memory_order_relaxed);
+            return ret;
+        }
+
+        // 工作线程里可能长时间阻塞的调用（等待其他任务、磁盘同步）放在这个作用域里
+        // 不是工作线程时什么也不做
+        class blocking_region : public noncopyable
+        {
+        private:
+            worker_group *m_group;
+
+        public:
+            blocking_region() : m_group(current())
+            {
+                if (!m_group)
+                    return;
+                const auto &blocked = m_group->m_blocked.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (m_group->m_active.load(std::memory_order_relaxed) - blocked < std::max(m_group->m_options.min_threads, 1))
+                    m_group->m_cv.notify_one(); // 立即检查，不等下一次
+            }
+            ~blocking_region()
+            {
+                if (m_group)
+                    m_group->m_blocked.fetch_sub(1, std::memory_order_relaxed);
+            }
+        };
+
+    private:
+        static Options Normalize(Options options)
+        {
+            options.min_threads = std::max(options.min_threads, 0);
+            options.max_threads = std::max({options.max_threads, options.min_threads, 1});
+            options.tick = std::max(options.tick, std::chrono::milliseconds(1));
+            return options;
+        }
+
+        // 持有m_mutex时调用
+        bool Spawn()
+        {
+            if (m_stop || m_free.empty())
+                return false;
+
+            const auto &index = m_free.back();
+            m_free.pop_back();
+            if (m_threads[index].joinable())
+                m_threads[index].join(); // 之前用这个槽位的线程已经退出
+            m_active.fetch_add(1, std::memory_order_relaxed);
+            m_threads[index] = std::thread([this, index]
+                                           {
+                                               current() = this;
+                                               if (!m_cpus.empty())
+                                                   Pin(m_cpus[index % m_cpus.size()]);
+                                               m_run(index);
+                                               Exit(index); });
+            return true;
+        }
+
+        static std::vector<int> AvailableCpus()
+        {
+            std::vector<int> ret;
+#ifdef _WIN32
+            DWORD_PTR process_mask = 0;
+            DWORD_PTR system_mask = 0;
+            if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+            {
+                for (int i = 0; i < (int)sizeof(DWORD_PTR) * 8; ++i)
+                {
+                    if (process_mask & ((DWORD_PTR)1 << i))
+                        ret.push_back(i);
+                }
+            }
+#elif defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            {
+                for (int i = 0; i < CPU_SETSIZE; ++i)
+                {
+                    if (CPU_ISSET(i, &set))
+                        ret.push_back(i);
+                }
+            }
+#endif
+            return ret;
+        }
+
+        // 绑定失败只写日志，不影响运行
+        static void Pin(int cpu)
+        {
+#ifdef _WIN32
+            if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+                RAFT_LOG("thread_pool->pin failed cpu:{}", cpu);
+#elif defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+                RAFT_LOG("thread_pool->pin failed cpu:{}", cpu);
+#else
+            (void)cpu;
+#endif
+        }
+
+        void Exit(int index)
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            m_active.fetch_sub(1, std::memory_order_relaxed);
+            if (!m_stop && !m_queue.stopped())
+                m_free.push_back(index);
+        }
+
+        void Monitor()
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            while (!m_stop)
+            {
+                m_cv.wait_for(_, m_options.tick);
+                if (m_stop || m_queue.stopped())
+                    break;
+                Balance();
+            }
+        }
+
+        // 持有m_mutex时调用
+        void Balance()
+        {
+            const auto &active = m_active.load(std::memory_order_relaxed);
+            const auto &blocked = m_blocked.load(std::memory_order_relaxed);
+            const auto &idle = m_queue.sleepers();
+            const auto &runnable = active - blocked;
+            const auto &pending = m_queue.has_pending();
+            const auto floor = std::max(m_options.min_threads, 1);
+
+            // 阻塞补偿：阻塞的线程不算数，可运行的不够时一次补上
+            if (pending && runnable < floor)
+            {
+                int n = 0;
+                while (runnable + n < floor && Spawn())
+                    ++n;
+                if (n > 0)
+                {
+                    m_grown.fetch_add(n, std::memory_order_relaxed);
+                    RAFT_LOG("thread_pool->grow threads:{} blocked:{} reason:blocked", active + n, blocked);
+                    m_backlog = false;
+                    return;
+                }
+            }
+
+            // 分片所属的线程空闲也帮不上，不等第二次检查
+            if (m_queue.has_general_pending() && m_queue.idle_general() == 0 && Spawn())
+            {
+                m_grown.fetch_add(1, std::memory_order_relaxed);
+                RAFT_LOG("thread_pool->grow threads:{} blocked:{} reason:general", active + 1, blocked);
+                m_backlog = false;
+                return;
+            }
+
+            // 积压：有任务但没有空闲线程，连续两次才增加，避免短暂的高峰
+            if (pending && idle == 0)
+            {
+                // 还没有线程领取的退出不再需要，否则下一个空闲的线程刚增加就退出
+                if (const auto &n = m_queue.cancel_retire(); n > 0)
+                {
+                    m_shrunk.fetch_sub(n, std::memory_order_relaxed);
+                    RAFT_LOG("thread_pool->cancel shrink:{}", n);
+                }
+                if (m_backlog && Spawn())
+                {
+                    m_grown.fetch_add(1, std::memory_order_relaxed);
+                    RAFT_LOG("thread_pool->grow threads:{} blocked:{} reason:backlog", active + 1, blocked);
+                    m_backlog = false;
+                }
+                else
+                {
+                    m_backlog = true;
+                }
+            }
+            else
+            {
+                m_backlog = false;
+            }
+
+            // 空闲：超出min_threads的线程空闲够久，一次退出一个
+            // 只看不属于分片的空闲线程，分片所属的线程空闲时退出会一直等不到线程领取
+            if (m_queue.idle_general() > 0 && runnable > m_options.min_threads && m_queue.retiring() == 0)
+            {
+                if (++m_idle_ticks * m_options.tick >= m_options.idle_timeout)
+                {
+                    m_idle_ticks = 0;
+                    m_queue.retire(1);
+                    m_shrunk.fetch_add(1, std::memory_order_relaxed);
+                    RAFT_LOG("thread_pool->shrink threads:{} idle:{}", active - 1, idle);
+                }
+            }
+            else
+            {
+                m_idle_ticks = 0;
+            }
+        }
+    };
+}
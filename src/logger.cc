@@ -0,0 +1,303 @@
+#include "logger.h"
+
+#include <stdlib.h>
+#include <bit>
+
+raft::logger::logger(size_t ring_size, std::chrono::milliseconds interval)
+    : m_uid([]
+            {
+                static std::atomic<unsigned long long> s_uid{0};
+                return ++s_uid; }()),
+      m_ring_size(std::bit_ceil(std::max(ring_size, MAX_RECORD))),
+      m_interval(interval)
+{
+    m_thread = std::thread([this]
+                           { Run(); });
+}
+
+raft::logger::~logger()
+{
+    Stop();
+}
+
+raft::logger &raft::logger::get()
+{
+    // 不析构：线程池等静态对象析构时仍可能写日志，退出时只停止后台线程
+    static logger *lg = []
+    {
+        auto ret = new logger();
+        std::atexit([]
+                    { get().Stop(); });
+        return ret;
+    }();
+    return *lg;
+}
+
+void raft::logger::SetOutput(FILE *file)
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_file = file;
+}
+
+void raft::logger::Flush()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    // 正在进行的一轮可能已经错过了调用前的记录，再等完整的一轮
+    const auto &target = m_pass + 2;
+    m_flush = std::max(m_flush, target);
+    m_cv.notify_all();
+    m_cv.wait(_, [&]
+              { return m_pass >= target || m_exited; });
+}
+
+void raft::logger::Stop()
+{
+    {
+        std::unique_lock<std::mutex> _(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+unsigned long long raft::logger::Dropped() const
+{
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+bool raft::logger::ring::Push(const char *rec, size_t size)
+{
+    const auto &t = tail.load(std::memory_order_relaxed);
+    if (t + size - cached_head > data.size())
+    {
+        cached_head = head.load(std::memory_order_acquire);
+        if (t + size - cached_head > data.size())
+            return false;
+    }
+
+    const auto &pos = t & mask;
+    const auto first = std::min(size, data.size() - pos);
+    memcpy(&data[pos], rec, first);
+    memcpy(&data[0], rec + first, size - first);
+    tail.store(t + size, std::memory_order_release);
+    return true;
+}
+
+void raft::logger::ring::Copy(size_t pos, char *dst, size_t size) const
+{
+    pos &= mask;
+    const auto first = std::min(size, data.size() - pos);
+    memcpy(dst, &data[pos], first);
+    memcpy(dst + first, &data[0], size - first);
+}
+
+void raft::logger::Write(const char *rec, size_t size)
+{
+    // 线程第一次写这个logger时创建缓冲区，线程退出时标记关闭，后台线程输出完后释放
+    struct entry
+    {
+        unsigned long long uid = 0;
+        std::shared_ptr<ring> r;
+    };
+    struct thread_rings
+    {
+        std::vector<entry> vec;
+        ~thread_rings()
+        {
+            for (const auto &e : vec)
+                e.r->closed.store(true, std::memory_order_release);
+        }
+    };
+    thread_local thread_rings t;
+
+    ring *r = nullptr;
+    for (const auto &e : t.vec)
+    {
+        if (e.uid == m_uid)
+        {
+            r = e.r.get();
+            break;
+        }
+    }
+    if (!r)
+    {
+        auto tmp = std::make_shared<ring>(m_ring_size);
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            m_rings.push_back(tmp);
+        }
+        t.vec.push_back({m_uid, tmp});
+        r = tmp.get();
+    }
+
+    if (!r->Push(rec, size))
+    {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void raft::logger::Run()
+{
+    std::string out;
+    while (true)
+    {
+        bool stop = false;
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            m_cv.wait_for(_, m_interval, [this]
+                          { return m_pass < m_flush || m_stop; });
+            stop = m_stop;
+        }
+
+        Drain(out);
+
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            if (!out.empty())
+            {
+                fwrite(out.data(), 1, out.size(), m_file);
+                fflush(m_file);
+            }
+            ++m_pass;
+            m_exited = stop;
+        }
+        out.clear();
+        m_cv.notify_all();
+
+        if (stop)
+            break;
+    }
+}
+
+void raft::logger::Drain(std::string &out)
+{
+    std::vector<std::shared_ptr<ring>> rings;
+    {
+        std::unique_lock<std::mutex> _(m_mutex);
+        rings = m_rings;
+    }
+
+    // 取出每个缓冲区已有的记录，各自是有序的，合并后按时间排序
+    m_batch.clear();
+    m_order.clear();
+    bool has_closed = false;
+    for (const auto &r : rings)
+    {
+        has_closed = has_closed || r->closed.load(std::memory_order_acquire);
+        auto h = r->head.load(std::memory_order_relaxed);
+        const auto &t = r->tail.load(std::memory_order_acquire);
+        while (h != t)
+        {
+            header hd;
+            r->Copy(h, (char *)&hd, sizeof(hd));
+            const auto &pos = m_batch.size();
+            m_batch.resize(pos + hd.size);
+            r->Copy(h, m_batch.data() + pos, hd.size);
+            m_order.emplace_back(hd.time, pos);
+            h += hd.size;
+        }
+        r->head.store(h, std::memory_order_release);
+    }
+
+    std::stable_sort(m_order.begin(), m_order.end(), [](const auto &a, const auto &b)
+                     { return a.first < b.first; });
+    for (const auto &[time, pos] : m_order)
+        Format(m_batch.data() + pos, out);
+
+    for (const auto &r : rings)
+    {
+        const auto &dropped = r->dropped.load(std::memory_order_relaxed);
+        if (dropped != r->reported)
+        {
+            const auto &now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            out += "[" + std::to_string(now) + "] logger->dropped " + std::to_string(dropped - r->reported) + " records\n";
+            r->reported = dropped;
+        }
+    }
+
+    // 线程已退出且记录已输出的缓冲区不再需要
+    if (has_closed)
+    {
+        std::unique_lock<std::mutex> _(m_mutex);
+        std::erase_if(m_rings, [](const auto &r)
+                      { return r->closed.load(std::memory_order_acquire) && r->head.load(std::memory_order_relaxed) == r->tail.load(std::memory_order_acquire); });
+    }
+}
+
+void raft::logger::Format(const char *rec, std::string &out)
+{
+    header h;
+    memcpy(&h, rec, sizeof(h));
+    const char *p = rec + sizeof(h);
+    const char *end = rec + h.size;
+
+    out += "[";
+    out += std::to_string(h.time);
+    out += "] ";
+    for (const char *f = h.site->fmt; *f; ++f)
+    {
+        if (f[0] != '{' || f[1] != '}' || p >= end)
+        {
+            out += *f;
+            continue;
+        }
+        ++f;
+
+        const auto &t = (tag)*p++;
+        switch (t)
+        {
+        case TAG_INT:
+        {
+            long long v = 0;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            out += std::to_string(v);
+            break;
+        }
+        case TAG_UINT:
+        {
+            unsigned long long v = 0;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            out += std::to_string(v);
+            break;
+        }
+        case TAG_DOUBLE:
+        {
+            double v = 0;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%g", v);
+            out += buf;
+            break;
+        }
+        case TAG_CHAR:
+            out += *p++;
+            break;
+        case TAG_STRING:
+        {
+            uint16_t len = 0;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            out.append(p, len);
+            p += len;
+            break;
+        }
+        case TAG_LITERAL:
+        {
+            const char *v = nullptr;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            out += v;
+            break;
+        }
+        default:
+            p = end; // 不认识的参数，后面的都无法解析
+            break;
+        }
+    }
+    out += "\n";
+}
@@ -0,0 +1,327 @@
+#include "message.h"
+
+#include <limits>
+
+namespace
+{
+    // 格式：[版本 varint][类型 varint][字段...]
+    // 整数都是变长编码（有符号的先zigzag），小的数只占一个字节
+    // AppendEntriesArgs的日志：[条数]，每条[index与上一条的差][term与上一条的差][内容长度<<1|is_server]，第一条与pre_log比较
+    // 同一批日志的索引连续、任期基本相同，每条的头通常只有3个字节
+    // head之后按顺序是各条日志的内容或快照数据
+    enum MessageType : unsigned char
+    {
+        VOTE_ARGS = 1,
+        VOTE_REPLY = 2,
+        APPEND_ENTRIES_ARGS = 3,
+        APPEND_ENTRIES_REPLY = 4,
+        INSTALL_SNAPSHOT_ARGS = 5,
+        INSTALL_SNAPSHOT_REPLY = 6,
+        READ_INDEX_ARGS = 7,
+        READ_INDEX_REPLY = 8,
+    };
+
+    void PutVarint(std::string &data, unsigned long long v)
+    {
+        while (v >= 0x80)
+        {
+            data.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        data.push_back((char)v);
+    }
+
+    void PutInt(std::string &data, long long v)
+    {
+        PutVarint(data, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+    }
+
+    // 顺序读取，越界或格式错误后所有读取都失败
+    class reader
+    {
+    private:
+        const raft::buffer &m_data;
+        size_t m_pos = 0;
+        bool m_ok = true;
+
+    public:
+        explicit reader(const raft::buffer &data) : m_data(data) {}
+
+        bool ok() const { return m_ok; }
+        size_t remain() const { return m_data.size() - m_pos; }
+
+        unsigned long long Varint()
+        {
+            unsigned long long v = 0;
+            for (int shift = 0; shift < 64 && m_pos < m_data.size(); shift += 7)
+            {
+                const auto &c = (unsigned char)m_data.data()[m_pos++];
+                v |= (unsigned long long)(c & 0x7F) << shift;
+                if (!(c & 0x80))
+                    return v;
+            }
+            m_ok = false;
+            return 0;
+        }
+
+        int Int()
+        {
+            const auto &v = Varint();
+            return (int)(long long)((v >> 1) ^ (~(v & 1) + 1));
+        }
+
+        bool Bool() { return Varint() != 0; }
+
+        // 内容引用接收缓冲区，不复制
+        raft::buffer Bytes(size_t len)
+        {
+            if (!m_ok || remain() < len)
+            {
+                m_ok = false;
+                return raft::buffer();
+            }
+            const auto &ret = m_data.slice(m_pos, len);
+            m_pos += len;
+            return ret;
+        }
+    };
+}
+
+void raft::Encode(const message &msg, std::string &head, std::vector<buffer> &contents)
+{
+    PutVarint(head, WIRE_VERSION);
+    if (const auto *m = std::get_if<VoteArgs>(&msg))
+    {
+        PutVarint(head, VOTE_ARGS);
+        PutInt(head, m->term);
+        PutInt(head, m->candidate_id);
+        PutInt(head, m->last_log_index);
+        PutInt(head, m->last_log_term);
+    }
+    else if (const auto *m = std::get_if<VoteReply>(&msg))
+    {
+        PutVarint(head, VOTE_REPLY);
+        PutInt(head, m->id);
+        PutInt(head, m->term);
+        PutVarint(head, m->vote_granted);
+    }
+    else if (const auto *m = std::get_if<AppendEntriesArgs>(&msg))
+    {
+        PutVarint(head, APPEND_ENTRIES_ARGS);
+        PutInt(head, m->term);
+        PutInt(head, m->leader_id);
+        PutInt(head, m->pre_log_index);
+        PutInt(head, m->pre_log_term);
+        PutInt(head, m->commit_index);
+        PutInt(head, m->epoch);
+        PutInt(head, m->read_seq);
+        PutVarint(head, m->log_vec.size());
+
+        head.reserve(head.size() + m->log_vec.size() * 4);
+        long long index = m->pre_log_index;
+        long long term = m->pre_log_term;
+        for (const auto &log : m->log_vec)
+        {
+            PutInt(head, log.index - index);
+            PutInt(head, log.term - term);
+            PutVarint(head, (unsigned long long)log.content.size() << 1 | (log.is_server ? 1 : 0));
+            index = log.index;
+            term = log.term;
+            if (!log.content.empty())
+                contents.push_back(log.content);
+        }
+    }
+    else if (const auto *m = std::get_if<AppendEntriesReply>(&msg))
+    {
+        PutVarint(head, APPEND_ENTRIES_REPLY);
+        PutInt(head, m->id);
+        PutInt(head, m->term);
+        PutInt(head, m->log_count);
+        PutVarint(head, m->success);
+        PutInt(head, m->commit_index);
+        PutInt(head, m->match_index);
+        PutInt(head, m->epoch);
+        PutInt(head, m->read_seq);
+        PutInt(head, m->conflict_term);
+        PutInt(head, m->conflict_index);
+    }
+    else if (const auto *m = std::get_if<InstallSnapshotArgs>(&msg))
+    {
+        PutVarint(head, INSTALL_SNAPSHOT_ARGS);
+        PutInt(head, m->term);
+        PutInt(head, m->leader_id);
+        PutInt(head, m->last_index);
+        PutInt(head, m->last_term);
+        PutInt(head, m->offset);
+        PutVarint(head, m->done);
+        PutInt(head, m->epoch);
+        PutVarint(head, m->data.size());
+        if (!m->data.empty())
+            contents.push_back(m->data);
+    }
+    else if (const auto *m = std::get_if<InstallSnapshotReply>(&msg))
+    {
+        PutVarint(head, INSTALL_SNAPSHOT_REPLY);
+        PutInt(head, m->id);
+        PutInt(head, m->term);
+        PutInt(head, m->last_index);
+        PutInt(head, m->offset);
+        PutVarint(head, m->done);
+        PutInt(head, m->epoch);
+    }
+    else if (const auto *m = std::get_if<ReadIndexArgs>(&msg))
+    {
+        PutVarint(head, READ_INDEX_ARGS);
+        PutInt(head, m->id);
+        PutInt(head, m->seq);
+    }
+    else if (const auto *m = std::get_if<ReadIndexReply>(&msg))
+    {
+        PutVarint(head, READ_INDEX_REPLY);
+        PutInt(head, m->id);
+        PutInt(head, m->term);
+        PutInt(head, m->seq);
+        PutVarint(head, m->success);
+        PutInt(head, m->index);
+        PutInt(head, m->leader_id);
+    }
+}
+
+bool raft::Decode(const buffer &data, message &msg)
+{
+    // 完整解码后才修改msg
+    reader r(data);
+    if (r.Varint() != WIRE_VERSION || !r.ok())
+        return false;
+
+    message ret;
+    switch (r.Varint())
+    {
+    case VOTE_ARGS:
+    {
+        VoteArgs m;
+        m.term = r.Int();
+        m.candidate_id = r.Int();
+        m.last_log_index = r.Int();
+        m.last_log_term = r.Int();
+        ret = std::move(m);
+        break;
+    }
+    case VOTE_REPLY:
+    {
+        VoteReply m;
+        m.id = r.Int();
+        m.term = r.Int();
+        m.vote_granted = r.Bool();
+        ret = std::move(m);
+        break;
+    }
+    case APPEND_ENTRIES_ARGS:
+    {
+        AppendEntriesArgs m;
+        m.term = r.Int();
+        m.leader_id = r.Int();
+        m.pre_log_index = r.Int();
+        m.pre_log_term = r.Int();
+        m.commit_index = r.Int();
+        m.epoch = r.Int();
+        m.read_seq = r.Int();
+        const auto &count = r.Varint();
+        if (!r.ok() || count > r.remain()) // 每条的头至少一个字节
+            return false;
+
+        // 先读完所有条目的头，再按顺序切出内容
+        m.log_vec.resize(count);
+        std::vector<size_t> lens(count);
+        // 差值来自网络，累加时不能溢出；索引必须紧接pre_log_index连续
+        long long index = m.pre_log_index;
+        long long term = m.pre_log_term;
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto &log = m.log_vec[i];
+            index += r.Int();
+            term += r.Int();
+            if (index != m.pre_log_index + (long long)i + 1 || index > std::numeric_limits<int>::max() ||
+                term < std::numeric_limits<int>::min() || term > std::numeric_limits<int>::max())
+                return false;
+            log.index = (int)index;
+            log.term = (int)term;
+            const auto &v = r.Varint();
+            log.is_server = v & 1;
+            lens[i] = v >> 1;
+        }
+        for (size_t i = 0; i < count && r.ok(); ++i)
+            m.log_vec[i].content = r.Bytes(lens[i]);
+        ret = std::move(m);
+        break;
+    }
+    case APPEND_ENTRIES_REPLY:
+    {
+        AppendEntriesReply m;
+        m.id = r.Int();
+        m.term = r.Int();
+        m.log_count = r.Int();
+        m.success = r.Bool();
+        m.commit_index = r.Int();
+        m.match_index = r.Int();
+        m.epoch = r.Int();
+        m.read_seq = r.Int();
+        m.conflict_term = r.Int();
+        m.conflict_index = r.Int();
+        ret = std::move(m);
+        break;
+    }
+    case INSTALL_SNAPSHOT_ARGS:
+    {
+        InstallSnapshotArgs m;
+        m.term = r.Int();
+        m.leader_id = r.Int();
+        m.last_index = r.Int();
+        m.last_term = r.Int();
+        m.offset = r.Int();
+        m.done = r.Bool();
+        m.epoch = r.Int();
+        m.data = r.Bytes(r.Varint());
+        ret = std::move(m);
+        break;
+    }
+    case INSTALL_SNAPSHOT_REPLY:
+    {
+        InstallSnapshotReply m;
+        m.id = r.Int();
+        m.term = r.Int();
+        m.last_index = r.Int();
+        m.offset = r.Int();
+        m.done = r.Bool();
+        m.epoch = r.Int();
+        ret = std::move(m);
+        break;
+    }
+    case READ_INDEX_ARGS:
+    {
+        ReadIndexArgs m;
+        m.id = r.Int();
+        m.seq = r.Int();
+        ret = std::move(m);
+        break;
+    }
+    case READ_INDEX_REPLY:
+    {
+        ReadIndexReply m;
+        m.id = r.Int();
+        m.term = r.Int();
+        m.seq = r.Int();
+        m.success = r.Bool();
+        m.index = r.Int();
+        m.leader_id = r.Int();
+        ret = std::move(m);
+        break;
+    }
+    default:
+        return false;
+    }
+    if (!r.ok())
+        return false;
+    msg = std::move(ret);
+    return true;
+}
@@ -0,0 +1,143 @@
+#include "quorum.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "thread_pool.h"
+
+raft::quorum::quorum(std::vector<int> members, int needed, int tag, callback done)
+    : quorum(std::move(members), needed, {}, 0, tag, std::move(done))
+{
+}
+
+raft::quorum::quorum(std::vector<int> members, int needed, std::vector<int> old_members, int old_needed, int tag, callback done)
+    : m_tag(tag), m_done(std::move(done))
+{
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+    std::sort(old_members.begin(), old_members.end());
+    old_members.erase(std::unique(old_members.begin(), old_members.end()), old_members.end());
+    std::set_union(members.begin(), members.end(), old_members.begin(), old_members.end(), std::back_inserter(m_members));
+
+    m_size[0] = (int)members.size();
+    m_size[1] = (int)old_members.size();
+    m_needed[0] = needed;
+    m_needed[1] = old_needed;
+    m_groups.reset(new unsigned char[m_members.size()]);
+    m_acked.reset(new std::atomic<bool>[m_members.size()]);
+    for (size_t i = 0; i < m_members.size(); ++i)
+    {
+        const auto &id = m_members[i];
+        m_groups[i] = (std::binary_search(members.begin(), members.end(), id) ? 1 : 0) |
+                      (std::binary_search(old_members.begin(), old_members.end(), id) ? 2 : 0);
+        m_acked[i].store(false, std::memory_order_relaxed);
+    }
+}
+
+std::shared_ptr<raft::quorum> raft::quorum::when_majority(std::vector<int> members, int tag, callback done)
+{
+    const auto &needed = (int)members.size() / 2 + 1;
+    return std::make_shared<quorum>(std::move(members), needed, tag, std::move(done));
+}
+
+std::shared_ptr<raft::quorum> raft::quorum::when_all(std::vector<int> members, int tag, callback done)
+{
+    const auto &needed = (int)members.size();
+    return std::make_shared<quorum>(std::move(members), needed, tag, std::move(done));
+}
+
+std::shared_ptr<raft::quorum> raft::quorum::when_count(std::vector<int> members, int needed, int tag, callback done)
+{
+    return std::make_shared<quorum>(std::move(members), needed, tag, std::move(done));
+}
+
+std::shared_ptr<raft::quorum> raft::quorum::when_joint(std::vector<int> members, int needed, std::vector<int> old_members, int old_needed, int tag, callback done)
+{
+    return std::make_shared<quorum>(std::move(members), needed, std::move(old_members), old_needed, tag, std::move(done));
+}
+
+void raft::quorum::ack(int member, bool ok)
+{
+    if (get() != result::pending)
+        return;
+
+    const auto &it = std::lower_bound(m_members.begin(), m_members.end(), member);
+    if (it == m_members.end() || *it != member)
+        return;
+    const auto &i = it - m_members.begin();
+    if (m_acked[i].exchange(true, std::memory_order_relaxed))
+        return;
+
+    // 两组的计数用顺序一致的读写：两个线程分别补齐两组时，至少一个能看到两组都够数
+    bool failed = false;
+    for (int g = 0; g < 2; ++g)
+    {
+        if (!(m_groups[i] & (1 << g)))
+            continue;
+        if (ok)
+            m_ok[g].fetch_add(1);
+        else if (m_fail[g].fetch_add(1) + 1 > m_size[g] - m_needed[g])
+            failed = true;
+    }
+    if (failed)
+        Resolve(result::failed);
+    else if (ok && Reached())
+        Resolve(result::reached);
+}
+
+bool raft::quorum::Reached() const
+{
+    return m_ok[0].load() >= m_needed[0] && m_ok[1].load() >= m_needed[1];
+}
+
+void raft::quorum::expire()
+{
+    Resolve(result::timeout);
+}
+
+void raft::quorum::expire_after(std::chrono::milliseconds delay)
+{
+    // 定时器不延长生命周期，先有结果（被释放）就什么也不做
+    std::weak_ptr<quorum> weak = weak_from_this();
+    thread_pool::get(0).submit_after(delay, [weak]
+                                     {
+                                         if (auto q = weak.lock())
+                                             q->expire(); });
+}
+
+#if _HAS_CXX20
+bool raft::quorum::Park(std::coroutine_handle<> h)
+{
+    // 与Resolve的先改结果再取等待者配对：登记时结果未定，则一定会被恢复
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (get() != result::pending)
+        return false;
+    m_waiters.push_back(h);
+    return true;
+}
+#endif
+
+void raft::quorum::Resolve(result r)
+{
+    auto expected = result::pending;
+    if (!m_result.compare_exchange_strong(expected, r, std::memory_order_acq_rel))
+        return;
+
+    // 只有确定结果的线程会走到这里，回调后释放，避免回调持有的对象和自己互相引用
+    if (m_done)
+    {
+        auto done = std::move(m_done);
+        m_done = nullptr;
+        done(r);
+    }
+
+#if _HAS_CXX20
+    std::vector<std::coroutine_handle<>> waiters;
+    {
+        std::unique_lock<std::mutex> _(m_mutex);
+        waiters.swap(m_waiters);
+    }
+    for (auto h : waiters)
+        h.resume();
+#endif
+}
@@ -2,232 +2,1293 @@
 
 #include <assert.h>
 #include <random>
-#include <sstream>
 #include <algorithm>
+#include <iterator>
+#include <limits>
+#include <string.h>
 
-#define PRINT(...) PrintOutput(m_factory, m_id, __func__, ##__VA_ARGS__)
-template <typename T>
-void osspack(std::ostream &o, T &&t) { o << t; }
-template <typename T, typename... Args>
-void osspack(std::ostream &o, T &&t, Args &&...args)
+// 日志带上(id 任期 状态)和函数名，fmt必须是字符串字面量
+#define PRINT(fmt, ...) RAFT_LOG("({} {} {}) {}->" fmt, m_id, m_term, (int)m_state.load(), raft::log_literal{__func__}, ##__VA_ARGS__)
+
+namespace
+{
+    constexpr int HEARTBEAT_INTERVAL = 100; // 领导心跳间隔(ms)
+    constexpr int ELECTION_TIMEOUT = 600;   // 跟随者心跳超时(ms)
+    constexpr int ELECTION_DELAY_MIN = 100; // 候选人发起选举前的随机等待(ms)
+    constexpr int ELECTION_DELAY_MAX = 300;
+    constexpr int STALL_TICKS = ELECTION_TIMEOUT / HEARTBEAT_INTERVAL; // 同步请求超过这么多次心跳没有返回，则认为丢失
+    constexpr int LEASE_TIMEOUT = ELECTION_TIMEOUT * 9 / 10;            // 租约时长(ms)，比跟随者的心跳超时短，留出时钟误差
+
+    int RandomInt(int min, int max)
+    {
+        thread_local std::default_random_engine eng(std::random_device{}());
+        return std::uniform_int_distribution<int>(min, max)(eng);
+    }
+
+    template <typename T>
+    void Put(std::string &s, T v) { s.append((const char *)&v, sizeof(v)); }
+
+    template <typename T>
+    T Get(const char *p)
+    {
+        T v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // server的快照格式：[成员配置长度 u32][成员配置][状态机快照]，没有成员配置时长度为0
+    raft::buffer PackSnapshot(const std::string &membership, const raft::buffer &data)
+    {
+        std::string s;
+        s.reserve(4 + membership.size() + data.size());
+        Put<unsigned int>(s, (unsigned int)membership.size());
+        s += membership;
+        s.append(data.data(), data.size());
+        return raft::buffer(std::move(s));
+    }
+
+    // 返回状态机快照，和成员配置一样引用原数据
+    raft::buffer UnpackSnapshot(const raft::buffer &snapshot, raft::buffer &membership)
+    {
+        if (snapshot.size() < 4)
+        {
+            membership = raft::buffer();
+            return raft::buffer();
+        }
+        const auto len = std::min<size_t>(Get<unsigned int>(snapshot.data()), snapshot.size() - 4);
+        membership = snapshot.slice(4, len);
+        return snapshot.slice(4 + len, snapshot.size());
+    }
+}
+
+void raft::log_segment::set(size_t k, Log e)
+{
+    indexes[k] = e.index;
+    terms[k] = e.term;
+    servers[k] = e.is_server;
+    if (e.content.empty() || e.content.size() > SMALL_CONTENT)
+    {
+        contents[k] = std::move(e.content);
+        return;
+    }
+
+    // 短内容复制到内存区，原来的缓冲区（提议、收到的请求）随之释放
+    if (arena_used + e.content.size() > ARENA_SIZE)
+    {
+        arena.reset(new char[ARENA_SIZE]);
+        arena_used = 0;
+    }
+    char *p = arena.get() + arena_used;
+    memcpy(p, e.content.data(), e.content.size());
+    arena_used += e.content.size();
+    contents[k] = buffer(arena, p, e.content.size());
+}
+
+void raft::log_segment::copy(const log_segment &other, size_t n)
+{
+    // 内容共享原来的内存区，之后的追加写到新的内存区
+    std::copy(other.indexes, other.indexes + n, indexes);
+    std::copy(other.terms, other.terms + n, terms);
+    std::copy(other.servers, other.servers + n, servers);
+    std::copy(other.contents, other.contents + n, contents);
+}
+
+raft::buffer raft::log_state_machine::Apply(const Log &log)
+{
+    if (!log.is_server)
+        m_log_vec.push_back(log);
+    return buffer();
+}
+
+// 快照格式：每条日志[index i32][term i32][长度 u32][内容]
+raft::buffer raft::log_state_machine::Snapshot()
+{
+    std::string data;
+    for (const auto &log : m_log_vec.snapshot())
+    {
+        Put<int>(data, log.index);
+        Put<int>(data, log.term);
+        Put<unsigned int>(data, (unsigned int)log.content.size());
+        data.append(log.content.data(), log.content.size());
+    }
+    return buffer(std::move(data));
+}
+
+void raft::log_state_machine::Restore(const buffer &snapshot)
+{
+    m_log_vec.clear();
+    size_t pos = 0;
+    while (pos + 12 <= snapshot.size())
+    {
+        const char *p = snapshot.data() + pos;
+        const auto &len = Get<unsigned int>(p + 8);
+        // 内容引用快照，不再复制
+        m_log_vec.push_back(Log{Get<int>(p), Get<int>(p + 4), false, snapshot.slice(pos + 12, len)});
+        pos += 12 + len;
+    }
+}
+
+bool raft::Membership::IsVoter(int id) const
+{
+    return std::binary_search(voters.begin(), voters.end(), id) || std::binary_search(old_voters.begin(), old_voters.end(), id);
+}
+
+bool raft::Membership::IsLearner(int id) const
+{
+    return std::binary_search(learners.begin(), learners.end(), id) && !IsVoter(id);
+}
+
+// 成员配置的日志内容："Membership:新成员;旧成员;学习者"，每组逗号分隔，如"Membership:1,2,4;1,2,3;5"
+std::string raft::Membership::Encode() const
+{
+    std::string s = "Membership:";
+    const std::vector<int> *groups[] = {&voters, &old_voters, &learners};
+    for (size_t g = 0; g < 3; ++g)
+    {
+        if (g > 0)
+            s.push_back(';');
+        for (size_t i = 0; i < groups[g]->size(); ++i)
+        {
+            if (i > 0)
+                s.push_back(',');
+            s += std::to_string((*groups[g])[i]);
+        }
+    }
+    return s;
+}
+
+bool raft::Membership::Decode(const buffer &content, Membership &m)
+{
+    constexpr std::string_view PREFIX = "Membership:";
+    auto s = content.view();
+    if (s.substr(0, PREFIX.size()) != PREFIX)
+        return false;
+    s.remove_prefix(PREFIX.size());
+
+    m = Membership();
+    std::vector<int> *groups[] = {&m.voters, &m.old_voters, &m.learners};
+    size_t g = 0;
+    int id = 0;
+    bool digit = false;
+    for (const auto &c : s)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            id = id * 10 + (c - '0');
+            digit = true;
+            continue;
+        }
+        if (c != ',' && c != ';')
+            return false;
+        if (digit)
+            groups[g]->push_back(id);
+        id = 0;
+        digit = false;
+        if (c == ';' && ++g >= 3)
+            return false;
+    }
+    if (digit)
+        groups[g]->push_back(id);
+    return true;
+}
+
+raft::server::server(int id, std::shared_ptr<objfactory<server>> factory, const Config &config) : m_config(config)
+{
+    assert(id >= 0);
+    assert(factory);
+    assert(config.max_entries_per_rpc > 0 && config.max_bytes_per_rpc > 0 && config.max_inflight > 0);
+    m_id = id;
+    m_initial_membership.learners = config.learners;
+    std::sort(m_initial_membership.learners.begin(), m_initial_membership.learners.end());
+    m_learner = m_initial_membership.IsLearner(m_id);
+    m_factory = factory;
+    m_transport = config.transport ? config.transport : DefaultTransport();
+    m_state_machine = std::make_shared<log_state_machine>();
+    m_snapshot_ref.store(std::make_shared<const Snapshot>());
+}
+
+std::shared_ptr<raft::transport> raft::server::DefaultTransport()
+{
+    static const auto transport = std::make_shared<local_transport>();
+    return transport;
+}
+
+raft::log_entries::view raft::server::ApplyLogVec() const
+{
+    // 状态机只在Start之前替换，之后不加锁读
+    const auto &sm = std::dynamic_pointer_cast<log_state_machine>(m_state_machine);
+    return sm ? sm->LogVec() : log_entries::view{};
+}
+
+void raft::server::SetStateMachine(std::shared_ptr<state_machine> sm)
+{
+    assert(sm);
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_state_machine = std::move(sm);
+}
+
+int raft::server::AddLog(buffer content)
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (m_is_stop || m_state != State::Leader)
+        return m_leader_id;
+
+    const auto &index = LastLogIndex() + 1;
+    PRINT("index:{} term:{} content:{}", index, m_term, content);
+    AppendLog(Log{index, m_term, false, std::move(content)});
+    PersistLog(index);
+
+    // 不等心跳，窗口允许就立即同步
+    BroadcastAppendEntries(false);
+    return 0;
+}
+
+raft::future<raft::ApplyResult> raft::server::Propose(buffer content)
+{
+    std::promise<ApplyResult> promise;
+    auto ret = promise.get_future();
+    {
+        std::unique_lock<std::mutex> _(m_propose_mutex);
+        m_proposals.push_back(Proposal{std::move(content), std::move(promise)});
+        if (m_proposing)
+            return ret; // 和正在攒的这一批一起添加
+        m_proposing = true;
+    }
+
+    auto tmp = m_factory->Get(m_id, m_factory);
+    thread_pool::get(0).post_to(m_id, [tmp]
+                                { tmp->FlushProposals(); });
+    return ret;
+}
+
+raft::future<raft::ApplyResult> raft::server::Read()
+{
+    std::promise<ApplyResult> promise;
+    auto ret = promise.get_future();
+
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (m_is_stop || (m_state != State::Leader && m_leader_id == 0))
+    {
+        promise.set_value(ApplyResult{ApplyResult::Status::NotLeader, -1, 0, m_leader_id, buffer()});
+        return ret;
+    }
+    if (m_state == State::Leader)
+    {
+        StartRead(ReadWaiter{-1, std::move(promise)});
+        return ret;
+    }
+
+    // 跟随者向领导要读索引，领导一个选举超时内没有返回则失败
+    const auto &seq = ++m_forward_seq;
+    m_read_forwarded.emplace(seq, ReadWaiter{-1, std::move(promise)});
+    m_transport->Send(m_leader_id, ReadIndexArgs{m_id, seq}, lane::control);
+    std::weak_ptr<server> weak = m_factory->Get(m_id, m_factory);
+    thread_pool::get(0).submit_after_to(m_id, std::chrono::milliseconds(ELECTION_TIMEOUT), [weak, seq]
+                                        {
+                                            auto self = weak.lock();
+                                            if (!self)
+                                                return;
+                                            std::unique_lock<std::mutex> _(self->m_mutex);
+                                            const auto &it = self->m_read_forwarded.find(seq);
+                                            if (it == self->m_read_forwarded.end())
+                                                return;
+                                            self->ReadFailed(it->second, ApplyResult::Status::LeaderChanged);
+                                            self->m_read_forwarded.erase(it); });
+    return ret;
+}
+
+raft::future<raft::ApplyResult> raft::server::ChangeMembership(std::vector<int> voters, std::vector<int> learners)
+{
+    assert(!voters.empty());
+    std::sort(voters.begin(), voters.end());
+    voters.erase(std::unique(voters.begin(), voters.end()), voters.end());
+    std::sort(learners.begin(), learners.end());
+    learners.erase(std::unique(learners.begin(), learners.end()), learners.end());
+
+    std::promise<ApplyResult> promise;
+    auto ret = promise.get_future();
+
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (m_is_stop || m_state != State::Leader)
+    {
+        promise.set_value(ApplyResult{ApplyResult::Status::NotLeader, -1, 0, m_leader_id, buffer()});
+        return ret;
+    }
+
+    // 上一次变更的联合配置或新配置还没提交
+    const auto &current = CurrentMembership();
+    if (m_membership_promise || current.IsJoint() || (!m_memberships.empty() && m_memberships.back().first > m_commit_index))
+    {
+        promise.set_value(ApplyResult{ApplyResult::Status::Rejected, -1, 0, m_id, buffer()});
+        return ret;
+    }
+
+    // 先添加联合配置，添加时就生效，提交后由AdvanceMembership添加新配置
+    Membership joint{std::move(voters), current.voters, std::move(learners)};
+    const auto &index = LastLogIndex() + 1;
+    PRINT("index:{} {}", index, joint.Encode());
+    AppendLog(Log{index, m_term, true, joint.Encode()});
+    m_membership_promise = std::move(promise);
+    PersistLog(index);
+    BroadcastAppendEntries(false);
+    return ret;
+}
+
+raft::Membership raft::server::GetMembership()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    return CurrentMembership();
+}
+
+void raft::server::Start()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_is_stop = false;
+    m_vote_quorum.store(nullptr);
+    ResetElectionTimer(ELECTION_TIMEOUT, ELECTION_TIMEOUT);
+
+    m_state = State::Folower;
+    m_term = 0;
+    m_votedfor = 0;
+    m_leader_id = 0;
+    m_log.clear();
+    m_term_vec.clear();
+    m_snapshot_index = 0;
+    m_snapshot_term = 0;
+    m_snapshot = buffer();
+    RestoreStateMachine();
+    PublishSnapshot();
+    m_recv_snapshot_index = -1;
+    m_recv_snapshot.clear();
+    FailProposals(ApplyResult::Status::LeaderChanged);
+    FailReads(ApplyResult::Status::LeaderChanged);
+    OpenWal(); // 从预写日志恢复
+    if (m_log.empty())
+    {
+        AppendLog(Log{0, 0, true, "Start"}); // 初始化一条日志
+        PersistLog(0);
+    }
+    PublishSnapshot();
+
+    // 快照之内的日志已经应用过
+    m_commit_index = m_snapshot_index;
+    m_last_applied = m_snapshot_index;
+
+    RetireReplication();
+
+    // 接收其他server的消息，不延长自己的生命周期
+    std::weak_ptr<server> weak = m_factory->Get(m_id, m_factory);
+    m_transport->Bind(m_id, [weak](message msg)
+                      {
+                          if (const auto &self = weak.lock())
+                              self->Receive(msg); });
+
+    //启动定时器
+    thread_pool::get(0).cancel(m_timer_id);
+    Schedule(std::chrono::milliseconds(HEARTBEAT_INTERVAL));
+}
+
+void raft::server::Stop()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_is_stop = true;
+    FailProposals(ApplyResult::Status::LeaderChanged);
+    FailReads(ApplyResult::Status::LeaderChanged);
+    PRINT("");
+}
+
+void raft::server::ReStart()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_is_stop = false;
+    m_vote_quorum.store(nullptr);
+    ResetElectionTimer(ELECTION_TIMEOUT, ELECTION_TIMEOUT);
+
+    // m_state = State::Folower;
+    // m_term = 0;
+    // m_votedfor = 0;
+    // m_log_vec.clear();
+    // m_log_vec.push_back(Log{(int)m_log_vec.size(), 0, true, "Start"}); // 初始化一条日志
+
+    // m_commit_index = 0;
+    // m_last_applied = 0;
+
+    RetireReplication();
+    PRINT("");
+}
+
+void raft::server::Update()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (m_is_stop)
+    {
+        Schedule(std::chrono::milliseconds(HEARTBEAT_INTERVAL));
+        return;
+    }
+
+    const auto &now = std::chrono::steady_clock::now();
+    switch (m_state.load())
+    {
+    case State::Leader:
+    {
+        // 领导同步日志信息，发0条当心跳
+        BroadcastAppendEntries(true);
+
+        // 租约读：每次心跳都确认一次地位，续租
+        if (m_config.lease_read)
+            ConfirmLeadership();
+    }
+    break;
+    case State::Candidate:
+    {
+        // 随机等待结束，发起一轮选举
+        if (now >= m_election_deadline)
+            Election();
+    }
+    break;
+    case State::Folower:
+    {
+        // 心跳超时，成为候选人，随机等待后发起选举
+        // 学习者和不在成员配置里的server不参加选举，只是不再认为领导还在
+        if (now >= m_election_deadline && !CurrentMembership().IsVoter(m_id))
+        {
+            m_leader_id = 0;
+            ResetElectionTimer(ELECTION_TIMEOUT, ELECTION_TIMEOUT);
+        }
+        else if (now >= m_election_deadline)
+        {
+            m_state = State::Candidate;
+            PRINT("sleep:{}", ResetElectionTimer(ELECTION_DELAY_MIN, ELECTION_DELAY_MAX));
+        }
+    }
+    break;
+    default:
+        return;
+    }
+
+    // 领导按心跳间隔醒来，其他状态最迟在选举超时时刻醒来
+    auto delay = std::chrono::milliseconds(HEARTBEAT_INTERVAL);
+    if (m_state != State::Leader)
+        delay = std::clamp(std::chrono::ceil<std::chrono::milliseconds>(m_election_deadline - now), std::chrono::milliseconds(1), delay);
+    Schedule(delay);
+}
+
+void raft::server::Election()
+{
+    // 任期+1，并投自己一票
+    ++m_term;
+    m_votedfor = m_id;
+    m_leader_id = 0;
+    PRINT("vote self");
+
+    // 这一轮没选出领导，则随机等待后重新发起
+    PRINT("sleep:{}", ResetElectionTimer(ELECTION_DELAY_MIN, ELECTION_DELAY_MAX));
+
+    // 这一轮的投票计数：加上自己一票超过半数有投票权的成员则当选，学习者不算成员
+    // 联合配置时新旧两组分别计数，都过半才当选；不在某一组里时自己那一票不算
+    // 投票返回只计数不加锁，够数时回调里加一次锁当选
+    const auto &m = CurrentMembership();
+    std::vector<int> peers;
+    std::vector<int> old_peers;
+    std::copy_if(m.voters.begin(), m.voters.end(), std::back_inserter(peers), [this](int id)
+                 { return id != m_id; });
+    std::copy_if(m.old_voters.begin(), m.old_voters.end(), std::back_inserter(old_peers), [this](int id)
+                 { return id != m_id; });
+    const auto &needed = (int)m.voters.size() / 2 + 1 - (peers.size() < m.voters.size() ? 1 : 0);
+    const auto &old_needed = m.IsJoint() ? (int)m.old_voters.size() / 2 + 1 - (old_peers.size() < m.old_voters.size() ? 1 : 0) : 0;
+    if (needed <= 0 && old_needed <= 0)
+    {
+        ToLeader(); // 只有自己一个成员
+        return;
+    }
+
+    std::vector<int> targets;
+    std::set_union(peers.begin(), peers.end(), old_peers.begin(), old_peers.end(), std::back_inserter(targets));
+
+    std::weak_ptr<server> weak = m_factory->Get(m_id, m_factory); // 计数保存在自己身上，不能互相引用
+    m_vote_quorum.store(quorum::when_joint(std::move(peers), needed, std::move(old_peers), old_needed, m_term, [weak, term = m_term.load()](quorum::result r)
+                                           {
+                                               auto self = weak.lock();
+                                               if (r != quorum::result::reached || !self)
+                                                   return;
+                                               std::unique_lock<std::mutex> _(self->m_mutex);
+                                               if (!self->m_is_stop && self->m_state == State::Candidate && self->m_term == term)
+                                                   self->ToLeader(); }));
+
+    // 发起请求投票，所有请求一次放入线程池
+    const VoteArgs &args{m_term, m_id, LastLogIndex(), LastLogTerm()};
+    thread_pool::batch batch(thread_pool::get(0));
+    for (const auto &id : targets)
+        AfterPersist(id, args, lane::control);
+}
+
+void raft::server::Schedule(std::chrono::milliseconds delay)
+{
+    auto tmp = m_factory->Get(m_id, m_factory);
+    m_timer_id = thread_pool::get(0).submit_after_to(m_id, delay, [tmp]
+                                                     { tmp->Update(); });
+}
+
+int raft::server::ResetElectionTimer(int min_ms, int max_ms)
+{
+    const auto &timeout = RandomInt(min_ms, max_ms);
+    m_election_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    return timeout;
+}
+
+void raft::server::BroadcastAppendEntries(bool heartbeat)
+{
+    const auto &rep = m_replication.load();
+    if (!rep)
+        return;
+
+    // 发给所有跟随者的请求一次放入线程池
+    const auto &log = m_log.snapshot();
+    thread_pool::batch batch(thread_pool::get(0));
+    for (size_t i = 0; i < rep->ids.size(); ++i)
+    {
+        const auto &id = rep->ids[i];
+        if (id == m_id)
+            continue;
+
+        // 请求长时间没有返回（跟随者掉线或消息丢失），重发最后一条作为探测
+        // 跟随者缺日志或有冲突时返回冲突提示，领导据此直接回退到正确的位置
+        auto &progress = *rep->peers[i];
+        std::unique_lock<std::mutex> _(progress.mutex);
+        if (heartbeat && progress.inflight > 0 && ++progress.stall >= STALL_TICKS)
+        {
+            ++progress.epoch;
+            progress.inflight = 0;
+            progress.stall = 0;
+            progress.sent_from = std::numeric_limits<int>::max();
+            progress.next_index = std::max(progress.match_index + 1, std::min(progress.next_index, LastIndex(log)));
+        }
+
+        SendAppendEntries(*rep, id, progress, log, heartbeat);
+    }
+}
+
+void raft::server::SendAppendEntries(Replication &rep, int id, Progress &progress, const log_entries::view &log, bool heartbeat)
+{
+    if (progress.retired)
+        return;
+
+    // 视图里的第一条就是快照的最后一条
+    const auto &first = FirstIndex(log);
+    const auto &last = LastIndex(log);
+
+    AppendEntriesArgs args;
+    args.term = rep.term;
+    args.leader_id = m_id;
+    args.commit_index = m_commit_index;
+
+    // 跟随者需要的日志已经压缩进快照
+    bool sent = false;
+    if (progress.next_index <= first)
+        sent = SendSnapshot(rep, id, progress);
+
+    // 窗口未满时分批发送，发送后乐观推进next_index，不等返回
+    while (progress.inflight < m_config.max_inflight && progress.next_index > first && progress.next_index <= last)
+    {
+        args.epoch = progress.epoch;
+        args.pre_log_index = progress.next_index - 1;
+        args.pre_log_term = TermAt(log, args.pre_log_index);
+
+        args.log_vec.clear();
+        int bytes = 0;
+        for (int i = progress.next_index; i <= last && (int)args.log_vec.size() < m_config.max_entries_per_rpc; ++i)
+        {
+            const auto &entry = log[i - first];
+            bytes += (int)entry.content.size();
+            if (!args.log_vec.empty() && bytes > m_config.max_bytes_per_rpc)
+                break;
+            args.log_vec.push_back(entry);
+        }
+
+        progress.sent_from = std::min(progress.sent_from, progress.next_index);
+        progress.next_index += (int)args.log_vec.size();
+        ++progress.inflight;
+        sent = true;
+
+        m_transport->Send(id, std::move(args));
+    }
+
+    // 没有日志可发（或窗口已满）时发0条当心跳，走控制面，不排在大批日志后面
+    if (heartbeat && !sent)
+    {
+        args.epoch = progress.epoch;
+        args.pre_log_index = progress.next_index - 1;
+        args.pre_log_term = std::max(TermAt(log, args.pre_log_index), 0);
+        args.log_vec.clear();
+
+        m_transport->Send(id, std::move(args), lane::control);
+    }
+}
+
+bool raft::server::SendSnapshot(Replication &rep, int id, Progress &progress)
+{
+    // 同一时间只有一块在途，跟随者按顺序拼接
+    if (progress.inflight > 0)
+        return false;
+
+    // 开始发送时固定使用最新的快照
+    if (progress.snapshot_index < 0)
+    {
+        const auto &snapshot = m_snapshot_ref.load(std::memory_order_acquire);
+        progress.snapshot_index = snapshot->index;
+        progress.snapshot_term = snapshot->term;
+        progress.snapshot = snapshot->data;
+        progress.snapshot_offset = 0;
+    }
+
+    InstallSnapshotArgs args;
+    args.term = rep.term;
+    args.leader_id = m_id;
+    args.last_index = progress.snapshot_index;
+    args.last_term = progress.snapshot_term;
+    args.offset = progress.snapshot_offset;
+    args.data = progress.snapshot.slice(progress.snapshot_offset, m_config.snapshot_chunk_size);
+    args.done = args.offset + args.data.size() >= progress.snapshot.size();
+    args.epoch = progress.epoch;
+    ++progress.inflight;
+
+    m_transport->Send(id, std::move(args));
+    return true;
+}
+
+void raft::server::AdvanceCommit(int match_index)
+{
+    // 只有越过提交进度的同步进度才可能推进提交
+    const auto &rep = m_replication.load();
+    if (match_index <= m_commit_index || !rep)
+        return;
+
+    // 有投票权的成员过半的同步进度，学习者不算；联合配置时取两组中小的
+    const auto committed = std::min(QuorumMatch(*rep, rep->voters, m_quorum_vec), QuorumMatch(*rep, rep->old_voters, m_quorum_vec));
+
+    // 不负责为之前的领导留下的过半复制日志专门进行提交，只提交自己任期内的日志
+    // 提交自己任期日志时能够自动把之前的都提交
+    if (committed == std::numeric_limits<int>::max() || committed <= m_commit_index || TermAt(committed) != m_term)
+        return;
+    m_commit_index = committed;
+    ApplyLog();
+
+    // 立即把新的提交进度告诉跟随者，有日志可发时随日志一起带过去
+    const auto &log = m_log.snapshot();
+    for (size_t i = 0; i < rep->ids.size(); ++i)
+    {
+        if (rep->ids[i] != m_id)
+        {
+            auto &progress = *rep->peers[i];
+            std::unique_lock<std::mutex> _(progress.mutex);
+            SendAppendEntries(*rep, rep->ids[i], progress, log, true);
+        }
+    }
+}
+
+void raft::server::TryCommit(Replication &rep, int match_index)
+{
+    if (match_index <= m_commit_index)
+        return;
+
+    // 先不加锁估算过半的同步进度，推进不了就不加锁
+    thread_local std::vector<int> quorum_vec;
+    const auto committed = std::min(QuorumMatch(rep, rep.voters, quorum_vec), QuorumMatch(rep, rep.old_voters, quorum_vec));
+    if (committed == std::numeric_limits<int>::max() || committed <= m_commit_index || TermAt(m_log.snapshot(), committed) != rep.term)
+        return;
+
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (!m_is_stop && m_state == State::Leader && m_term == rep.term)
+        AdvanceCommit(match_index);
+}
+
+int raft::server::QuorumMatch(const Replication &rep, const std::vector<int> &group, std::vector<int> &buf)
+{
+    if (group.empty())
+        return std::numeric_limits<int>::max();
+
+    // 复用同一块内存，不排序；升序的第(n-1)/2个，至少n/2+1个成员的进度不小于它，成员数为偶数时也过半
+    buf.clear();
+    for (const auto &i : group)
+        buf.push_back(rep.peers[i]->match_index.load(std::memory_order_acquire));
+    const auto &mid = buf.begin() + (buf.size() - 1) / 2;
+    std::nth_element(buf.begin(), mid, buf.end());
+    return *mid;
+}
+
+raft::server::Progress *raft::server::Replication::Find(int id) const
+{
+    const auto &it = std::lower_bound(ids.begin(), ids.end(), id);
+    if (it == ids.end() || *it != id)
+        return nullptr;
+    return peers[it - ids.begin()].get();
+}
+
+std::shared_ptr<raft::server::Replication> raft::server::MakeReplication()
+{
+    // 要同步的是新旧成员和学习者，自己也占一个位置（记录自己落盘的进度）
+    const auto &m = CurrentMembership();
+    std::vector<int> ids = {m_id};
+    for (const auto *group : {&m.voters, &m.old_voters, &m.learners})
+        ids.insert(ids.end(), group->begin(), group->end());
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    auto rep = std::make_shared<Replication>(m_term, std::move(ids));
+    for (const auto &id : m.voters)
+        rep->voters.push_back((int)(std::lower_bound(rep->ids.begin(), rep->ids.end(), id) - rep->ids.begin()));
+    for (const auto &id : m.old_voters)
+        rep->old_voters.push_back((int)(std::lower_bound(rep->ids.begin(), rep->ids.end(), id) - rep->ids.begin()));
+    return rep;
+}
+
+void raft::server::RebuildReplication()
+{
+    // 留下的server共用原来的同步状态，正在处理的应答不会丢；新加入的先假设和我一致，不一致时再回退
+    // 任期内变更成员时新加入的从刚添加的成员配置开始发，立即得到应答，缺日志时据此回退或发快照
+    const auto &old = m_replication.load();
+    auto rep = MakeReplication();
+    for (size_t i = 0; i < rep->ids.size(); ++i)
+    {
+        if (old)
+        {
+            const auto &it = std::lower_bound(old->ids.begin(), old->ids.end(), rep->ids[i]);
+            if (it != old->ids.end() && *it == rep->ids[i])
+            {
+                rep->peers[i] = old->peers[it - old->ids.begin()];
+                continue;
+            }
+        }
+        rep->peers[i] = std::make_shared<Progress>();
+        rep->peers[i]->next_index = old ? LastLogIndex() : LastLogIndex() + 1;
+    }
+    m_replication.store(rep);
+
+    // 被移除的server不再发送
+    if (old)
+    {
+        for (size_t i = 0; i < old->ids.size(); ++i)
+        {
+            if (!rep->Find(old->ids[i]))
+            {
+                std::unique_lock<std::mutex> _(old->peers[i]->mutex);
+                old->peers[i]->retired = true;
+            }
+        }
+    }
+}
+
+void raft::server::RetireReplication()
+{
+    // 持有锁的应答发完这一次，之后的都看到retired
+    if (const auto &rep = m_replication.exchange(nullptr))
+    {
+        for (auto &progress : rep->peers)
+        {
+            std::unique_lock<std::mutex> _(progress->mutex);
+            progress->retired = true;
+        }
+    }
+}
+
+void raft::server::ApplyLog()
+{
+    while (m_last_applied < m_commit_index && m_last_applied < LastLogIndex())
+    {
+        const auto &log = LogAt(++m_last_applied);
+        if (!log.is_server)
+            PRINT("apply_log[{}]{index:{} term:{} content:{}}", m_last_applied, log.index, log.term, log.content);
+        const auto &result = m_state_machine->Apply(log);
+
+        // 应用的日志就是提议添加的那条才算成功
+        while (!m_apply_waiters.empty() && m_apply_waiters.front().index <= m_last_applied)
+        {
+            auto &waiter = m_apply_waiters.front();
+            if (waiter.index == m_last_applied && waiter.term == log.term)
+                waiter.promise.set_value(ApplyResult{ApplyResult::Status::Ok, waiter.index, waiter.term, 0, result});
+            else
+                waiter.promise.set_value(ApplyResult{ApplyResult::Status::LeaderChanged, waiter.index, waiter.term, m_leader_id, buffer()});
+            m_apply_waiters.pop_front();
+        }
+    }
+
+    if (!m_read_waiters.empty())
+        ApplyReads();
+
+    if (m_state == State::Leader)
+        AdvanceMembership();
+
+    // 快照之后应用的日志足够多，压缩
+    if (m_config.snapshot_threshold > 0 && m_last_applied - m_snapshot_index >= m_config.snapshot_threshold)
+        TakeSnapshot();
+}
+
+void raft::server::FlushProposals()
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    while (true)
+    {
+        // 执行期间到达的提议留给下一轮，一轮只落盘、广播一次
+        std::vector<Proposal> proposals;
+        {
+            std::unique_lock<std::mutex> _(m_propose_mutex);
+            if (m_proposals.empty())
+            {
+                m_proposing = false;
+                return;
+            }
+            proposals.swap(m_proposals);
+        }
+
+        if (m_is_stop || m_state != State::Leader)
+        {
+            for (auto &proposal : proposals)
+                proposal.promise.set_value(ApplyResult{ApplyResult::Status::NotLeader, -1, 0, m_leader_id, buffer()});
+            continue;
+        }
+
+        const auto &from = LastLogIndex() + 1;
+        for (auto &proposal : proposals)
+        {
+            const auto &index = LastLogIndex() + 1;
+            AppendLog(Log{index, m_term, false, std::move(proposal.content)});
+            m_apply_waiters.push_back(ApplyWaiter{index, m_term, std::move(proposal.promise)});
+        }
+        PRINT("from:{} count:{} term:{}", from, proposals.size(), m_term);
+        PersistLog(from);
+        BroadcastAppendEntries(false);
+    }
+}
+
+void raft::server::FailProposals(ApplyResult::Status status)
+{
+    for (auto &waiter : m_apply_waiters)
+        waiter.promise.set_value(ApplyResult{status, waiter.index, waiter.term, m_leader_id, buffer()});
+    m_apply_waiters.clear();
+
+    // 联合配置还没提交，变更可能由下一任领导完成，也可能被覆盖
+    if (m_membership_promise)
+    {
+        m_membership_promise->set_value(ApplyResult{status, -1, 0, m_leader_id, buffer()});
+        m_membership_promise.reset();
+    }
+}
+
+void raft::server::StartRead(ReadWaiter waiter)
+{
+    // 上任的那条日志提交之前，不知道之前的任期提交到了哪里，读索引至少是它
+    waiter.index = std::max(m_commit_index.load(), FirstIndexOfTerm(m_term));
+    if (m_config.lease_read && std::chrono::steady_clock::now() < m_lease_deadline)
+    {
+        // 租约内不会有别的领导，不用确认
+        ReadConfirmed(std::move(waiter));
+        ApplyReads();
+        return;
+    }
+
+    m_read_pending.push_back(std::move(waiter));
+    ConfirmLeadership();
+}
+
+void raft::server::ConfirmLeadership()
+{
+    if (m_read_quorum.load())
+        return; // 这一轮结束后再发起下一轮
+
+    const auto &m = CurrentMembership();
+    std::vector<int> peers;
+    std::vector<int> old_peers;
+    std::copy_if(m.voters.begin(), m.voters.end(), std::back_inserter(peers), [this](int id)
+                 { return id != m_id; });
+    std::copy_if(m.old_voters.begin(), m.old_voters.end(), std::back_inserter(old_peers), [this](int id)
+                 { return id != m_id; });
+
+    // 加上自己超过半数有投票权的成员承认我的任期，则发出心跳时我还是领导；联合配置时两组都要过半
+    // 这一轮的读在发出心跳之前记下了读索引
+    const auto &needed = (int)m.voters.size() / 2 + 1 - (peers.size() < m.voters.size() ? 1 : 0);
+    const auto &old_needed = m.IsJoint() ? (int)m.old_voters.size() / 2 + 1 - (old_peers.size() < m.old_voters.size() ? 1 : 0) : 0;
+    const auto &seq = ++m_read_seq;
+    m_read_confirming.swap(m_read_pending);
+    m_read_start = std::chrono::steady_clock::now();
+    if (needed <= 0 && old_needed <= 0)
+    {
+        FinishReadRound(m_term, seq, true);
+        return;
+    }
+
+    std::vector<int> targets;
+    std::set_union(peers.begin(), peers.end(), old_peers.begin(), old_peers.end(), std::back_inserter(targets));
+    std::weak_ptr<server> weak = m_factory->Get(m_id, m_factory);
+    auto q = quorum::when_joint(std::move(peers), needed, std::move(old_peers), old_needed, seq, [weak, term = m_term.load(), seq](quorum::result r)
+                                {
+                                    auto self = weak.lock();
+                                    if (!self)
+                                        return;
+                                    std::unique_lock<std::mutex> _(self->m_mutex);
+                                    self->FinishReadRound(term, seq, r == quorum::result::reached); });
+    m_read_quorum.store(q);
+    q->expire_after(std::chrono::milliseconds(ELECTION_TIMEOUT));
+
+    // 不带日志，也不让跟随者据此推进提交
+    AppendEntriesArgs args;
+    args.term = m_term;
+    args.leader_id = m_id;
+    args.pre_log_index = -1;
+    args.commit_index = m_commit_index;
+    args.read_seq = seq;
+    thread_pool::batch batch(thread_pool::get(0));
+    for (const auto &id : targets)
+        m_transport->Send(id, args, lane::control);
+}
+
+void raft::server::FinishReadRound(int term, int seq, bool ok)
+{
+    // 卸任或停服时读已经全部失败
+    if (seq != m_read_seq)
+        return;
+    m_read_quorum.store(nullptr);
+    if (m_is_stop || m_state != State::Leader || m_term != term)
+        return;
+
+    std::vector<ReadWaiter> confirming;
+    confirming.swap(m_read_confirming);
+    if (ok)
+    {
+        // 跟随者收到心跳后一个选举超时内不会发起选举，租约从心跳发出时算起
+        m_lease_deadline = m_read_start + std::chrono::milliseconds(LEASE_TIMEOUT);
+        for (auto &waiter : confirming)
+            ReadConfirmed(std::move(waiter));
+        ApplyReads();
+    }
+    else
+    {
+        // 没有确认（可能被隔离了），这一批失败，之后的读重新确认
+        PRINT("seq:{} count:{}", seq, confirming.size());
+        for (auto &waiter : confirming)
+            ReadFailed(waiter, ApplyResult::Status::LeaderChanged);
+    }
+
+    if (!m_read_pending.empty())
+        ConfirmLeadership();
+}
+
+void raft::server::ReadConfirmed(ReadWaiter waiter)
+{
+    if (waiter.from < 0)
+        m_read_waiters.push_back(std::move(waiter));
+    else
+        m_transport->Send(waiter.from, ReadIndexReply{m_id, m_term, waiter.seq, true, waiter.index, m_id}, lane::control);
+}
+
+void raft::server::ReadFailed(ReadWaiter &waiter, ApplyResult::Status status)
+{
+    if (waiter.from < 0)
+        waiter.promise.set_value(ApplyResult{status, waiter.index, m_term, m_leader_id, buffer()});
+    else
+        m_transport->Send(waiter.from, ReadIndexReply{m_id, m_term, waiter.seq, false, waiter.index, m_leader_id}, lane::control);
+}
+
+void raft::server::ApplyReads()
+{
+    // 读索引不一定有序（租约内的读不等确认），逐个检查，没应用到的前移
+    size_t n = 0;
+    for (size_t i = 0; i < m_read_waiters.size(); ++i)
+    {
+        auto &waiter = m_read_waiters[i];
+        if (waiter.index <= m_last_applied)
+            waiter.promise.set_value(ApplyResult{ApplyResult::Status::Ok, waiter.index, m_term, m_leader_id, buffer()});
+        else if (n++ != i)
+            m_read_waiters[n - 1] = std::move(waiter);
+    }
+    m_read_waiters.resize(n);
+}
+
+void raft::server::FailReads(ApplyResult::Status status)
+{
+    m_read_quorum.store(nullptr);
+    m_lease_deadline = {};
+    for (auto *vec : {&m_read_pending, &m_read_confirming, &m_read_waiters})
+    {
+        for (auto &waiter : *vec)
+            ReadFailed(waiter, status);
+        vec->clear();
+    }
+    for (auto &[seq, waiter] : m_read_forwarded)
+        ReadFailed(waiter, status);
+    m_read_forwarded.clear();
+}
+
+const raft::Membership &raft::server::CurrentMembership()
+{
+    if (!m_memberships.empty())
+        return m_memberships.back().second;
+
+    // 还没有成员配置，按对象池现有的server算，复用同一块内存
+    auto &m = m_initial_membership;
+    m.voters.clear();
+    for (const auto &id : m_factory->GetAllObjKey())
+    {
+        if (!std::binary_search(m.learners.begin(), m.learners.end(), id))
+            m.voters.push_back(id);
+    }
+    return m;
+}
+
+void raft::server::MembershipChanged()
 {
-    o << t;
-    osspack(o, std::forward<Args>(args)...);
+    const auto &m = CurrentMembership();
+    m_learner = m.IsLearner(m_id);
+    PRINT("{} learner:{}", m.Encode(), m_learner.load());
+
+    // 领导立即按新的成员同步，新配置提交之前就开始
+    if (m_state == State::Leader)
+        RebuildReplication();
 }
-template <typename... Args>
-void PrintOutput(std::shared_ptr<raft::objfactory<raft::server>> factory, int id, const std::string &func, Args &&...args)
+
+void raft::server::AdvanceMembership()
 {
-    auto server = factory->Get(id, factory);
-    std::ostringstream o;
-    osspack(o, "(", id, " ", server->Term(), " ", (int)server->GetState(), ") ", func, "->", std::forward<Args>(args)...);
-    factory->Get(0, factory)->AddPrint(o.str());
+    // 最新的配置已经应用（提交）才进入下一步
+    if (m_memberships.empty() || m_memberships.back().first > m_last_applied)
+        return;
+
+    const auto &m = m_memberships.back().second;
+    if (m.IsJoint())
+    {
+        // 联合配置已提交，添加新配置，之后只按新的成员计数
+        const Membership next{m.voters, {}, m.learners};
+        const auto &index = LastLogIndex() + 1;
+        PRINT("index:{} {}", index, next.Encode());
+        AppendLog(Log{index, m_term, true, next.Encode()});
+        if (m_membership_promise)
+        {
+            m_apply_waiters.push_back(ApplyWaiter{index, m_term, std::move(*m_membership_promise)});
+            m_membership_promise.reset();
+        }
+        PersistLog(index);
+        BroadcastAppendEntries(false);
+    }
+    else if (!m.IsVoter(m_id))
+    {
+        // 新配置里没有我，提交后卸任，剩下的成员超时后选出新领导
+        PRINT("removed");
+        m_leader_id = 0;
+        ToFollower(m_term, 0);
+    }
 }
 
-raft::server::server(int id, std::shared_ptr<objfactory<server>> factory)
+void raft::server::RestoreStateMachine()
 {
-    assert(id >= 0);
-    assert(factory);
-    m_id = id;
-    m_factory = factory;
+    // 快照里的成员配置是最早的一个，快照之后日志里的由RebuildLogIndex加上
+    buffer content;
+    const auto &data = UnpackSnapshot(m_snapshot, content);
+    m_memberships.clear();
+    Membership m;
+    if (Membership::Decode(content, m))
+        m_memberships.emplace_back(m_snapshot_index, std::move(m));
+    m_state_machine->Restore(data);
+    MembershipChanged();
 }
 
-const std::vector<raft::Log> raft::server::ApplyLogVec()
+void raft::server::RequestReadIndex(const ReadIndexArgs &args)
 {
     std::unique_lock<std::mutex> _(m_mutex);
-    std::vector<Log> log_vec;
-    for (int i = 0; i <= m_last_applied && i < (int)m_log_vec.size(); ++i)
+    if (m_is_stop)
+        return;
+    if (m_state != State::Leader)
     {
-        if (!m_log_vec[i].is_server)
-            log_vec.push_back(m_log_vec[i]);
+        m_transport->Send(args.id, ReadIndexReply{m_id, m_term, args.seq, false, 0, m_leader_id}, lane::control);
+        return;
     }
-    return log_vec;
+    StartRead(ReadWaiter{-1, std::promise<ApplyResult>(), args.id, args.seq});
 }
 
-int raft::server::AddLog(const std::string &str)
+void raft::server::ReplyReadIndex(const ReadIndexReply &reply)
 {
     std::unique_lock<std::mutex> _(m_mutex);
-    if (m_is_stop || m_state != State::Leader)
-        return m_votedfor;
+    const auto &it = m_read_forwarded.find(reply.seq);
+    if (it == m_read_forwarded.end())
+        return; // 已经超时
+    auto waiter = std::move(it->second);
+    m_read_forwarded.erase(it);
+
+    // 问的不是领导，或者它没能确认地位
+    if (!reply.success)
+    {
+        waiter.promise.set_value(ApplyResult{ApplyResult::Status::NotLeader, -1, m_term, reply.leader_id, buffer()});
+        return;
+    }
 
-    const auto &index = (int)m_log_vec.size();
-    m_log_vec.push_back(Log{index, m_term, false, str});
-    PRINT("index:", index, " term:", m_term, " content:", str);
-    return 0;
+    // 等自己应用到领导给的读索引
+    waiter.index = reply.index;
+    m_read_waiters.push_back(std::move(waiter));
+    ApplyReads();
 }
 
-void raft::server::Start()
+int raft::server::TermAt(int index) const
 {
-    std::unique_lock<std::mutex> _(m_mutex);
-    m_is_stop = false;
-    m_heartbeat = 0;
-    m_vote_count = 0;
-
-    m_state = State::Folower;
-    m_term = 0;
-    m_votedfor = 0;
-    m_log_vec.clear();
-    m_log_vec.push_back(Log{(int)m_log_vec.size(), 0, true, "Start"}); // 初始化一条日志
-
-    m_commit_index = 0;
-    m_last_applied = 0;
-
-    m_next_index_vec.clear();
-    m_match_index_vec.clear();
-
-    //启动定时器
-    auto tmp = m_factory->Get(m_id, m_factory);
-    thread_pool::get(0).submit([tmp]
-                               { tmp->Update(); });
+    if (index < m_snapshot_index || index > LastLogIndex())
+        return -1;
+    const auto &[segment, k] = m_log.locate(index - m_snapshot_index);
+    return segment->terms[k];
 }
 
-void raft::server::Stop()
+int raft::server::FirstIndex(const log_entries::view &log)
 {
-    std::unique_lock<std::mutex> _(m_mutex);
-    m_is_stop = true;
-    PRINT("");
+    const auto &[segment, k] = log.locate(0);
+    return segment->indexes[k];
 }
 
-void raft::server::ReStart()
+int raft::server::LastIndex(const log_entries::view &log)
 {
-    std::unique_lock<std::mutex> _(m_mutex);
-    m_is_stop = false;
-    m_heartbeat = 0;
-    m_vote_count = 0;
-
-    // m_state = State::Folower;
-    // m_term = 0;
-    // m_votedfor = 0;
-    // m_log_vec.clear();
-    // m_log_vec.push_back(Log{(int)m_log_vec.size(), 0, true, "Start"}); // 初始化一条日志
+    const auto &[segment, k] = log.locate(log.size() - 1);
+    return segment->indexes[k];
+}
 
-    // m_commit_index = 0;
-    // m_last_applied = 0;
+int raft::server::TermAt(const log_entries::view &log, int index)
+{
+    const auto &first = FirstIndex(log);
+    if (index < first || index > LastIndex(log))
+        return -1;
+    const auto &[segment, k] = log.locate(index - first);
+    return segment->terms[k];
+}
 
-    m_next_index_vec.clear();
-    m_match_index_vec.clear();
-    PRINT("");
+int raft::server::LastIndexOfTerm(const log_entries::view &log, int term)
+{
+    // 任期递增，二分找最后一条不大于term的
+    size_t lo = 0;
+    size_t hi = log.size();
+    while (lo < hi)
+    {
+        const auto &mid = lo + (hi - lo) / 2;
+        const auto &[segment, k] = log.locate(mid);
+        if (segment->terms[k] <= term)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return -1;
+    const auto &[segment, k] = log.locate(lo - 1);
+    return segment->terms[k] == term ? segment->indexes[k] : -1;
 }
 
-void raft::server::Update()
+void raft::server::AppendLog(Log log)
 {
-    while (true)
+    if (m_term_vec.empty() || m_term_vec.back().first != log.term)
+        m_term_vec.emplace_back(log.term, log.index);
+
+    // 成员配置添加时就生效
+    Membership m;
+    const auto &index = log.index;
+    const bool &changed = log.is_server && Membership::Decode(log.content, m);
+    m_log.push_back(std::move(log));
+    if (changed)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        m_memberships.emplace_back(index, std::move(m));
+        MembershipChanged();
+    }
+}
 
-        std::unique_lock<std::mutex> _(m_mutex);
-        if (m_is_stop)
-            continue;
+void raft::server::TruncateLog(int index)
+{
+    m_log.truncate(index - m_snapshot_index);
+    while (!m_term_vec.empty() && m_term_vec.back().second >= index)
+        m_term_vec.pop_back();
 
-        switch (m_state)
-        {
-        case State::Leader:
-        {
-            // 领导同步日志信息，发0条当心跳
-            AppendEntriesArgs args;
-            args.term = m_term;
-            args.leader_id = m_id;
-            args.commit_index = m_commit_index;
-            for (const auto &id : m_factory->GetAllObjKey())
-            {
-                if (id == m_id || id < 0 || id >= m_next_index_vec.size())
-                    continue;
+    // 被删掉的成员配置不再生效，回到之前的
+    bool changed = false;
+    while (!m_memberships.empty() && m_memberships.back().first >= index)
+    {
+        m_memberships.pop_back();
+        changed = true;
+    }
+    if (changed)
+        MembershipChanged();
+}
 
-                const auto &next_index = m_next_index_vec[id];
-                args.pre_log_index = next_index - 1;
-                args.pre_log_term = args.pre_log_index >= 0 && args.pre_log_index < (int)m_log_vec.size() ? m_log_vec[args.pre_log_index].term : 0;
+void raft::server::RebuildLogIndex()
+{
+    m_term_vec.clear();
+    while (!m_memberships.empty() && m_memberships.back().first > m_snapshot_index)
+        m_memberships.pop_back();
 
-                args.log_vec.clear();
-                for (int i = next_index; i < (int)m_log_vec.size(); ++i)
-                    args.log_vec.push_back(m_log_vec[i]);
+    Membership m;
+    for (size_t i = 0; i < m_log.size(); ++i)
+    {
+        const auto &[segment, k] = m_log.locate(i);
+        if (m_term_vec.empty() || m_term_vec.back().first != segment->terms[k])
+            m_term_vec.emplace_back(segment->terms[k], segment->indexes[k]);
+        if (segment->servers[k] && segment->indexes[k] > m_snapshot_index && Membership::Decode(segment->contents[k], m))
+            m_memberships.emplace_back(segment->indexes[k], std::move(m));
+    }
+    MembershipChanged();
+}
 
-                auto tmp = m_factory->Get(id, m_factory);
-                thread_pool::get(0).submit([tmp, args]
-                                           { tmp->RequestAppendEntries(args); });
-            }
-        }
-        break;
-        case State::Candidate:
-            break;
-        case State::Folower:
-        {
-            // 心跳计数，超时则触发选举
-            if (++m_heartbeat == 6)
-            {
-                m_heartbeat = 0;
-                m_state = State::Candidate;
-                auto tmp = m_factory->Get(m_id, m_factory);
-                thread_pool::get(0).submit([tmp]
-                                           { tmp->Election(); });
-            }
-        }
-        break;
-        default:
-            return;
-        }
+int raft::server::FirstIndexOfTerm(int term) const
+{
+    const auto &it = std::lower_bound(m_term_vec.begin(), m_term_vec.end(), std::make_pair(term, std::numeric_limits<int>::min()));
+    if (it == m_term_vec.end() || it->first != term)
+        return -1;
+    return std::max(it->second, m_snapshot_index);
+}
 
-        // 保存日志
-        if (m_state == State::Leader && !m_match_index_vec.empty())
-        {
-            // 不负责为之前的领导留下的过半复制日志专门进行提交，只提交自己任期内的日志
-            auto match_vec = m_match_index_vec;
-            std::sort(match_vec.begin(), match_vec.end());
-            const auto &mid_index = match_vec[(int)match_vec.size() / 2]; // 超过半数提交
-            if (m_log_vec[mid_index].term == m_term)
-            {
-                // 提交自己任期日志时能够自动把之前的都提交
-                m_commit_index = std::max(mid_index, m_commit_index);
-            }
-        }
+void raft::server::TakeSnapshot()
+{
+    const auto &index = m_last_applied;
+    if (index <= m_snapshot_index || index > LastLogIndex())
+        return;
 
-        for (; m_last_applied <= m_commit_index; ++m_last_applied)
-        {
-            if (m_last_applied >= 0 && m_last_applied < (int)m_log_vec.size())
-            {
-                const auto &log = m_log_vec[m_last_applied];
-                if (!log.is_server)
-                    PRINT("apply_log[", m_last_applied, "]{index:", log.index, " term:", log.term, " content:", log.content, "}");
-            }
-            else
-            {
-                PRINT("apply_log[", m_last_applied, "] fail");
-            }
-        }
+    // 快照的最后一条留在日志开头，用于一致性检查（已发布的条目不能修改，内容随所在的块一起释放）
+    // 先发布快照再压缩日志，读者在视图里找不到的日志一定在已发布的快照里
+    // 快照带上当时生效的成员配置，压缩掉的配置只留这一个
+    std::string membership;
+    const auto &it = std::upper_bound(m_memberships.begin(), m_memberships.end(), index, [](int i, const std::pair<int, Membership> &m)
+                                      { return i < m.first; });
+    if (it != m_memberships.begin())
+    {
+        membership = std::prev(it)->second.Encode();
+        m_memberships.erase(m_memberships.begin(), std::prev(it));
     }
+    m_snapshot = PackSnapshot(membership, m_state_machine->Snapshot());
+    m_snapshot_term = TermAt(index);
+    m_snapshot_index = index;
+    PublishSnapshot();
+    m_log.pop_front(index - FirstIndex(m_log.snapshot()));
+    while (m_term_vec.size() > 1 && m_term_vec[1].second <= index)
+        m_term_vec.erase(m_term_vec.begin());
+    PRINT("index:{} term:{} size:{} log_count:{}", m_snapshot_index, m_snapshot_term, m_snapshot.size(), m_log.size());
+
+    if (m_wal)
+        m_wal->SaveSnapshot(m_snapshot_index, m_snapshot_term, m_snapshot);
 }
 
-void raft::server::Election()
+void raft::server::RestoreSnapshot(int index, int term, buffer data)
 {
-    while (true)
-    {
-        // 随机计时器
-        std::random_device rd;
-        std::default_random_engine eng(rd());
-        std::uniform_int_distribution<int> dist(100, 300);
-        const auto &sleep = dist(eng);
-        PRINT("sleep:", sleep);
-        std::this_thread::sleep_for(std::chrono::milliseconds(sleep));
-
-        std::unique_lock<std::mutex> _(m_mutex);
-        if (m_is_stop || m_state != State::Candidate) // 计时期间可能不是候选人了
-            break;
-
-        // 任期+1，并投自己一票
-        m_vote_count = 1;
-        ++m_term;
-        m_votedfor = m_id;
-        PRINT("vote self");
-
-        // 发起请求投票
-        const VoteArgs &args{m_term, m_id, (int)m_log_vec.size() - 1, m_log_vec.empty() ? 0 : m_log_vec.back().term};
-        for (const auto &id : m_factory->GetAllObjKey())
-        {
-            if (id == m_id)
-                continue;
+    // 快照之后还有一致的日志则保留，否则全部丢弃
+    const bool &keep = TermAt(index) == term;
+    m_snapshot_index = index;
+    m_snapshot_term = term;
+    m_snapshot = std::move(data);
+    PublishSnapshot();
+    if (keep)
+        m_log.pop_front(index - FirstIndex(m_log.snapshot()));
+    else
+        m_log.assign(Log{index, term, true, buffer()});
+    RestoreStateMachine();
+    RebuildLogIndex();
 
-            auto tmp = m_factory->Get(id, m_factory);
-            thread_pool::get(0).submit([tmp, args]
-                                       { tmp->RequestVote(args); });
-        }
+    m_commit_index = std::max(m_commit_index.load(), index);
+    m_last_applied = index;
+    PRINT("index:{} term:{} size:{} keep:{}", index, term, m_snapshot.size(), keep);
+
+    if (m_wal)
+    {
+        PersistState();
+        m_wal->SaveSnapshot(index, term, m_snapshot);
+        // 快照之后写一条同索引的记录，回放时截断之后不一致的旧日志
+        if (!keep)
+            m_wal->SaveLog(index, term, true, buffer());
     }
 }
 
@@ -239,49 +1300,64 @@ void raft::server::RequestVote(const VoteArgs &args)
 
     VoteReply reply{};
 
-    // 候选人任期比我大，或者我没有投票，或者投的是同一个候选人
-    if (args.term >= m_term || m_votedfor == 0 || m_votedfor == args.candidate_id)
+    // 租约读：领导的心跳超时之前不给别人投票，领导的租约内不会选出新领导
+    if (m_config.lease_read && m_state == State::Folower && m_leader_id != 0 && args.candidate_id != m_leader_id && std::chrono::steady_clock::now() < m_election_deadline)
+    {
+        reply.id = m_id;
+        reply.term = m_term;
+        PRINT("not_vote {} leader:{}", args.candidate_id, m_leader_id);
+        AfterPersist(args.candidate_id, reply, lane::control);
+        return;
+    }
+
+    // 候选人任期比我大，先跟上它的任期（领导卸任），新任期里还没有投票
+    // 跟随者和候选人不重置选举超时，投出票才重置：日志落后的候选人反复发起选举时，日志新的server仍会超时发起选举
+    if (args.term > m_term)
+    {
+        const auto deadline = m_election_deadline;
+        const bool &was_leader = m_state == State::Leader;
+        ToFollower(args.term, 0);
+        if (!was_leader)
+            m_election_deadline = deadline;
+    }
+
+    // 同一个任期只投一票：我没有投票，或者投的就是这个候选人；任期比我小的不投
+    if (args.term == m_term && (m_votedfor == 0 || m_votedfor == args.candidate_id))
     {
         // 候选人的日志至少要和我一样新
-        const auto &last_log_term = m_log_vec.empty() ? 0 : m_log_vec.back().term;
+        const auto &last_log_term = LastLogTerm();
         if (args.last_log_term > last_log_term ||
-            (args.last_log_term == last_log_term && args.last_log_index >= (int)m_log_vec.size() - 1))
+            (args.last_log_term == last_log_term && args.last_log_index >= LastLogIndex()))
         {
             ToFollower(args.term, args.candidate_id);
             reply.vote_granted = true;
         }
     }
 
-    if (!reply.vote_granted && m_state == State::Leader)
-        ToFollower(args.term, 0);
-
+    reply.id = m_id;
     reply.term = m_term;
 
-    PRINT(reply.vote_granted ? "vote " : "not_vote ", args.candidate_id);
+    PRINT("{} {}", reply.vote_granted ? "vote" : "not_vote", args.candidate_id);
 
     // 投票返回
-    auto tmp = m_factory->Get(args.candidate_id, m_factory);
-    thread_pool::get(0).submit([tmp, reply]
-                               { tmp->ReplyVote(reply); });
+    AfterPersist(args.candidate_id, reply, lane::control);
 }
 
 void raft::server::ReplyVote(const VoteReply &reply)
 {
+    // 只计入同一任期的那一轮选举，够数时由计数回调当选
+    if (const auto &q = m_vote_quorum.load(); q && q->tag() == reply.term)
+        q->ack(reply.id, reply.vote_granted);
+
+    if (reply.vote_granted)
+        return;
+
+    // 拒绝时可能是任期比我大
     std::unique_lock<std::mutex> _(m_mutex);
     if (m_is_stop || m_state != State::Candidate) // 收到投票返回时可能不是候选人了
         return;
-
-    if (reply.vote_granted)
-    {
-        // 同意，则投票数+1，如果获得超过半数的投票，则当选领导
-        if (++m_vote_count * 2 >= (int)m_factory->GetAllObjKey().size() - 1)
-            ToLeader();
-    }
-    else if (reply.term > m_term)
-    {
-        // 任期比我大
+    if (reply.term > m_term)
         ToFollower(reply.term, 0);
-    }
 }
 
 void raft::server::RequestAppendEntries(const AppendEntriesArgs &args)
@@ -300,14 +1376,7 @@ void raft::server::RequestAppendEntries(const AppendEntriesArgs &args)
     }
     else
     {
-        // 重置心跳
-        m_heartbeat = 0;
-
-        // 任期要与领导一致
-        m_term = args.term;
-
-        if (m_state != State::Folower)
-            ToFollower(args.term, args.leader_id);
+        FollowLeader(args.term, args.leader_id);
 
         if (args.log_vec.empty())
         {
@@ -316,44 +1385,70 @@ void raft::server::RequestAppendEntries(const AppendEntriesArgs &args)
             // 则更新我的提交进度索引
             if (m_commit_index < args.commit_index &&
                 args.pre_log_index >= 0 &&
-                args.pre_log_index < (int)m_log_vec.size() &&
-                m_log_vec[args.pre_log_index].term == args.pre_log_term)
+                TermAt(args.pre_log_index) == args.pre_log_term)
             {
                 m_commit_index = std::min(args.pre_log_index, args.commit_index);
+                ApplyLog();
             }
 
-            // 心跳无返回
-            return;
+            // 心跳无返回，领导确认地位的除外
+            if (args.read_seq == 0)
+                return;
+            reply.success = true;
         }
-
-        if (m_commit_index >= args.pre_log_index + (int)args.log_vec.size())
+        else if (m_commit_index >= args.pre_log_index + (int)args.log_vec.size())
         {
             // 发过来的日志都在我的提交进度内，返回成功
             reply.success = true;
         }
-        else if ((args.pre_log_index >= (int)m_log_vec.size()) ||
-                 (args.pre_log_index >= 0 && m_log_vec[args.pre_log_index].term != args.pre_log_term))
+        else if ((args.pre_log_index > LastLogIndex()) ||
+                 (args.pre_log_index >= m_snapshot_index && TermAt(args.pre_log_index) != args.pre_log_term))
         {
-            if ((args.pre_log_index >= (int)m_log_vec.size()))
-                PRINT("not_match ", args.pre_log_index, " >= ", m_log_vec.size());
+            if ((args.pre_log_index > LastLogIndex()))
+                PRINT("not_match {} > {}", args.pre_log_index, LastLogIndex());
             else
-                PRINT("not_match ", args.pre_log_index, " >= 0 && ", m_log_vec[args.pre_log_index].term, " != ", args.pre_log_term);
+                PRINT("not_match {} >= {} && {} != {}", args.pre_log_index, m_snapshot_index, TermAt(args.pre_log_index), args.pre_log_term);
 
             // 领导记录关于我的提交进度，与我实际进度不一致，则返回失败
+            // 带上冲突的任期和它在我日志中的第一条，领导可以一次跳过整个任期
             reply.success = false;
+            if (args.pre_log_index > LastLogIndex())
+            {
+                reply.conflict_index = LastLogIndex() + 1;
+            }
+            else
+            {
+                reply.conflict_term = TermAt(args.pre_log_index);
+                reply.conflict_index = std::max(FirstIndexOfTerm(reply.conflict_term), m_snapshot_index + 1);
+            }
         }
         else
         {
-            PRINT("log_push ", m_commit_index, " ", args.commit_index, " ", args.pre_log_index, " ", args.pre_log_term, " ", args.log_vec.size());
+            PRINT("log_push {} {} {} {} {}", m_commit_index, args.commit_index, args.pre_log_index, args.pre_log_term, args.log_vec.size());
 
             // 领导记录关于我的提交进度，与我实际进度一致，则添加新日志，返回成功
-            m_log_vec.resize(args.pre_log_index + 1);
-            m_log_vec.insert(m_log_vec.end(), args.log_vec.begin(), args.log_vec.end());
+            // 只在任期冲突处截断，重复或乱序到达的旧请求不能删掉已有的日志
+            // 已压缩进快照的日志都已提交，必然一致
+            int index = args.pre_log_index + 1;
+            auto it = args.log_vec.begin();
+            for (; it != args.log_vec.end() && index <= LastLogIndex(); ++it, ++index)
+            {
+                if (index > m_snapshot_index && LogAt(index).term != it->term)
+                {
+                    TruncateLog(index);
+                    break;
+                }
+            }
+            const auto &from = LastLogIndex() + 1;
+            for (; it != args.log_vec.end(); ++it)
+                AppendLog(*it);
+            PersistLog(from);
 
             if (m_commit_index < args.commit_index)
             {
                 // 更新我的提交记录
-                m_commit_index = std::min(args.commit_index, std::max(args.pre_log_index, m_commit_index));
+                m_commit_index = std::min(args.commit_index, std::max(args.pre_log_index + (int)args.log_vec.size(), m_commit_index.load()));
+                ApplyLog();
             }
 
             reply.success = true;
@@ -364,117 +1459,409 @@ void raft::server::RequestAppendEntries(const AppendEntriesArgs &args)
     reply.term = m_term;
     reply.log_count = (int)args.log_vec.size();
     reply.commit_index = m_commit_index;
+    reply.match_index = reply.success ? args.pre_log_index + reply.log_count : 0;
+    reply.epoch = args.epoch;
+    reply.read_seq = args.read_seq;
 
-    auto tmp = m_factory->Get(args.leader_id, m_factory);
-    thread_pool::get(0).submit([tmp, reply]
-                               { tmp->ReplyAppendEntries(reply); });
+    // 日志和任期落盘后才应答，确认地位的应答走控制面
+    AfterPersist(args.leader_id, reply, args.read_seq != 0 ? lane::control : lane::data);
 }
 
 void raft::server::ReplyAppendEntries(const AppendEntriesReply &reply)
 {
-    std::unique_lock<std::mutex> _(m_mutex);
-    if (m_is_stop || m_state != State::Leader)
+    // 确认地位的心跳应答只计数，与同步进度无关
+    if (reply.read_seq != 0)
+    {
+        if (const auto &q = m_read_quorum.load(); q && q->tag() == reply.read_seq)
+            q->ack(reply.id, reply.success);
+        return;
+    }
+
+    // 不加m_mutex，只锁这个跟随者的同步进度，不同跟随者的应答并行处理
+    const auto &rep = m_replication.load();
+    if (m_is_stop || m_state != State::Leader || !rep)
     {
-        PRINT("return stop:", m_is_stop, " state:", (int)m_state);
+        PRINT("return stop:{} state:{}", m_is_stop, (int)m_state.load());
         return;
     }
 
-    if (reply.id < 0 || reply.id >= (int)m_next_index_vec.size())
+    auto *found = rep->Find(reply.id);
+    if (!found)
     {
-        PRINT("return id:", reply.id);
+        PRINT("return id:{}", reply.id);
         return;
     }
 
+    // 回退前发出的请求，只用来更新同步进度
+    auto &progress = *found;
+    std::unique_lock<std::mutex> lock(progress.mutex);
+    if (progress.retired)
+        return;
+    const auto &log = m_log.snapshot();
+    const bool &current = reply.epoch == progress.epoch;
+    if (current)
+        progress.inflight = std::max(progress.inflight - 1, 0);
+
     if (reply.success)
     {
-        if (reply.id >= (int)m_match_index_vec.size())
+        if (current)
+            progress.stall = 0;
+
+        if (reply.log_count > 0)
+            PRINT("succ {} {} {} count:{}", reply.id, progress.match_index, progress.next_index, reply.log_count);
+
+        // 添加成功，更新跟随者的同步进度
+        const auto match_index = std::max(progress.match_index.load(), reply.match_index);
+        progress.match_index.store(match_index, std::memory_order_release);
+        progress.next_index = std::max(progress.next_index, match_index + 1);
+
+        // 本轮的请求都已返回，还没确认的日志一定被拒绝了（乱序先到），心跳不会返回，只能从确认处重发
+        if (current && progress.inflight == 0)
+            progress.next_index = match_index + 1;
+
+        // 推进提交要加m_mutex，先放开这个跟随者，保持m_mutex在前的加锁顺序
+        lock.unlock();
+        TryCommit(*rep, match_index);
+        lock.lock();
+
+        // 窗口空出来了，继续同步
+        SendAppendEntries(*rep, reply.id, progress, m_log.snapshot(), false);
+    }
+    else if (current)
+    {
+        if (reply.term <= rep->term && reply.conflict_term < 0 && reply.conflict_index >= progress.sent_from && reply.conflict_index < progress.next_index && progress.inflight > 0)
         {
-            PRINT("return id2:", reply.id);
-            return;
+            // 跟随者只是缺日志，缺的部分本轮已经发出且还有请求在途，是后发的请求先到了（乱序），先不回退
+            // 在途的请求都返回后仍然缺，再回退
+        }
+        else if (reply.term <= rep->term)
+        {
+            // 添加失败，按冲突提示回退，之前发出的请求全部作废
+            // 我也有冲突的任期，则从我这个任期的最后一条之后开始，否则跳过跟随者的整个冲突任期
+            // 跟随者提交进度之内的日志一定一致，不会退到它之前
+            int next_index = reply.conflict_index;
+            if (reply.conflict_term >= 0)
+            {
+                const auto &last = LastIndexOfTerm(log, reply.conflict_term);
+                if (last >= 0)
+                    next_index = last + 1;
+            }
+            next_index = std::min(std::max(next_index, std::max(reply.commit_index, progress.match_index.load()) + 1), LastIndex(log) + 1);
+
+            PRINT("fail {} {} -> {} conflict:{}/{} commit:{}", reply.id, progress.next_index, next_index, reply.conflict_term, reply.conflict_index, reply.commit_index);
+            ++progress.epoch;
+            progress.inflight = 0;
+            progress.stall = 0;
+            progress.sent_from = std::numeric_limits<int>::max();
+            progress.next_index = next_index;
+            SendAppendEntries(*rep, reply.id, progress, log, false);
+        }
+        else
+        {
+            // 任期比我大，不处理
         }
+    }
+}
 
-        if (reply.log_count > 0)
-            PRINT("succ ", reply.id, " ", m_match_index_vec[reply.id], " ", m_next_index_vec[reply.id], " count:", reply.log_count);
+void raft::server::RequestInstallSnapshot(const InstallSnapshotArgs &args)
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (m_is_stop)
+        return;
+
+    InstallSnapshotReply reply{};
+    reply.id = m_id;
+    reply.last_index = args.last_index;
+    reply.epoch = args.epoch;
 
-        // 添加成功，更新跟随者的提交进度和同步进度
-        m_match_index_vec[reply.id] = std::max(m_match_index_vec[reply.id], m_next_index_vec[reply.id] + reply.log_count - 1);
-        m_next_index_vec[reply.id] += reply.log_count;
+    if (args.term < m_term)
+    {
+        // 我的任期比领导的大，则无视
+        PRINT("term bigger than leader");
     }
     else
     {
-        if (reply.term <= m_term)
+        FollowLeader(args.term, args.leader_id);
+
+        if (args.offset == 0 && args.last_index > m_commit_index)
+        {
+            // 从头开始接收新的快照
+            m_recv_snapshot_index = args.last_index;
+            m_recv_snapshot_term = args.last_term;
+            m_recv_snapshot.clear();
+        }
+
+        if (args.last_index <= m_commit_index)
+        {
+            // 快照之内的日志我都已经提交了，不需要安装
+            reply.done = true;
+        }
+        else if (args.last_index != m_recv_snapshot_index || args.last_term != m_recv_snapshot_term)
+        {
+            // 不是正在接收的快照，让领导从头发送
+            reply.offset = 0;
+        }
+        else if (args.offset != (int)m_recv_snapshot.size())
         {
-            // 添加失败，更新跟随者的提交进度
-            PRINT("fail ", reply.id, " ", m_next_index_vec[reply.id], " ", reply.commit_index);
-            m_next_index_vec[reply.id] = reply.commit_index + 1;
+            // 重复或丢失了数据块，让领导从已收到的位置继续
+            reply.offset = (int)m_recv_snapshot.size();
         }
         else
         {
-            // 任期比我大，不处理
+            m_recv_snapshot.append(args.data.data(), args.data.size());
+            reply.offset = (int)m_recv_snapshot.size();
+            if (args.done)
+            {
+                RestoreSnapshot(args.last_index, args.last_term, buffer(std::move(m_recv_snapshot)));
+                m_recv_snapshot_index = -1;
+                m_recv_snapshot.clear();
+                reply.done = true;
+            }
         }
     }
+    reply.term = m_term;
+
+    // 快照和任期落盘后才应答
+    AfterPersist(args.leader_id, reply);
 }
 
-void raft::server::ToLeader()
+void raft::server::ReplyInstallSnapshot(const InstallSnapshotReply &reply)
 {
-    m_state = State::Leader;
-    m_heartbeat = 0;
-    m_vote_count = 0;
-    m_votedfor = 0;
+    // 同ReplyAppendEntries，只锁这个跟随者
+    const auto &rep = m_replication.load();
+    auto *found = rep ? rep->Find(reply.id) : nullptr;
+    if (m_is_stop || m_state != State::Leader || !found)
+        return;
+
+    // 回退前发出的请求，或者任期比我大，不处理
+    auto &progress = *found;
+    std::unique_lock<std::mutex> lock(progress.mutex);
+    if (progress.retired || reply.epoch != progress.epoch || reply.term > rep->term || reply.last_index != progress.snapshot_index)
+        return;
+    progress.inflight = std::max(progress.inflight - 1, 0);
+    progress.stall = 0;
 
+    if (reply.done)
     {
-        const auto &len = m_factory->GetAllObjKey().size();
-        m_next_index_vec.clear();
-        m_next_index_vec.resize(len, 0);
-        m_match_index_vec.clear();
-        m_match_index_vec.resize(len, 0);
+        // 快照安装完成，从快照之后继续同步日志
+        PRINT("succ {} snapshot:{}", reply.id, progress.snapshot_index);
+        const auto match_index = std::max(progress.match_index.load(), progress.snapshot_index);
+        progress.match_index.store(match_index, std::memory_order_release);
+        progress.next_index = std::max(progress.next_index, match_index + 1);
+        progress.snapshot_index = -1;
+        progress.snapshot = buffer();
+
+        lock.unlock();
+        TryCommit(*rep, match_index);
+        lock.lock();
     }
+    else
+    {
+        progress.snapshot_offset = reply.offset;
+    }
+    SendAppendEntries(*rep, reply.id, progress, m_log.snapshot(), false);
+}
+
+void raft::server::PublishSnapshot()
+{
+    m_snapshot_ref.store(std::make_shared<const Snapshot>(Snapshot{m_snapshot_index, m_snapshot_term, m_snapshot}), std::memory_order_release);
+}
+
+void raft::server::OpenWal()
+{
+    if (m_config.wal_dir.empty())
+        return;
+
+    // 等之前的写入结束，避免新旧两个预写日志同时操作文件
+    if (m_wal)
+    {
+        std::promise<void> done;
+        m_wal->Sync([&done]
+                    { done.set_value(); });
+        thread_pool::blocking_region blocking;
+        done.get_future().wait();
+    }
+
+    wal::Options options;
+    options.dir = m_config.wal_dir + "/" + std::to_string(m_id);
+    options.segment_size = m_config.wal_segment_size;
+    options.max_batch_bytes = m_config.wal_max_batch_bytes;
+    options.max_delay = std::chrono::milliseconds(m_config.wal_max_delay);
+    m_wal = std::make_shared<wal>(options);
+
+    const auto &ok = m_wal->Load([this](int index, int term, buffer data)
+                                 {
+                                     m_snapshot_index = index;
+                                     m_snapshot_term = term;
+                                     m_snapshot = std::move(data);
+                                     RestoreStateMachine();
+                                     m_log.assign(Log{index, term, true, buffer()});
+                                     RebuildLogIndex(); },
+                                 [this](int term, int votedfor)
+                                 {
+                                     m_term = term;
+                                     m_votedfor = votedfor; },
+                                 [this](int index, int term, bool is_server, buffer content)
+                                 {
+                                     // 同一个索引再次出现，说明之后的日志被截断过，快照之前的日志跳过
+                                     if (index < m_snapshot_index || index > LastLogIndex() + 1)
+                                         return;
+                                     TruncateLog(index);
+                                     if (index == m_snapshot_index)
+                                         content = buffer();
+                                     AppendLog(Log{index, term, is_server, std::move(content)}); });
+    m_persist_term = m_term;
+    m_persist_votedfor = m_votedfor;
+    PRINT("load {} term:{} votedfor:{} snapshot:{} log_count:{}", ok ? "succ" : "fail", m_term, m_votedfor, m_snapshot_index, m_log.size());
+    assert(ok);
+}
+
+void raft::server::PersistState()
+{
+    if (!m_wal || (m_term == m_persist_term && m_votedfor == m_persist_votedfor))
+        return;
+
+    m_wal->SaveState(m_term, m_votedfor);
+    m_persist_term = m_term;
+    m_persist_votedfor = m_votedfor;
+}
+
+void raft::server::PersistLog(int from)
+{
+    const auto &last = LastLogIndex();
+    if (m_wal)
+    {
+        PersistState();
+        for (int i = from; i <= last; ++i)
+            m_wal->SaveLog(LogAt(i).index, LogAt(i).term, LogAt(i).is_server, LogAt(i).content);
+    }
+
+    if (m_state != State::Leader)
+        return;
+
+    // 领导自己的日志也要落盘后才能计入提交
+    if (!m_wal)
+    {
+        LogPersisted(m_term, last);
+        return;
+    }
+    auto tmp = m_factory->Get(m_id, m_factory);
+    const auto &term = m_term.load();
+    m_wal->Sync([tmp, term, last]
+                {
+                    thread_pool::get(0).post_to(tmp->m_id, [tmp, term, last]
+                                                {
+                                                    std::unique_lock<std::mutex> _(tmp->m_mutex);
+                                                    tmp->LogPersisted(term, last); }); });
+}
 
-    m_log_vec.push_back(Log{(int)m_log_vec.size(), m_term, true, "ToLeader:" + std::to_string(m_id)});
+void raft::server::AfterPersist(int to, message msg, lane l)
+{
+    if (!m_wal)
+    {
+        m_transport->Send(to, std::move(msg), l);
+        return;
+    }
+
+    PersistState();
+    m_wal->Sync([transport = m_transport, to, msg = std::move(msg), l]() mutable
+                { transport->Send(to, std::move(msg), l); });
+}
+
+void raft::server::Receive(const message &msg)
+{
+    if (const auto *m = std::get_if<VoteArgs>(&msg))
+        RequestVote(*m);
+    else if (const auto *m = std::get_if<VoteReply>(&msg))
+        ReplyVote(*m);
+    else if (const auto *m = std::get_if<AppendEntriesArgs>(&msg))
+        RequestAppendEntries(*m);
+    else if (const auto *m = std::get_if<AppendEntriesReply>(&msg))
+        ReplyAppendEntries(*m);
+    else if (const auto *m = std::get_if<InstallSnapshotArgs>(&msg))
+        RequestInstallSnapshot(*m);
+    else if (const auto *m = std::get_if<InstallSnapshotReply>(&msg))
+        ReplyInstallSnapshot(*m);
+    else if (const auto *m = std::get_if<ReadIndexArgs>(&msg))
+        RequestReadIndex(*m);
+    else if (const auto *m = std::get_if<ReadIndexReply>(&msg))
+        ReplyReadIndex(*m);
+}
+
+void raft::server::LogPersisted(int term, int index)
+{
+    const auto &rep = m_replication.load();
+    auto *found = rep ? rep->Find(m_id) : nullptr;
+    if (m_state != State::Leader || m_term != term || !found)
+        return;
+
+    auto &progress = *found;
+    {
+        std::unique_lock<std::mutex> _(progress.mutex);
+        index = std::max(progress.match_index.load(), index);
+        progress.match_index.store(index, std::memory_order_release);
+    }
+    AdvanceCommit(index);
+}
+
+void raft::server::ToLeader()
+{
+    m_state = State::Leader;
+    m_vote_quorum.store(nullptr);
+    m_leader_id = m_id; // 这一任期的票投给了自己，保持不变，不会再投给同任期的别人
+
+    // 每个任期一份新的同步进度，上一任期的应答拿到的是旧的，不会改到这一份
+    // 先假设跟随者和我一致，不一致时再回退，避免一上任就给所有人发快照
+    RetireReplication();
+    RebuildReplication();
+
+    AppendLog(Log{LastLogIndex() + 1, m_term, true, "ToLeader:" + std::to_string(m_id)});
+    PersistLog(LastLogIndex());
     PRINT("");
+
+    // 立即发送心跳，不等下一次定时
+    BroadcastAppendEntries(true);
 }
 
 void raft::server::ToFollower(int term, int votedfor)
 {
+    const bool &was_leader = m_state == State::Leader;
+    if (term > m_term)
+        m_leader_id = 0; // 新任期还不知道领导是谁
     m_state = State::Folower;
-    m_heartbeat = 0;
-    m_vote_count = 0;
+    RetireReplication();
+    ResetElectionTimer(ELECTION_TIMEOUT, ELECTION_TIMEOUT);
+    m_vote_quorum.store(nullptr);
     m_term = term;
     m_votedfor = votedfor;
     PRINT("");
-}
 
-void raft::server::Print()
-{
-    while (true)
+    // 不再是领导，等待应用的提议和读立即失败，带上新的领导
+    if (was_leader)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(300));
-
-        std::unique_lock<std::mutex> _(m_mutex);
-        if (m_print_map.empty())
-            continue;
-
-        auto it = m_print_map.begin();
-        while (!it->second.empty())
-        {
-            printf("[%lld] %s\n", it->first, it->second.front().c_str());
-            it->second.pop();
-        }
-        m_print_map.erase(it);
+        FailProposals(ApplyResult::Status::LeaderChanged);
+        FailReads(ApplyResult::Status::LeaderChanged);
     }
 }
 
-void raft::server::AddPrint(const std::string &str)
+void raft::server::FollowLeader(int term, int leader_id)
 {
-    std::unique_lock<std::mutex> _(m_mutex);
-    m_print_map[std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock().now().time_since_epoch()).count()].push(str);
+    // 任期要与领导一致：任期比我大时跟上，新任期里还没有投票，不能把上一任期的票带过去落盘
+    // 同一任期的候选人变回跟随者，保留已投的票
+    if (term > m_term || m_state != State::Folower)
+        ToFollower(term, term > m_term ? 0 : m_votedfor);
+
+    // 重置心跳
+    ResetElectionTimer(ELECTION_TIMEOUT, ELECTION_TIMEOUT);
+    m_leader_id = leader_id;
 }
 
 void raft::server::PrintAllLog()
 {
     std::unique_lock<std::mutex> _(m_mutex);
-    for (const auto &log : m_log_vec)
-        PRINT("index:", log.index, " term:", log.term, " is_server:", log.is_server, " content:", log.content);
+    PRINT("snapshot index:{} term:{} size:{}", m_snapshot_index, m_snapshot_term, m_snapshot.size());
+    for (const auto &log : m_log.snapshot())
+        PRINT("index:{} term:{} is_server:{} content:{}", log.index, log.term, log.is_server, log.content);
 }
 
 void raft::server::PrintAllApplyLog()
@@ -482,5 +1869,5 @@ void raft::server::PrintAllApplyLog()
     const auto &log_vec = ApplyLogVec();
     std::unique_lock<std::mutex> _(m_mutex);
     for (const auto &log : log_vec)
-        PRINT("index:", log.index, " term:", log.term, " is_server:", log.is_server, " content:", log.content);
+        PRINT("index:{} term:{} is_server:{} content:{}", log.index, log.term, log.is_server, log.content);
 }
@@ -0,0 +1,449 @@
+#ifdef __linux__
+
+#include "tcp_transport.h"
+#include "logger.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr size_t FRAME_HEADER = 9;      // [长度 u32][目标id i32][车道 u8]
+    constexpr size_t MAX_FRAME = 1u << 30;  // 超过则认为数据错乱，断开连接
+    constexpr size_t READ_BLOCK = 64 * 1024; // 接收块的大小，大于它的帧单独一块
+
+    sockaddr_in Address(const std::string &host, int port)
+    {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return addr;
+    }
+
+    void NoDelay(int fd)
+    {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+}
+
+raft::tcp_transport::tcp_transport(const Options &options) : m_options(options)
+{
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    Watch(m_wake_fd, EPOLLIN, true);
+
+    m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    auto addr = Address(m_options.host, m_options.port);
+    socklen_t len = sizeof(addr);
+    if (bind(m_listen_fd, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(m_listen_fd, SOMAXCONN) == 0 && getsockname(m_listen_fd, (sockaddr *)&addr, &len) == 0)
+    {
+        m_port = ntohs(addr.sin_port);
+        Watch(m_listen_fd, EPOLLIN, true);
+    }
+    else
+    {
+        RAFT_LOG("tcp_transport->listen failed port:{} errno:{}", m_options.port, errno);
+    }
+
+    m_loop = std::thread([this]
+                         { Loop(); });
+}
+
+raft::tcp_transport::~tcp_transport()
+{
+    {
+        std::unique_lock<std::mutex> _(m_mutex);
+        m_stop = true;
+    }
+    const unsigned long long one = 1;
+    [[maybe_unused]] const auto &n = write(m_wake_fd, &one, sizeof(one));
+    m_loop.join();
+
+    for (const auto &[fd, p] : m_peer_fds)
+        close(fd);
+    for (const auto &[fd, in] : m_inbounds)
+        close(fd);
+    close(m_listen_fd);
+    close(m_wake_fd);
+    close(m_epoll_fd);
+}
+
+void raft::tcp_transport::AddPeer(int id, const std::string &host, int port)
+{
+    auto p = std::make_shared<peer>();
+    p->id = id;
+    p->addr = Address(host, port);
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_peers[id] = std::move(p);
+}
+
+std::shared_ptr<raft::tcp_transport::peer> raft::tcp_transport::FindPeer(int id)
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    const auto &it = m_peers.find(id);
+    return it == m_peers.end() ? nullptr : it->second;
+}
+
+void raft::tcp_transport::Send(int to, message msg, lane l)
+{
+    if (Deliver(to, msg, l))
+        return;
+    const auto &p = FindPeer(to);
+    if (!p)
+        return;
+
+    // 帧头和消息的定长部分在一块里，长度最后填
+    std::string head(FRAME_HEADER, '\0');
+    std::vector<buffer> contents;
+    Encode(msg, head, contents);
+    size_t bytes = head.size();
+    for (const auto &c : contents)
+        bytes += c.size();
+    const auto &len = (unsigned int)(bytes - 4);
+    const auto &lane_byte = (unsigned char)l;
+    memcpy(head.data(), &len, 4);
+    memcpy(head.data() + 4, &to, 4);
+    memcpy(head.data() + 8, &lane_byte, 1);
+
+    bool wake = false;
+    {
+        std::unique_lock<std::mutex> _(p->mutex);
+        if (p->bytes + bytes > m_options.max_queue_bytes)
+            return;
+        p->queue.emplace_back(std::move(head));
+        for (auto &c : contents)
+            p->queue.push_back(std::move(c));
+        p->bytes += bytes;
+        if (!p->scheduled)
+            wake = p->scheduled = true;
+    }
+
+    // 事件循环处理之前的发送都只是入队
+    if (wake)
+    {
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            m_dirty.push_back(p);
+        }
+        const unsigned long long one = 1;
+        [[maybe_unused]] const auto &n = write(m_wake_fd, &one, sizeof(one));
+    }
+}
+
+void raft::tcp_transport::Loop()
+{
+    epoll_event events[64];
+    std::vector<std::shared_ptr<peer>> dirty;
+    std::vector<std::shared_ptr<peer>> waiting;
+    while (true)
+    {
+        const auto &timeout = m_waiting.empty() ? -1 : (int)m_options.reconnect_delay.count();
+        const auto &n = epoll_wait(m_epoll_fd, events, 64, timeout);
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            if (m_stop)
+                return;
+            dirty.swap(m_dirty);
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            const auto &fd = events[i].data.fd;
+            const auto &ev = events[i].events;
+            if (fd == m_wake_fd)
+            {
+                unsigned long long value = 0;
+                [[maybe_unused]] const auto &r = read(m_wake_fd, &value, sizeof(value));
+            }
+            else if (fd == m_listen_fd)
+            {
+                Accept();
+            }
+            else if (const auto &it = m_peer_fds.find(fd); it != m_peer_fds.end())
+            {
+                // 发出的连接只写，可读说明对方关闭了
+                auto p = it->second;
+                if (!p->connecting && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                {
+                    std::unique_lock<std::mutex> _(p->mutex);
+                    char c;
+                    const auto &r = recv(fd, &c, 1, MSG_DONTWAIT);
+                    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                    {
+                        ClosePeer(*p);
+                        continue;
+                    }
+                }
+                if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                    Flush(p);
+            }
+            else
+            {
+                Read(fd);
+            }
+        }
+
+        for (const auto &p : dirty)
+            Flush(p);
+        dirty.clear();
+
+        // 到时间的远端重连，没到的Flush会再放回m_waiting
+        waiting.swap(m_waiting);
+        for (const auto &p : waiting)
+            Flush(p);
+        waiting.clear();
+    }
+}
+
+void raft::tcp_transport::Accept()
+{
+    while (true)
+    {
+        const auto &fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        NoDelay(fd);
+        m_inbounds[fd];
+        Watch(fd, EPOLLIN, true);
+    }
+}
+
+void raft::tcp_transport::Read(int fd)
+{
+    const auto &it = m_inbounds.find(fd);
+    if (it == m_inbounds.end())
+        return;
+    auto &in = it->second;
+
+    bool closed = false;
+    while (true)
+    {
+        if (in.end == in.capacity)
+            Renew(in);
+        const auto &n = recv(fd, in.block.get() + in.end, in.capacity - in.end, 0);
+        if (n > 0)
+        {
+            in.end += n;
+            if (Parse(in))
+                continue;
+            closed = true;
+            break;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+
+    if (closed)
+    {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        m_inbounds.erase(it);
+    }
+}
+
+bool raft::tcp_transport::Parse(inbound &in)
+{
+    while (in.end - in.begin >= 4)
+    {
+        const char *data = in.block.get() + in.begin;
+        unsigned int len = 0;
+        memcpy(&len, data, 4);
+        if (len < FRAME_HEADER - 4 || len > MAX_FRAME)
+        {
+            RAFT_LOG("tcp_transport->read bad frame len:{}", len);
+            return false;
+        }
+        if (in.end - in.begin - 4 < len)
+            break;
+
+        int to = 0;
+        unsigned char l = 0;
+        memcpy(&to, data + 4, 4);
+        memcpy(&l, data + 8, 1);
+        message msg;
+        if (Decode(buffer(in.block, data + FRAME_HEADER, len + 4 - FRAME_HEADER), msg))
+            Deliver(to, msg, l == (unsigned char)lane::control ? lane::control : lane::data);
+        else
+            RAFT_LOG("tcp_transport->read bad message to:{} len:{}", to, len);
+        in.begin += 4 + len;
+    }
+    return true;
+}
+
+void raft::tcp_transport::Renew(inbound &in)
+{
+    // 没凑完的帧长度已知时，新块至少放得下这一帧
+    const auto &pending = in.end - in.begin;
+    size_t capacity = READ_BLOCK;
+    if (pending >= 4)
+    {
+        unsigned int len = 0;
+        memcpy(&len, in.block.get() + in.begin, 4);
+        capacity = std::max(capacity, 4 + (size_t)len);
+    }
+
+    // 没有消息引用旧块且放得下时原地搬到开头
+    if (in.block && in.block.use_count() == 1 && in.capacity >= capacity)
+    {
+        memmove(in.block.get(), in.block.get() + in.begin, pending);
+    }
+    else
+    {
+        std::shared_ptr<char[]> block(new char[capacity]);
+        if (pending > 0)
+            memcpy(block.get(), in.block.get() + in.begin, pending);
+        in.block = std::move(block);
+        in.capacity = capacity;
+    }
+    in.begin = 0;
+    in.end = pending;
+}
+
+void raft::tcp_transport::Connect(peer &p)
+{
+    p.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p.fd < 0)
+        return;
+    NoDelay(p.fd);
+    if (connect(p.fd, (sockaddr *)&p.addr, sizeof(p.addr)) != 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            close(p.fd);
+            p.fd = -1;
+            return;
+        }
+        p.connecting = true;
+    }
+    Watch(p.fd, EPOLLOUT, true);
+}
+
+void raft::tcp_transport::Flush(const std::shared_ptr<peer> &p)
+{
+    std::unique_lock<std::mutex> _(p->mutex);
+    if (p->queue.empty())
+    {
+        p->scheduled = false;
+        return;
+    }
+
+    if (p->fd < 0)
+    {
+        if (std::chrono::steady_clock::now() < p->retry_at)
+        {
+            m_waiting.push_back(p);
+            return;
+        }
+        Connect(*p);
+        if (p->fd < 0)
+        {
+            ClosePeer(*p);
+            return;
+        }
+        m_peer_fds[p->fd] = p;
+        if (p->connecting)
+            return; // 等可写
+    }
+    else if (p->connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+        {
+            ClosePeer(*p);
+            return;
+        }
+        p->connecting = false;
+    }
+
+    // 攒下的块一次发出，写不完等可写
+    const auto max_iov = std::max(m_options.max_iov, 1);
+    std::vector<iovec> iov;
+    iov.reserve(max_iov);
+    while (!p->queue.empty())
+    {
+        iov.clear();
+        size_t offset = p->offset;
+        for (auto it = p->queue.begin(); it != p->queue.end() && (int)iov.size() < max_iov; ++it)
+        {
+            iov.push_back(iovec{(void *)(it->data() + offset), it->size() - offset});
+            offset = 0;
+        }
+
+        msghdr hdr{};
+        hdr.msg_iov = iov.data();
+        hdr.msg_iovlen = iov.size();
+        const auto &n = sendmsg(p->fd, &hdr, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                Watch(p->fd, EPOLLIN | EPOLLOUT, false);
+                return;
+            }
+            ClosePeer(*p);
+            return;
+        }
+
+        p->bytes -= n;
+        size_t left = n;
+        while (left > 0)
+        {
+            const auto &remain = p->queue.front().size() - p->offset;
+            if (left < remain)
+            {
+                p->offset += left;
+                break;
+            }
+            left -= remain;
+            p->queue.pop_front();
+            p->offset = 0;
+        }
+    }
+    p->scheduled = false;
+    Watch(p->fd, EPOLLIN, false);
+}
+
+void raft::tcp_transport::ClosePeer(peer &p)
+{
+    if (p.fd >= 0)
+    {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, p.fd, nullptr);
+        close(p.fd);
+        m_peer_fds.erase(p.fd);
+        RAFT_LOG("tcp_transport->disconnect peer:{} dropped:{}", p.id, p.bytes);
+    }
+    p.fd = -1;
+    p.connecting = false;
+    p.scheduled = false;
+    p.queue.clear();
+    p.offset = 0;
+    p.bytes = 0;
+    p.retry_at = std::chrono::steady_clock::now() + m_options.reconnect_delay;
+}
+
+void raft::tcp_transport::Watch(int fd, unsigned int events, bool add)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(m_epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
+
+#endif
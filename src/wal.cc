@@ -0,0 +1,438 @@
+#include "wal.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+#ifdef _WIN32
+#include <io.h>
+#define open _open
+#define write _write
+#define close _close
+#define fdatasync _commit
+#define O_FLAGS (_O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY)
+#else
+#include <unistd.h>
+#define O_FLAGS (O_WRONLY | O_CREAT | O_APPEND)
+#endif
+
+namespace
+{
+    // 记录格式：[长度 u32][crc32 u32][类型 u8][内容]，长度和crc覆盖类型和内容
+    enum RecordType : char
+    {
+        STATE = 1, // term, votedfor
+        LOG = 2,   // index, term, is_server, content
+    };
+
+    constexpr size_t HEADER_SIZE = 8;
+
+    unsigned int Crc32(const char *data, size_t size)
+    {
+        static const auto table = []
+        {
+            std::vector<unsigned int> t(256);
+            for (unsigned int i = 0; i < 256; ++i)
+            {
+                unsigned int c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        unsigned int crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i)
+            crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    template <typename T>
+    void Put(std::string &s, T v) { s.append((const char *)&v, sizeof(v)); }
+
+    template <typename T>
+    T Get(const char *p)
+    {
+        T v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    std::string Record(const std::string &body)
+    {
+        std::string record;
+        Put<unsigned int>(record, (unsigned int)body.size());
+        Put<unsigned int>(record, Crc32(body.data(), body.size()));
+        record += body;
+        return record;
+    }
+
+    std::string SegmentName(unsigned long long seq)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "wal-%016llx.log", seq);
+        return name;
+    }
+
+    bool ParseSegmentName(const std::string &name, unsigned long long &seq)
+    {
+        return name.size() == 24 && sscanf(name.c_str(), "wal-%16llx.log", &seq) == 1;
+    }
+
+    // 快照文件：[长度 u32][crc32 u32][index i32][term i32][数据]
+    std::string SnapshotName(int index)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "snap-%016x.snap", (unsigned int)index);
+        return name;
+    }
+
+    bool ParseSnapshotName(const std::string &name, int &index)
+    {
+        return name.size() == 26 && sscanf(name.c_str(), "snap-%16x.snap", &index) == 1;
+    }
+
+    // 文件的目录项也要落盘
+    void SyncDir(const std::string &dir)
+    {
+#ifndef _WIN32
+        const auto &fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            fsync(fd);
+            close(fd);
+        }
+#endif
+    }
+
+    void WriteAll(int fd, const char *data, size_t size)
+    {
+        size_t pos = 0;
+        while (pos < size)
+        {
+            const auto &n = write(fd, data + pos, (unsigned int)(size - pos));
+            if (n <= 0)
+            {
+                perror("wal: write");
+                abort(); // 无法保证持久化，不能继续应答
+            }
+            pos += n;
+        }
+        if (fdatasync(fd) != 0)
+        {
+            perror("wal: fdatasync");
+            abort();
+        }
+    }
+}
+
+raft::wal::wal(Options options) : m_options(std::move(options))
+{
+    assert(!m_options.dir.empty());
+}
+
+raft::wal::~wal()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool raft::wal::Load(const snapshot_handler &on_snapshot, const state_handler &on_state, const log_handler &on_log)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(m_options.dir, ec);
+    if (ec)
+        return false;
+
+    std::map<unsigned long long, std::filesystem::path> segments;
+    std::map<int, std::filesystem::path> snapshots;
+    for (const auto &entry : std::filesystem::directory_iterator(m_options.dir, ec))
+    {
+        unsigned long long seq = 0;
+        int index = 0;
+        if (!entry.is_regular_file())
+            continue;
+        if (ParseSegmentName(entry.path().filename().string(), seq))
+            segments[seq] = entry.path();
+        else if (ParseSnapshotName(entry.path().filename().string(), index))
+            snapshots[index] = entry.path();
+    }
+    if (ec)
+        return false;
+
+    // 最新的完整快照
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it)
+    {
+        std::ifstream in(it->second, std::ios::binary);
+        auto data = std::make_shared<std::string>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (data->size() < HEADER_SIZE + 8)
+            continue;
+        const auto &len = Get<unsigned int>(data->data());
+        const auto &crc = Get<unsigned int>(data->data() + 4);
+        const char *body = data->data() + HEADER_SIZE;
+        if (len < 8 || HEADER_SIZE + len != data->size() || Crc32(body, len) != crc)
+            continue;
+
+        on_snapshot(Get<int>(body), Get<int>(body + 4), buffer(data, body + 8, len - 8));
+        break;
+    }
+
+    bool corrupt = false;
+    for (const auto &[seq, path] : segments)
+    {
+        m_segment_seq = seq;
+        if (corrupt)
+        {
+            // 损坏位置之后的段不再可信
+            std::filesystem::remove(path, ec);
+            continue;
+        }
+
+        std::ifstream in(path, std::ios::binary);
+        auto data = std::make_shared<std::string>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        auto &max_index = m_segment_index[seq];
+        max_index = -1;
+        size_t pos = 0;
+        while (pos + HEADER_SIZE <= data->size())
+        {
+            const auto &len = Get<unsigned int>(data->data() + pos);
+            const auto &crc = Get<unsigned int>(data->data() + pos + 4);
+            const char *body = data->data() + pos + HEADER_SIZE;
+            if (len == 0 || pos + HEADER_SIZE + len > data->size() || Crc32(body, len) != crc)
+                break;
+
+            if (body[0] == STATE && len == 9)
+            {
+                m_state_record.assign(body - HEADER_SIZE, HEADER_SIZE + len);
+                on_state(Get<int>(body + 1), Get<int>(body + 5));
+            }
+            else if (body[0] == LOG && len >= 10)
+            {
+                // 日志内容直接引用读出的段数据，不再复制
+                max_index = std::max(max_index, Get<int>(body + 1));
+                on_log(Get<int>(body + 1), Get<int>(body + 5), body[9] != 0, buffer(data, body + 10, len - 10));
+            }
+            pos += HEADER_SIZE + len;
+        }
+
+        if (pos < data->size())
+        {
+            // 末尾是写了一半的记录（崩溃），截掉
+            fprintf(stderr, "wal: truncate %s at %zu/%zu\n", path.string().c_str(), pos, data->size());
+            std::filesystem::resize_file(path, pos, ec);
+            corrupt = true;
+        }
+    }
+
+    // 新的写入总是从新段开始
+    std::unique_lock<std::mutex> _(m_mutex);
+    ++m_segment_seq;
+    return true;
+}
+
+void raft::wal::SaveState(int term, int votedfor)
+{
+    std::string body;
+    body += STATE;
+    Put<int>(body, term);
+    Put<int>(body, votedfor);
+
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_pending_state = Record(body);
+    m_pending += m_pending_state;
+    Schedule();
+}
+
+void raft::wal::SaveLog(int index, int term, bool is_server, const buffer &content)
+{
+    std::string body;
+    body.reserve(10 + content.size());
+    body += LOG;
+    Put<int>(body, index);
+    Put<int>(body, term);
+    body += (char)is_server;
+    body.append(content.data(), content.size());
+    const auto &record = Record(body);
+
+    std::unique_lock<std::mutex> _(m_mutex);
+    m_pending += record;
+    m_pending_index = std::max(m_pending_index, index);
+    Schedule();
+}
+
+void raft::wal::SaveSnapshot(int index, int term, buffer data)
+{
+    std::unique_lock<std::mutex> _(m_mutex);
+    if (index <= m_pending_snapshot.index)
+        return;
+    m_pending_snapshot = Snapshot{index, term, std::move(data)};
+    Schedule();
+}
+
+void raft::wal::Sync(std::function<void()> done)
+{
+    {
+        std::unique_lock<std::mutex> _(m_mutex);
+        if (!m_pending.empty() || m_pending_snapshot.index >= 0 || m_flushing)
+        {
+            m_waiters.push_back(std::move(done));
+            Schedule();
+            return;
+        }
+    }
+    done();
+}
+
+void raft::wal::Schedule()
+{
+    if (m_flushing)
+        return;
+    m_flushing = true;
+
+    // 落盘交给不属于分片的线程，fdatasync期间分片线程照常处理心跳和投票
+    auto self = shared_from_this();
+    if (m_options.max_delay.count() <= 0 || m_pending.size() >= m_options.max_batch_bytes)
+        thread_pool::get(0).post_blocking([self]
+                                          { self->Flush(); });
+    else
+        thread_pool::get(0).submit_after(m_options.max_delay, [self]
+                                         { thread_pool::get(0).post_blocking([self]
+                                                                             { self->Flush(); }); });
+}
+
+void raft::wal::Flush()
+{
+    while (true)
+    {
+        std::string data;
+        std::string state;
+        int index = -1;
+        Snapshot snapshot;
+        std::vector<std::function<void()>> waiters;
+        {
+            std::unique_lock<std::mutex> _(m_mutex);
+            if (m_pending.empty() && m_pending_snapshot.index < 0 && m_waiters.empty())
+            {
+                m_flushing = false;
+                return;
+            }
+            data.swap(m_pending);
+            state.swap(m_pending_state);
+            std::swap(index, m_pending_index);
+            std::swap(snapshot, m_pending_snapshot);
+            waiters.swap(m_waiters);
+        }
+
+        {
+            // 落盘期间工作线程阻塞，线程池补充线程
+            thread_pool::blocking_region blocking;
+            // 快照先于同一批的记录落盘，快照之后写入的截断记录才能生效
+            if (snapshot.index >= 0)
+                WriteSnapshot(snapshot);
+            // 一批记录只写一次、同步一次
+            if (!data.empty())
+                Write(data, state, index);
+        }
+
+        for (auto &done : waiters)
+            done();
+    }
+}
+
+void raft::wal::Write(const std::string &data, const std::string &state, int index)
+{
+    if (m_fd < 0 || (m_segment_bytes > 0 && m_segment_bytes + data.size() > m_options.segment_size))
+    {
+        OpenSegment();
+
+        // 新段以当前的任期和投票开头，旧段可以整体删除
+        if (!m_state_record.empty())
+        {
+            WriteAll(m_fd, m_state_record.data(), m_state_record.size());
+            m_segment_bytes += m_state_record.size();
+        }
+    }
+
+    WriteAll(m_fd, data.data(), data.size());
+    m_segment_bytes += data.size();
+
+    if (!state.empty())
+        m_state_record = state;
+    auto &max_index = m_segment_index[m_segment_seq];
+    max_index = std::max(max_index, index);
+}
+
+void raft::wal::WriteSnapshot(const Snapshot &snapshot)
+{
+    std::string header;
+    std::string body;
+    Put<int>(body, snapshot.index);
+    Put<int>(body, snapshot.term);
+    body.append(snapshot.data.data(), snapshot.data.size());
+    Put<unsigned int>(header, (unsigned int)body.size());
+    Put<unsigned int>(header, Crc32(body.data(), body.size()));
+
+    // 先写临时文件再改名，保证快照文件要么完整要么不存在
+    const auto &dir = std::filesystem::path(m_options.dir);
+    const auto &tmp = (dir / (SnapshotName(snapshot.index) + ".tmp")).string();
+    const auto &fd = open(tmp.c_str(), O_FLAGS, 0644);
+    if (fd < 0)
+    {
+        perror("wal: open snapshot");
+        abort();
+    }
+    WriteAll(fd, (header + body).data(), header.size() + body.size());
+    close(fd);
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, dir / SnapshotName(snapshot.index), ec);
+    if (ec)
+    {
+        fprintf(stderr, "wal: rename snapshot %s\n", ec.message().c_str());
+        abort();
+    }
+    SyncDir(m_options.dir);
+
+    // 删除旧快照，以及从最早开始、日志都在快照之内的段（不能跳着删，后面的段可能截断过前面的日志）
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec))
+    {
+        int index = 0;
+        if (ParseSnapshotName(entry.path().filename().string(), index) && index < snapshot.index)
+            std::filesystem::remove(entry.path(), ec);
+    }
+    if (m_fd < 0)
+        return; // 还没有以最新任期和投票开头的新段，旧段先保留
+    for (auto it = m_segment_index.begin(); it != m_segment_index.end() && it->first < m_segment_seq && it->second <= snapshot.index;)
+    {
+        std::filesystem::remove(dir / SegmentName(it->first), ec);
+        it = m_segment_index.erase(it);
+    }
+}
+
+void raft::wal::OpenSegment()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        ++m_segment_seq;
+    }
+
+    const auto &path = (std::filesystem::path(m_options.dir) / SegmentName(m_segment_seq)).string();
+    m_fd = open(path.c_str(), O_FLAGS, 0644);
+    if (m_fd < 0)
+    {
+        perror("wal: open");
+        abort();
+    }
+    m_segment_bytes = 0;
+    m_segment_index[m_segment_seq] = -1;
+    SyncDir(m_options.dir);
+}
@@ -0,0 +1,105 @@
+#include "log_store.h"
+#include "raft.h"
+
+#include <assert.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+int main()
+{
+    // 用法同vector，跨块追加、截断、丢弃开头
+    {
+        raft::log_store<int, raft::array_segment<int, 4>> store;
+        assert(store.empty());
+        for (int i = 0; i < 10; ++i)
+            store.push_back(i);
+        assert(store.size() == 10 && store.front() == 0 && store.back() == 9 && store[5] == 5);
+
+        store.truncate(6);
+        assert(store.size() == 6 && store.back() == 5);
+        store.push_back(60);
+        assert(store.size() == 7 && store[6] == 60);
+
+        store.pop_front(5);
+        assert(store.size() == 2 && store.front() == 5 && store.back() == 60);
+        store.push_back(70);
+        assert(store.size() == 3 && store[2] == 70);
+
+        store.assign(100);
+        assert(store.size() == 1 && store.front() == 100);
+        store.clear();
+        assert(store.empty() && store.snapshot().empty());
+    }
+
+    // 视图不受之后的追加、截断、丢弃影响
+    {
+        raft::log_store<int, raft::array_segment<int, 4>> store;
+        for (int i = 0; i < 6; ++i)
+            store.push_back(i);
+        const auto &view = store.snapshot();
+
+        store.truncate(5);
+        store.push_back(50);
+        store.push_back(51);
+        store.pop_front(4);
+        assert(view.size() == 6);
+        int expect = 0;
+        for (const auto &e : view)
+            assert(e == expect++);
+        assert(expect == 6);
+
+        const auto &now = store.snapshot();
+        assert(now.size() == 3 && now[0] == 4 && now[1] == 50 && now[2] == 51);
+    }
+
+    // 一个写者不断追加、截断，读者看到的视图始终连续
+    {
+        raft::log_store<int, raft::array_segment<int, 16>> store;
+        store.push_back(0);
+        std::atomic<bool> stop{false};
+        std::thread reader([&]
+                           {
+                               while (!stop.load())
+                               {
+                                   const auto &view = store.snapshot();
+                                   assert(!view.empty() && view.front() == 0);
+                                   for (size_t i = 0; i < view.size(); ++i)
+                                       assert(view[i] == (int)i);
+                               } });
+        for (int round = 0; round < 200; ++round)
+        {
+            for (int i = (int)store.size(); i < 100; ++i)
+                store.push_back(i);
+            store.truncate(1 + round % 50);
+        }
+        stop.store(true);
+        reader.join();
+    }
+
+    // 按列存放的日志，短内容复制到内存区，长内容直接引用，截断后重写不影响旧视图
+    {
+        raft::log_entries store;
+        const std::string big(raft::log_segment::SMALL_CONTENT + 1, 'x');
+        const raft::buffer big_buffer(big);
+        for (int i = 0; i < 3000; ++i)
+            store.push_back(raft::Log{i, i / 100, i % 7 == 0, i % 500 == 0 ? big_buffer : raft::buffer(std::to_string(i))});
+        assert(store.size() == 3000 && store[0].content.data() == big_buffer.data() && store[1].content == "1");
+
+        const auto &view = store.snapshot();
+        store.truncate(1500);
+        for (int i = 1500; i < 2500; ++i)
+            store.push_back(raft::Log{i, 99, false, raft::buffer("new")});
+        store.pop_front(1000);
+
+        for (int i = 0; i < 3000; ++i)
+        {
+            const auto &log = view[i];
+            const auto &[segment, k] = view.locate(i);
+            assert(log.index == i && log.term == i / 100 && segment->terms[k] == i / 100 && log.is_server == (i % 7 == 0));
+            assert(log.content == (i % 500 == 0 ? big_buffer : raft::buffer(std::to_string(i))));
+        }
+        assert(store.size() == 1500 && store.front().index == 1000 && store[499].term == 14 && store[500].term == 99 && store.back().content == "new");
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include "logger.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 读出写到临时文件里的所有行
+std::vector<std::string> ReadLines(FILE *file)
+{
+    std::vector<std::string> lines;
+    fflush(file);
+    rewind(file);
+    std::string line;
+    for (int c = fgetc(file); c != EOF; c = fgetc(file))
+    {
+        if (c == '\n')
+        {
+            lines.push_back(line);
+            line.clear();
+        }
+        else
+        {
+            line += (char)c;
+        }
+    }
+    return lines;
+}
+
+// 去掉"[时间] "前缀
+std::string Body(const std::string &line)
+{
+    const auto &pos = line.find("] ");
+    assert(line[0] == '[' && pos != std::string::npos);
+    return line.substr(pos + 2);
+}
+
+struct Content
+{
+    std::string str;
+    std::string_view view() const { return str; }
+};
+
+int main()
+{
+    // 各种参数的格式化
+    {
+        FILE *file = tmpfile();
+        raft::logger lg;
+        lg.SetOutput(file);
+
+        static constexpr raft::log_site site{"int:{} uint:{} bool:{} char:{} double:{} str:{} literal:{} view:{} missing:{}"};
+        lg.Log(site, -3, 7u, true, 'x', 0.5, std::string("abc"), raft::log_literal{__func__}, Content{"buf"});
+        static constexpr raft::log_site brace{"apply_log[{}]{index:{}}"};
+        lg.Log(brace, 1, 2);
+        static constexpr raft::log_site nullstr{"{}"};
+        lg.Log(nullstr, (const char *)nullptr);
+        lg.Flush();
+
+        const auto &lines = ReadLines(file);
+        assert(lines.size() == 3);
+        assert(Body(lines[0]) == "int:-3 uint:7 bool:1 char:x double:0.5 str:abc literal:main view:buf missing:{}");
+        assert(Body(lines[1]) == "apply_log[1]{index:2}");
+        assert(Body(lines[2]) == "(null)");
+        fclose(file);
+    }
+
+    // 过长的字符串截断
+    {
+        FILE *file = tmpfile();
+        raft::logger lg;
+        lg.SetOutput(file);
+
+        static constexpr raft::log_site site{"{}|{}"};
+        lg.Log(site, std::string(1000, 'a'), 1);
+        lg.Flush();
+
+        const auto &lines = ReadLines(file);
+        assert(lines.size() == 1);
+        assert(Body(lines[0]) == std::string(raft::logger::MAX_STRING, 'a') + "|1");
+        fclose(file);
+    }
+
+    // 多线程并发写，每个线程的记录都在，且保持各自的顺序
+    {
+        FILE *file = tmpfile();
+        raft::logger lg;
+        lg.SetOutput(file);
+
+        constexpr int THREADS = 4;
+        constexpr int COUNT = 2000;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t)
+        {
+            threads.emplace_back([&lg, t]
+                                 {
+                                     static constexpr raft::log_site site{"thread:{} seq:{}"};
+                                     for (int i = 0; i < COUNT; ++i)
+                                     {
+                                         lg.Log(site, t, i);
+                                         if (i % 100 == 0)
+                                             std::this_thread::yield();
+                                     } });
+        }
+        for (auto &th : threads)
+            th.join();
+        lg.Flush();
+
+        std::vector<int> next(THREADS, 0);
+        const auto &lines = ReadLines(file);
+        for (const auto &line : lines)
+        {
+            int t = -1, i = -1;
+            assert(sscanf(Body(line).c_str(), "thread:%d seq:%d", &t, &i) == 2);
+            assert(t >= 0 && t < THREADS && i == next[t]);
+            ++next[t];
+        }
+        assert(lines.size() == (size_t)(THREADS * COUNT - lg.Dropped()));
+        if (lg.Dropped() == 0)
+        {
+            for (const auto &n : next)
+                assert(n == COUNT);
+        }
+        fclose(file);
+    }
+
+    // 缓冲区满时丢弃新记录，输出时报告丢了多少条
+    {
+        FILE *file = tmpfile();
+        raft::logger lg(0, std::chrono::hours(1)); // 最小的缓冲区，只有Flush时才输出
+        lg.SetOutput(file);
+
+        static constexpr raft::log_site site{"{}"};
+        const auto &COUNT = 200;
+        for (int i = 0; i < COUNT; ++i)
+            lg.Log(site, std::string(100, 'b'));
+        assert(lg.Dropped() > 0);
+        lg.Flush();
+
+        const auto &lines = ReadLines(file);
+        assert(!lines.empty());
+        assert(Body(lines.back()) == "logger->dropped " + std::to_string(lg.Dropped()) + " records");
+        assert(lines.size() == COUNT - lg.Dropped() + 1);
+
+        // 输出后又有空间了
+        lg.Log(site, "again");
+        lg.Flush();
+        assert(Body(ReadLines(file).back()) == "again");
+        fclose(file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "quorum.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if _HAS_CXX20
+// 立即开始的协程，等待投票结果
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+};
+
+detached Wait(std::shared_ptr<raft::quorum> q, std::atomic<int> &out)
+{
+    const auto &r = co_await *q;
+    out.store((int)r);
+}
+#endif
+
+int main()
+{
+    auto &tpool = raft::thread_pool::get(4);
+
+    // 多数同意时回调一次，重复的应答和非成员的应答不计数
+    {
+        int calls = 0;
+        auto result = raft::quorum::result::pending;
+        auto q = raft::quorum::when_majority({1, 2, 3, 4, 5}, 7, [&](raft::quorum::result r)
+                                             {
+                                                 ++calls;
+                                                 result = r; });
+        assert(q->tag() == 7);
+        q->ack(1, true);
+        q->ack(1, true);
+        q->ack(9, true);
+        assert(q->get() == raft::quorum::result::pending);
+        q->ack(2, true);
+        assert(q->get() == raft::quorum::result::pending);
+        q->ack(3, true);
+        assert(q->get() == raft::quorum::result::reached);
+        q->ack(4, false);
+        q->ack(5, false);
+        assert(calls == 1 && result == raft::quorum::result::reached);
+    }
+
+    // 拒绝太多、不可能够数时失败
+    {
+        auto q = raft::quorum::when_majority({1, 2, 3});
+        q->ack(1, false);
+        assert(q->get() == raft::quorum::result::pending);
+        q->ack(2, false);
+        assert(q->get() == raft::quorum::result::failed);
+        q->ack(3, true);
+        assert(q->get() == raft::quorum::result::failed);
+
+        auto all = raft::quorum::when_all({1, 2});
+        all->ack(1, true);
+        all->ack(2, false);
+        assert(all->get() == raft::quorum::result::failed);
+    }
+
+    // 联合共识：两组都够数才成功，任意一组不可能够数就失败
+    {
+        auto q = raft::quorum::when_joint({1, 2, 3}, 2, {3, 4, 5}, 2);
+        q->ack(1, true);
+        q->ack(2, true);
+        assert(q->get() == raft::quorum::result::pending);
+        q->ack(3, true); // 在两组里都算
+        assert(q->get() == raft::quorum::result::pending);
+        q->ack(4, true);
+        assert(q->get() == raft::quorum::result::reached);
+
+        auto f = raft::quorum::when_joint({1, 2, 3}, 2, {3, 4, 5}, 2);
+        f->ack(1, true);
+        f->ack(2, true);
+        f->ack(4, false);
+        assert(f->get() == raft::quorum::result::pending);
+        f->ack(5, false);
+        assert(f->get() == raft::quorum::result::failed);
+    }
+
+    // 超时
+    {
+        std::atomic<int> result{0};
+        auto q = raft::quorum::when_all({1, 2}, 0, [&](raft::quorum::result r)
+                                        { result.store((int)r); });
+        q->ack(1, true);
+        q->expire_after(std::chrono::milliseconds(20));
+        while (result.load() == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(result.load() == (int)raft::quorum::result::timeout);
+        q->ack(2, true);
+        assert(q->get() == raft::quorum::result::timeout);
+    }
+
+    // 多个线程同时应答，只回调一次
+    for (int round = 0; round < 100; ++round)
+    {
+        constexpr int MEMBERS = 16;
+        std::vector<int> members;
+        for (int i = 0; i < MEMBERS; ++i)
+            members.push_back(i);
+        std::atomic<int> calls{0};
+        auto q = raft::quorum::when_majority(members, 0, [&](raft::quorum::result)
+                                             { calls.fetch_add(1); });
+        std::vector<raft::future<void>> results;
+        for (int i = 0; i < MEMBERS; ++i)
+            results.emplace_back(tpool.submit([q, i]
+                                              { q->ack(i, true); }));
+        for (auto &r : results)
+            r.get();
+        assert(calls.load() == 1 && q->get() == raft::quorum::result::reached);
+    }
+
+#if _HAS_CXX20
+    // co_await等待结果，够数时在应答的线程里恢复
+    {
+        std::atomic<int> result{0};
+        auto q = raft::quorum::when_majority({1, 2, 3});
+        Wait(q, result);
+        q->ack(1, true);
+        assert(result.load() == 0);
+        q->ack(2, true);
+        assert(result.load() == (int)raft::quorum::result::reached);
+
+        // 已经有结果时不挂起
+        std::atomic<int> again{0};
+        Wait(q, again);
+        assert(again.load() == (int)raft::quorum::result::reached);
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,670 @@
+#include "raft.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <filesystem>
+#include <mutex>
+#include <random>
+
+int GetLeaderID(std::shared_ptr<raft::objfactory<raft::server>> factory)
+{
+    int leader_id = 0;
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (tmp->IsStop())
+            continue;
+
+        // 在同一个任期内，只有一个leader
+        if (!tmp->IsLeader())
+            continue;
+        if (leader_id == 0)
+            leader_id = id;
+        assert(leader_id == id);
+    }
+    return leader_id;
+}
+
+// 等到选出领导（不算except），超时返回0
+int WaitLeaderID(std::shared_ptr<raft::objfactory<raft::server>> factory, std::chrono::milliseconds timeout = std::chrono::seconds(5), int except = 0)
+{
+    const auto &deadline = std::chrono::steady_clock::now() + timeout;
+    auto leader_id = GetLeaderID(factory);
+    while ((leader_id == 0 || leader_id == except) && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        leader_id = GetLeaderID(factory);
+    }
+    return leader_id == except ? 0 : leader_id;
+}
+
+// 启动1到count号服务器，用自己的本地传输，和其他集群分开；传输写回config，之后加入的服务器用同一个
+std::shared_ptr<raft::objfactory<raft::server>> StartCluster(int count, raft::Config &config)
+{
+    auto factory = std::make_shared<raft::objfactory<raft::server>>();
+    config.transport = std::make_shared<raft::local_transport>();
+    for (int i = 1; i <= count; ++i)
+        factory->Get(i, factory, config)->Start();
+    return factory;
+}
+
+void StopAll(std::shared_ptr<raft::objfactory<raft::server>> factory)
+{
+    for (const auto &id : factory->GetAllObjKey())
+        factory->Get(id, factory)->Stop();
+}
+
+// 检测日志是否一致
+void CheckApplyLog(std::shared_ptr<raft::objfactory<raft::server>> factory)
+{
+    const auto &leader_id = GetLeaderID(factory);
+    assert(leader_id != 0);
+    const auto &log_vec = factory->Get(leader_id, factory)->ApplyLogVec();
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (tmp->IsStop())
+            continue;
+
+        const auto &tmp_log_vec = tmp->ApplyLogVec();
+        assert(log_vec.size() == tmp_log_vec.size());
+        for (int i = 0; i < (int)log_vec.size(); ++i)
+        {
+            assert(log_vec[i].index == tmp_log_vec[i].index);
+            assert(log_vec[i].term == tmp_log_vec[i].term);
+            assert(log_vec[i].is_server == tmp_log_vec[i].is_server);
+            assert(log_vec[i].content == tmp_log_vec[i].content);
+        }
+    }
+}
+
+int main()
+{
+    // 对象池
+    auto factory = std::make_shared<raft::objfactory<raft::server>>();
+
+    // 线程池，定时任务由时间轮驱动，线程数不随服务器数量增长
+    // 每个服务器的任务固定在一个分片（核）上执行
+    raft::thread_pool::Options pool_options;
+    pool_options.min_threads = 4;
+    pool_options.shards = 4;
+    pool_options.pin_threads = true;
+    raft::thread_pool::get(pool_options);
+
+    // 0号服务器不启动，作为学习者不计入选举和提交的多数
+    auto placeholder = factory->Get(0, factory);
+
+    const auto &MAX_SERVER = 5;
+
+    // 服务器启动，选举出一个leader
+    RAFT_LOG("\n\nTest->ALL server Start, server_count:{}", MAX_SERVER);
+    raft::Config config;
+    config.max_entries_per_rpc = 4; // 分批同步
+    config.max_inflight = 2;
+    config.snapshot_threshold = 20; // 频繁压缩
+    config.snapshot_chunk_size = 256; // 快照分块发送
+    config.learners = {0};
+    // 每个进程一个目录，同时运行的测试不会删掉彼此的预写日志，退出时删除
+    config.wal_dir = (std::filesystem::temp_directory_path() / ("raft_test_wal_" + std::to_string(std::random_device{}()))).string();
+    std::filesystem::remove_all(config.wal_dir);
+    for (int i = 1; i <= MAX_SERVER; ++i)
+        factory->Get(i, factory, config)->Start();
+    std::this_thread::sleep_for(std::chrono::seconds(15));
+    const auto &leader1 = GetLeaderID(factory);
+    assert(leader1 != 0);
+
+    // 领导掉线，重新选举
+    RAFT_LOG("\n\nTest->Server:{} Disconnect", leader1);
+    factory->Get(leader1, factory)->Stop();
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    const auto &leader2 = GetLeaderID(factory);
+    assert(leader2 != 0);
+
+    // 追加日志，掉线的服务器无法完成同步的
+    RAFT_LOG("\n\nTest->Server:{} Add Log", leader2);
+    factory->Get(leader2, factory)->AddLog("test_1");
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    assert(factory->Get(leader1, factory)->ApplyLogVec().size() == 0);
+    CheckApplyLog(factory);
+
+    // 掉线的服务器重新上线，同步日志
+    RAFT_LOG("\n\nTest->Server:{} Connect", leader1);
+    factory->Get(leader1, factory)->ReStart();
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    CheckApplyLog(factory);
+
+    // 超过一半的服务器掉线，无法完成选举
+    RAFT_LOG("\n\nTest->Leader:{} And More Than Half Server Disconnect", leader2);
+    factory->Get(leader2, factory)->Stop();
+    int disconnect_count = MAX_SERVER / 2;
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (tmp->IsStop())
+            continue;
+        tmp->Stop();
+        if (--disconnect_count <= 0)
+            break;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    assert(GetLeaderID(factory) == 0);
+
+    // 上线一台服务器，超过一半的服务器上线，重新选举
+    RAFT_LOG("\n\nTest->Server:{} Connect", leader2);
+    factory->Get(leader2, factory)->ReStart();
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    const auto &leader3 = GetLeaderID(factory);
+    assert(leader3 != 0);
+
+    // 下线一台非领导的服务器
+    RAFT_LOG("\n\nTest->Disconnect One Server");
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (!tmp->IsStop() && !tmp->IsLeader())
+        {
+            tmp->Stop();
+            break;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+
+    // 超过一半的服务器掉线，无法完成日志同步
+    RAFT_LOG("\n\nTest->Add Log");
+    factory->Get(leader3, factory)->AddLog("test_2");
+    factory->Get(leader3, factory)->AddLog("test_3");
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    CheckApplyLog(factory);
+
+    // 所有掉线的服务器重新上线，同步日志
+    RAFT_LOG("\n\nTest->All Server Connect");
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (tmp->IsStop() && id != 0)
+            tmp->ReStart();
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    CheckApplyLog(factory);
+
+    // 连续追加大量日志，分批流水线同步
+    const auto &leader4 = GetLeaderID(factory);
+    assert(leader4 != 0);
+    RAFT_LOG("\n\nTest->Server:{} Add Many Log", leader4);
+    const auto &apply_count = factory->Get(leader4, factory)->ApplyLogVec().size();
+    for (int i = 0; i < 100; ++i)
+        factory->Get(leader4, factory)->AddLog("batch_" + std::to_string(i));
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    assert(factory->Get(leader4, factory)->ApplyLogVec().size() == apply_count + 100);
+    CheckApplyLog(factory);
+
+    // 领导收到过半应答就提交并通知跟随者，不等心跳，所有服务器应用的延迟小于一次心跳间隔(100ms)
+    RAFT_LOG("\n\nTest->Server:{} Commit Latency", leader4);
+    const auto &begin = std::chrono::steady_clock::now();
+    factory->Get(leader4, factory)->AddLog("latency");
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (tmp->IsStop() || id == 0)
+            continue;
+        while (tmp->ApplyLogVec().size() < apply_count + 101 && std::chrono::steady_clock::now() - begin < std::chrono::seconds(1))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const auto &latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+    RAFT_LOG("latency:{}ms", latency);
+    assert(latency < 100);
+    CheckApplyLog(factory);
+
+    // 多个调用者并发提议，合并添加，应用后各自拿到结果
+    RAFT_LOG("\n\nTest->Server:{} Concurrent Propose", leader4);
+    {
+        std::vector<std::thread> threads;
+        std::vector<std::vector<raft::future<raft::ApplyResult>>> results(4);
+        for (int t = 0; t < (int)results.size(); ++t)
+        {
+            threads.emplace_back([&, t]
+                                 {
+                                     for (int i = 0; i < 50; ++i)
+                                         results[t].push_back(factory->Get(leader4, factory)->Propose("propose_" + std::to_string(t) + "_" + std::to_string(i))); });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        for (auto &vec : results)
+        {
+            int last_index = -1;
+            for (auto &result : vec)
+            {
+                assert(result.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+                const auto &ret = result.get();
+                assert(ret.status == raft::ApplyResult::Status::Ok);
+                assert(ret.index > last_index); // 同一个调用者的提议保持顺序
+                last_index = ret.index;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1)); // 等跟随者收到提交进度
+        CheckApplyLog(factory);
+
+        // 跟随者不接受提议，返回领导
+        for (const auto &id : factory->GetAllObjKey())
+        {
+            auto tmp = factory->Get(id, factory);
+            if (id == 0 || id == leader4 || tmp->IsStop())
+                continue;
+            const auto &ret = tmp->Propose("not_leader").get();
+            assert(ret.status == raft::ApplyResult::Status::NotLeader);
+            assert(ret.leader_hint == leader4);
+            break;
+        }
+    }
+
+    // 线性一致读不写日志，返回时之前提交的写入都已应用
+    RAFT_LOG("\n\nTest->Server:{} Read Index", leader4);
+    {
+        auto leader = factory->Get(leader4, factory);
+        const auto &write = leader->Propose("before_read").get();
+        assert(write.status == raft::ApplyResult::Status::Ok);
+        const int last_index = leader->LogVec().back().index;
+
+        std::vector<raft::future<raft::ApplyResult>> reads;
+        for (int i = 0; i < 20; ++i)
+            reads.push_back(leader->Read());
+        for (auto &read : reads)
+        {
+            assert(read.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+            const auto &ret = read.get();
+            assert(ret.status == raft::ApplyResult::Status::Ok);
+            assert(ret.index >= write.index);
+        }
+        assert(leader->LogVec().back().index == last_index);
+        assert(leader->ApplyLogVec().back().content == "before_read");
+
+        // 跟随者向领导要读索引，等自己应用到那里
+        for (const auto &id : factory->GetAllObjKey())
+        {
+            auto tmp = factory->Get(id, factory);
+            if (id == 0 || id == leader4 || tmp->IsStop())
+                continue;
+            const auto &ret = tmp->Read().get();
+            assert(ret.status == raft::ApplyResult::Status::Ok);
+            assert(ret.index >= write.index && ret.leader_hint == leader4);
+            assert(tmp->ApplyLogVec().back().content == "before_read");
+        }
+
+        // 不知道领导的服务器不能读
+        assert(placeholder->Read().get().status == raft::ApplyResult::Status::NotLeader);
+    }
+
+    // 跟随者崩溃重启，从预写日志恢复
+    int crash_id = 0;
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        if (id != 0 && id != leader4)
+        {
+            crash_id = id;
+            break;
+        }
+    }
+    RAFT_LOG("\n\nTest->Server:{} Crash And Recover", crash_id);
+    const auto &log_count = factory->Get(crash_id, factory)->LogVec().size();
+    factory->Get(crash_id, factory)->Start();
+    assert(factory->Get(crash_id, factory)->LogVec().size() == log_count);
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    CheckApplyLog(factory);
+
+    // 跟随者掉线期间领导压缩了日志，重新上线后通过安装快照追上
+    const auto &leader5 = GetLeaderID(factory);
+    assert(leader5 != 0);
+    int lag_id = 0;
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        if (id != 0 && id != leader5)
+        {
+            lag_id = id;
+            break;
+        }
+    }
+    RAFT_LOG("\n\nTest->Server:{} Disconnect While Leader Compact", lag_id);
+    factory->Get(lag_id, factory)->Stop();
+    const int lag_index = factory->Get(lag_id, factory)->LogVec().back().index; // 复制，安装快照后原日志会被替换
+    for (int i = 0; i < 60; ++i)
+        factory->Get(leader5, factory)->AddLog("snap_" + std::to_string(i));
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    assert(factory->Get(leader5, factory)->SnapshotIndex() > lag_index);
+    factory->Get(lag_id, factory)->ReStart();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    assert(factory->Get(lag_id, factory)->SnapshotIndex() > lag_index);
+    CheckApplyLog(factory);
+
+    // 领导被隔离时添加的日志没有提交，其他服务器选出新领导后，旧领导按冲突任期回退，覆盖这些日志
+    const auto &leader6 = GetLeaderID(factory);
+    assert(leader6 != 0);
+    RAFT_LOG("\n\nTest->Server:{} Diverge And Reconcile", leader6);
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        if (id != 0 && id != leader6)
+            factory->Get(id, factory)->Stop();
+    }
+    for (int i = 0; i < 20; ++i)
+        factory->Get(leader6, factory)->AddLog("diverge_" + std::to_string(i));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    factory->Get(leader6, factory)->Stop();
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        if (id != 0 && id != leader6)
+            factory->Get(id, factory)->ReStart();
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    const auto &leader7 = GetLeaderID(factory);
+    assert(leader7 != 0 && leader7 != leader6);
+    for (int i = 0; i < 20; ++i)
+        factory->Get(leader7, factory)->AddLog("reconcile_" + std::to_string(i));
+    factory->Get(leader6, factory)->ReStart();
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    CheckApplyLog(factory);
+    for (const auto &log : factory->Get(leader6, factory)->ApplyLogVec())
+        assert(log.content.view().substr(0, 8) != "diverge_");
+
+    // 同一个任期只投一票：先到的候选人拿到选票，同任期的另一个候选人被拒绝
+    // 领导的消息带来更大的任期时，新任期里还没有投票，上一任期的票不带过去
+    RAFT_LOG("\n\nTest->Vote Once Per Term");
+    {
+        auto vote_factory = std::make_shared<raft::objfactory<raft::server>>();
+        auto vote_transport = std::make_shared<raft::local_transport>();
+        raft::Config vote_config;
+        vote_config.transport = vote_transport;
+        auto voter = vote_factory->Get(1, vote_factory, vote_config);
+        std::mutex mutex;
+        std::vector<raft::VoteReply> replies;
+        for (int id = 2; id <= 3; ++id)
+        {
+            vote_factory->Get(id, vote_factory, vote_config); // 只占成员位置，不启动，由测试代替它收发消息
+            vote_transport->Bind(id, [&](raft::message msg)
+                                 {
+                                     if (const auto *reply = std::get_if<raft::VoteReply>(&msg))
+                                     {
+                                         std::unique_lock<std::mutex> _(mutex);
+                                         replies.push_back(*reply);
+                                     } });
+        }
+        voter->Start();
+
+        // 发出请求投票，等到应答
+        auto ask = [&](int term, int candidate_id)
+        {
+            size_t count = 0;
+            {
+                std::unique_lock<std::mutex> _(mutex);
+                count = replies.size();
+            }
+            vote_transport->Send(1, raft::VoteArgs{term, candidate_id, 1000, term}, raft::lane::control);
+            for (int i = 0; i < 100; ++i)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                std::unique_lock<std::mutex> _(mutex);
+                if (replies.size() > count)
+                    return replies.back();
+            }
+            assert(false);
+            return raft::VoteReply{};
+        };
+        const auto &first = ask(100, 2);
+        assert(first.term == 100 && first.vote_granted);
+        const auto &second = ask(100, 3);
+        assert(second.term == 100 && !second.vote_granted);
+
+        // 2号在101任期当了领导发来心跳，之后3号在101任期请求投票：我在101任期没有投过票
+        raft::AppendEntriesArgs heartbeat;
+        heartbeat.term = 101;
+        heartbeat.leader_id = 2;
+        vote_transport->Send(1, heartbeat, raft::lane::control);
+        const auto &third = ask(101, 3);
+        assert(third.term == 101 && third.vote_granted);
+
+        voter->Stop();
+        vote_transport->Unbind(2);
+        vote_transport->Unbind(3);
+    }
+
+    // 租约读：领导每次心跳都续租，租约内的读不等一轮确认，调用返回时已有结果
+    RAFT_LOG("\n\nTest->Lease Read");
+    {
+        raft::Config lease_config;
+        lease_config.lease_read = true;
+        auto lease_factory = StartCluster(3, lease_config);
+        const auto &lease_leader = WaitLeaderID(lease_factory);
+        assert(lease_leader != 0);
+
+        auto leader = lease_factory->Get(lease_leader, lease_factory);
+        const auto &write = leader->Propose("lease").get();
+        assert(write.status == raft::ApplyResult::Status::Ok);
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+        int immediate = 0;
+        for (int i = 0; i < 100; ++i)
+        {
+            auto read = leader->Read();
+            if (read.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                ++immediate;
+            assert(read.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+            const auto &ret = read.get();
+            assert(ret.status == raft::ApplyResult::Status::Ok && ret.index >= write.index);
+        }
+        assert(immediate > 0);
+
+        // 领导停服后读立即失败
+        leader->Stop();
+        assert(leader->Read().get().status == raft::ApplyResult::Status::NotLeader);
+        StopAll(lease_factory);
+    }
+
+    // 学习者接收日志、可以读，但不参加选举，也不计入提交的多数
+    RAFT_LOG("\n\nTest->Learner");
+    {
+        raft::Config learner_config;
+        learner_config.learners = {4, 5};
+        auto learner_factory = StartCluster(5, learner_config);
+        auto learner = learner_factory->Get(4, learner_factory);
+        assert(learner->IsLearner() && !learner_factory->Get(1, learner_factory)->IsLearner());
+
+        const auto &learner_leader = WaitLeaderID(learner_factory);
+        assert(learner_leader >= 1 && learner_leader <= 3);
+
+        // 停掉一个有投票权的成员，剩下的仍是多数（学习者不算），可以提交
+        auto leader = learner_factory->Get(learner_leader, learner_factory);
+        const auto &voter = learner_leader == 1 ? 2 : 1;
+        const auto &other = 6 - learner_leader - voter;
+        learner_factory->Get(voter, learner_factory)->Stop();
+        const auto &write = leader->Propose("learner").get();
+        assert(write.status == raft::ApplyResult::Status::Ok);
+
+        // 学习者的读向领导要读索引
+        const auto &ret = learner->Read().get();
+        assert(ret.status == raft::ApplyResult::Status::Ok && ret.index >= write.index);
+        assert(learner->ApplyLogVec().back().content == "learner");
+
+        // 有投票权的只剩领导，学习者再多也不能提交
+        learner_factory->Get(other, learner_factory)->Stop();
+        auto blocked = leader->Propose("blocked");
+        assert(blocked.wait_for(std::chrono::seconds(1)) == std::future_status::timeout);
+
+        // 学习者等再久也不会发起选举
+        leader->Stop();
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        assert(!learner->IsLeader() && learner->GetState() == raft::State::Folower);
+        assert(learner->Read().get().status == raft::ApplyResult::Status::NotLeader);
+        StopAll(learner_factory);
+        assert(blocked.get().status == raft::ApplyResult::Status::LeaderChanged);
+    }
+
+    // 学习者不算投票的成员，也不能凑成多数：4个成员、1个学习者，只剩2个成员在线时选不出领导
+    RAFT_LOG("\n\nTest->Learner Not Counted In Election");
+    {
+        raft::Config learner_config;
+        learner_config.learners = {5};
+        auto learner_factory = StartCluster(5, learner_config);
+        const auto &learner_leader = WaitLeaderID(learner_factory);
+        assert(learner_leader >= 1 && learner_leader <= 4);
+
+        // 停掉领导和另一个成员，剩下2个成员和学习者
+        const auto &voter = learner_leader == 1 ? 2 : 1;
+        learner_factory->Get(learner_leader, learner_factory)->Stop();
+        learner_factory->Get(voter, learner_factory)->Stop();
+        std::this_thread::sleep_for(std::chrono::seconds(3));
+        assert(GetLeaderID(learner_factory) == 0);
+
+        // 一个成员重新上线，超过一半，选出的领导不是学习者
+        learner_factory->Get(voter, learner_factory)->ReStart();
+        const auto &new_leader = WaitLeaderID(learner_factory);
+        assert(new_leader >= 1 && new_leader <= 4);
+        StopAll(learner_factory);
+    }
+
+    // 在线变更成员：持续写入的同时加入两个新成员、移除一个跟随者、移除领导，不停服
+    RAFT_LOG("\n\nTest->Membership Change");
+    {
+        raft::Config member_config;
+        member_config.snapshot_threshold = 50; // 新成员通过快照追上
+        auto member_factory = StartCluster(3, member_config);
+        const auto &member_leader = WaitLeaderID(member_factory);
+        assert(member_leader != 0);
+
+        // 先把成员写进日志，之后加入对象池的server不再自动算作成员；同一时间只能有一个变更
+        {
+            auto leader = member_factory->Get(member_leader, member_factory);
+            auto first = leader->ChangeMembership({1, 2, 3});
+            assert(leader->ChangeMembership({1, 2}).get().status == raft::ApplyResult::Status::Rejected);
+            assert(first.get().status == raft::ApplyResult::Status::Ok);
+            assert(leader->GetMembership().voters == std::vector<int>({1, 2, 3}) && !leader->GetMembership().IsJoint());
+        }
+
+        // 持续写入，领导换了就找新的领导
+        std::atomic<bool> stop{false};
+        std::atomic<int> written{0};
+        std::thread writer([&]
+                           {
+                               for (int i = 0; !stop; ++i)
+                               {
+                                   std::shared_ptr<raft::server> leader;
+                                   for (const auto &id : member_factory->GetAllObjKey())
+                                   {
+                                       auto tmp = member_factory->Get(id, member_factory);
+                                       if (!tmp->IsStop() && tmp->IsLeader())
+                                           leader = tmp;
+                                   }
+                                   if (!leader)
+                                   {
+                                       std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                                       continue;
+                                   }
+                                   if (leader->Propose("member_" + std::to_string(i)).get().status == raft::ApplyResult::Status::Ok)
+                                       ++written;
+                               } });
+
+        // 新加入的server先当自己是学习者，收到成员配置前不会发起选举
+        raft::Config join_config = member_config;
+        join_config.learners = {4, 5};
+        for (int i = 4; i <= 5; ++i)
+            member_factory->Get(i, member_factory, join_config)->Start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        auto leader = member_factory->Get(GetLeaderID(member_factory), member_factory);
+        const auto &added = leader->ChangeMembership({1, 2, 3, 4, 5}).get();
+        assert(added.status == raft::ApplyResult::Status::Ok);
+        // 两个新成员都收到新配置、不再是学习者、提交进度追上，可能要先装快照
+        auto joined = [&]
+        {
+            for (int i = 4; i <= 5; ++i)
+            {
+                auto tmp = member_factory->Get(i, member_factory);
+                if (tmp->IsLearner() || tmp->GetMembership().voters.size() != 5 || tmp->CommitIndex() < added.index)
+                    return false;
+            }
+            return true;
+        };
+        for (int i = 0; i < 100 && !joined(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(joined());
+
+        // 移除一个跟随者
+        const auto &removed = leader->key() == 1 ? 2 : 1;
+        std::vector<int> voters;
+        for (int i = 1; i <= 5; ++i)
+        {
+            if (i != removed)
+                voters.push_back(i);
+        }
+        assert(leader->ChangeMembership(voters).get().status == raft::ApplyResult::Status::Ok);
+        member_factory->Get(removed, member_factory)->Stop();
+
+        // 移除领导：新配置提交后它卸任，剩下的成员选出新领导
+        voters.erase(std::find(voters.begin(), voters.end(), leader->key()));
+        const auto &before = written.load();
+        assert(leader->ChangeMembership(voters).get().status == raft::ApplyResult::Status::Ok);
+        const auto &new_leader = WaitLeaderID(member_factory, std::chrono::seconds(5), leader->key());
+        assert(new_leader != 0 && !leader->IsLeader());
+        assert(std::find(voters.begin(), voters.end(), new_leader) != voters.end());
+        leader->Stop();
+
+        // 换领导之后写入继续
+        for (int i = 0; i < 50 && written.load() < before + 20; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        stop = true;
+        writer.join();
+        assert(written.load() >= before + 20);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        CheckApplyLog(member_factory);
+        assert(member_factory->Get(new_leader, member_factory)->GetMembership().voters == voters);
+        StopAll(member_factory);
+    }
+
+    // 成员数为偶数时也要过半：4个成员，提交和当选都要3个
+    RAFT_LOG("\n\nTest->Four Voters");
+    {
+        raft::Config even_config;
+        auto even_factory = StartCluster(4, even_config);
+        const auto &even_leader = WaitLeaderID(even_factory);
+        assert(even_leader != 0);
+        auto leader = even_factory->Get(even_leader, even_factory);
+        assert(leader->ChangeMembership({1, 2, 3, 4}).get().status == raft::ApplyResult::Status::Ok);
+
+        // 停掉两个跟随者，领导加剩下的一个只有一半，不能提交
+        std::vector<int> followers;
+        for (int i = 1; i <= 4; ++i)
+        {
+            if (i != even_leader)
+                followers.push_back(i);
+        }
+        even_factory->Get(followers[0], even_factory)->Stop();
+        even_factory->Get(followers[1], even_factory)->Stop();
+        auto blocked = leader->Propose("even");
+        assert(blocked.wait_for(std::chrono::seconds(1)) == std::future_status::timeout);
+
+        // 领导也停掉，重新上线一个跟随者，在线的只有一半，选不出领导
+        leader->Stop();
+        assert(blocked.get().status == raft::ApplyResult::Status::LeaderChanged);
+        even_factory->Get(followers[0], even_factory)->ReStart();
+        std::this_thread::sleep_for(std::chrono::seconds(3));
+        assert(GetLeaderID(even_factory) == 0);
+
+        // 再上线一个，超过一半，选出领导并且可以提交
+        even_factory->Get(followers[1], even_factory)->ReStart();
+        const auto &new_leader = WaitLeaderID(even_factory);
+        assert(new_leader != 0 && new_leader != leader->key());
+        assert(even_factory->Get(new_leader, even_factory)->Propose("even").get().status == raft::ApplyResult::Status::Ok);
+        StopAll(even_factory);
+    }
+
+    // 打印所有服务器的日志
+    RAFT_LOG("\n\nTest->All Server Print Apply Log");
+    for (const auto &id : factory->GetAllObjKey())
+    {
+        auto tmp = factory->Get(id, factory);
+        if (!tmp->IsStop() && id != 0)
+            tmp->PrintAllApplyLog();
+    }
+
+    // 停止后等还在进行的落盘结束，再删除预写日志
+    StopAll(factory);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::filesystem::remove_all(config.wal_dir);
+    return 0;
+}
@@ -0,0 +1,593 @@
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <atomic>
+#include <coroutine>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+
+// 统计全局new的次数，检查稳定后post不再分配内存
+std::atomic<long long> g_new_count{0};
+
+void *operator new(size_t n)
+{
+    g_new_count.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void *operator new(size_t n, const std::nothrow_t &) noexcept
+{
+    g_new_count.fetch_add(1, std::memory_order_relaxed);
+    return malloc(n ? n : 1);
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// 最简单的立即开始、不等待结果的协程，用来测试async_put
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+};
+
+detached AsyncPut(raft::bounded_queue<int> &queue, int value, std::atomic<int> &done, std::atomic<int> &failed)
+{
+    // 先存到变量再判断：GCC 12在if条件里co_await临时对象时，挂起期间不保留该对象
+    const bool ok = co_await queue.async_put(value);
+    if (!ok)
+        failed.fetch_add(1);
+    done.fetch_add(1);
+}
+
+int main()
+{
+    // 所属线程放入和取出、其他线程同时偷，每个元素恰好被取走一次
+    {
+        constexpr int COUNT = 100000;
+        constexpr int THIEVES = 3;
+        raft::chase_lev_deque<int *> deque(4); // 从很小开始，测试扩容
+        std::vector<int> items(COUNT, 0);
+        std::vector<std::atomic<int>> taken(COUNT);
+        std::atomic<bool> done{false};
+
+        std::vector<std::thread> thieves;
+        for (int i = 0; i < THIEVES; ++i)
+        {
+            thieves.emplace_back([&]
+                                 {
+                                     while (!done.load() || !deque.empty())
+                                     {
+                                         if (auto e = deque.steal())
+                                             taken[e.value() - items.data()].fetch_add(1);
+                                     } });
+        }
+
+        for (int i = 0; i < COUNT; ++i)
+        {
+            deque.push(&items[i]);
+            if (i % 3 == 0)
+            {
+                if (auto e = deque.pop())
+                    taken[e.value() - items.data()].fetch_add(1);
+            }
+        }
+        while (auto e = deque.pop())
+            taken[e.value() - items.data()].fetch_add(1);
+        done.store(true);
+        for (auto &t : thieves)
+            t.join();
+
+        for (const auto &t : taken)
+            assert(t.load() == 1);
+    }
+
+    // 有界队列：多个生产者阻塞放入、多个消费者取出，容量很小时每个元素恰好取出一次
+    {
+        constexpr int COUNT = 20000;
+        constexpr int PRODUCERS = 3;
+        constexpr int CONSUMERS = 3;
+        raft::bounded_queue<int> queue(3);
+        assert(queue.capacity() == 4);
+
+        std::vector<std::atomic<int>> taken(COUNT * PRODUCERS);
+        std::vector<std::thread> producers, consumers;
+        for (int p = 0; p < PRODUCERS; ++p)
+        {
+            producers.emplace_back([&queue, p]
+                                   {
+                                       for (int i = 0; i < COUNT; ++i)
+                                           assert(queue.put(p * COUNT + i)); });
+        }
+        for (int c = 0; c < CONSUMERS; ++c)
+        {
+            consumers.emplace_back([&]
+                                   {
+                                       // -1表示结束
+                                       for (auto e = queue.take(); e.value() >= 0; e = queue.take())
+                                           taken[e.value()].fetch_add(1); });
+        }
+        for (auto &t : producers)
+            t.join();
+        for (int c = 0; c < CONSUMERS; ++c)
+            assert(queue.put(-1));
+        for (auto &t : consumers)
+            t.join();
+        for (const auto &t : taken)
+            assert(t.load() == 1);
+    }
+
+    // 有界队列：满时try_put失败，put阻塞到有空位，销毁后put、take都返回
+    {
+        raft::bounded_queue<std::unique_ptr<int>> queue(2);
+        assert(queue.try_put(std::make_unique<int>(1)));
+        assert(queue.try_put(std::make_unique<int>(2)));
+        auto rejected = std::make_unique<int>(3);
+        assert(!queue.try_put(std::move(rejected)));
+        assert(rejected && *rejected == 3); // 失败时没有被移走
+
+        std::atomic<bool> put{false};
+        std::thread producer([&]
+                             {
+                                 assert(queue.put(std::make_unique<int>(3)));
+                                 put.store(true); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(!put.load());
+        assert(*queue.take().value() == 1);
+        producer.join();
+        assert(put.load());
+        assert(*queue.take().value() == 2);
+        assert(*queue.take().value() == 3);
+
+        std::thread consumer([&]
+                             { assert(!queue.take()); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        queue.destroy();
+        consumer.join();
+        assert(!queue.put(std::make_unique<int>(4)));
+    }
+
+    // 有界队列：满时协程挂起，取出时替它放入并恢复，销毁时恢复并返回false
+    {
+        raft::bounded_queue<int> queue(2);
+        std::atomic<int> done{0}, failed{0};
+        for (int i = 0; i < 5; ++i)
+            AsyncPut(queue, i, done, failed);
+        assert(done.load() == 2); // 两个直接放入，三个挂起
+
+        assert(queue.take().value() == 0);
+        assert(done.load() == 3);
+        assert(queue.take().value() == 1);
+        assert(queue.take().value() == 2);
+        assert(queue.take().value() == 3);
+        assert(done.load() == 5);
+        assert(queue.take().value() == 4);
+
+        AsyncPut(queue, 5, done, failed);
+        AsyncPut(queue, 6, done, failed);
+        AsyncPut(queue, 7, done, failed);
+        assert(done.load() == 7);
+        queue.destroy();
+        assert(done.load() == 8 && failed.load() == 1);
+    }
+
+    // 全局队列有界时，外部线程try_put满了失败，工作线程取走后又能放入
+    {
+        int items[3] = {0, 1, 2};
+        raft::work_stealing_queue<int *> queue(1, 2);
+        assert(queue.try_put(&items[0]));
+        assert(queue.try_put(&items[1]));
+        assert(!queue.try_put(&items[2]));
+
+        std::thread worker([&]
+                           {
+                               assert(queue.take(0).value() == &items[0]);
+                               assert(queue.take(0).value() == &items[1]); });
+        worker.join();
+        assert(queue.try_put(&items[2]));
+        queue.stop();
+        assert(!queue.try_put(&items[0]));
+        const auto &rest = queue.drain();
+        assert(rest.size() == 1 && rest[0] == &items[2]);
+    }
+
+    // 控制面先于数据面取出，连续取一批控制面后让数据面取一个
+    {
+        constexpr int CONTROL = 20;
+        int data[2] = {0, 1};
+        int control[CONTROL];
+        raft::work_stealing_queue<int *> queue(1);
+        assert(queue.put(&data[0]));
+        assert(queue.put(&data[1]));
+        for (int i = 0; i < CONTROL; ++i)
+            assert(queue.put(&control[i], raft::lane::control));
+
+        std::vector<int *> order;
+        std::thread worker([&]
+                           {
+                               for (int i = 0; i < CONTROL + 2; ++i)
+                                   order.push_back(queue.take(0).value()); });
+        worker.join();
+
+        // 数据面的任务在控制面的之间出现，且不是最先
+        std::vector<int> data_pos;
+        for (int i = 0; i < (int)order.size(); ++i)
+        {
+            if (order[i] == &data[0] || order[i] == &data[1])
+                data_pos.push_back(i);
+        }
+        assert(data_pos.size() == 2);
+        assert(data_pos[0] > 0 && data_pos[1] < (int)order.size() - 1);
+        for (int i = 0, c = 0; i < (int)order.size(); ++i)
+        {
+            if (order[i] != &data[0] && order[i] != &data[1])
+                assert(order[i] == &control[c++]);
+        }
+    }
+
+    auto &tpool = raft::thread_pool::get(4);
+
+    // 批量提交：作用域结束前不执行，结束时一次放入；嵌套的作用域各自放入
+    {
+        std::atomic<int> count{0};
+        std::vector<raft::future<void>> results;
+        {
+            raft::thread_pool::batch outer(tpool);
+            for (int i = 0; i < 10; ++i)
+                results.emplace_back(tpool.submit([&count]
+                                                  { count.fetch_add(1); }));
+            {
+                raft::thread_pool::batch inner(tpool);
+                results.emplace_back(tpool.submit(raft::lane::control, [&count]
+                                                  { count.fetch_add(100); }));
+            }
+            results.back().get(); // 内层已经放入
+            results.pop_back();
+            assert(count.load() >= 100);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            assert(count.load() == 100);
+        }
+        for (auto &r : results)
+            r.get();
+        assert(count.load() == 110);
+
+        std::vector<std::function<int()>> tasks;
+        for (int i = 0; i < 64; ++i)
+            tasks.emplace_back([i]
+                               { return i; });
+        auto futures = tpool.submit_bulk(raft::lane::data, std::move(tasks));
+        assert(futures.size() == 64);
+        for (int i = 0; i < 64; ++i)
+            assert(futures[i].get() == i);
+    }
+
+    // 稳定后post不调用全局new：任务对象在线程间流转后回到内存池
+    {
+        std::atomic<int> done{0};
+        auto round = [&tpool, &done](int count)
+        {
+            done.store(0);
+            for (int i = 0; i < count; ++i)
+                tpool.post([&done]
+                           { done.fetch_add(1, std::memory_order_relaxed); });
+            while (done.load() < count)
+                std::this_thread::yield();
+        };
+        // 预热时一次放入较多，之后每轮在途的任务不超过预热时分配的
+        for (int i = 0; i < 3; ++i)
+            round(2000);
+        const auto &before = g_new_count.load();
+        for (int i = 0; i < 50; ++i)
+            round(100);
+        assert(g_new_count.load() == before);
+    }
+
+    // 指定车道提交
+    {
+        auto control = tpool.submit(raft::lane::control, []
+                                    { return 1; });
+        auto data = tpool.submit(raft::lane::data, []
+                                 { return 2; });
+        assert(control.get() + data.get() == 3);
+    }
+
+    // try_submit在全局队列不限长度时总能放入
+    {
+        std::vector<raft::future<int>> results;
+        for (int i = 0; i < 100; ++i)
+        {
+            auto r = tpool.try_submit([i]
+                                      { return i + 1; });
+            assert(r);
+            results.emplace_back(std::move(r.value()));
+        }
+        for (int i = 0; i < 100; ++i)
+            assert(results[i].get() == i + 1);
+    }
+
+    // 外部线程提交（全局队列），任务里再提交（工作线程自己的队列），所有任务都执行
+    {
+        constexpr int COUNT = 10000;
+        std::atomic<int> count{0};
+        std::vector<raft::future<raft::future<void>>> results;
+        for (int i = 0; i < COUNT; ++i)
+        {
+            results.emplace_back(tpool.submit([&tpool, &count]
+                                              {
+                                                  count.fetch_add(1);
+                                                  return tpool.submit([&count]
+                                                                      { count.fetch_add(1); }); }));
+        }
+        for (auto &r : results)
+            r.get().get();
+        assert(count.load() == COUNT * 2);
+    }
+
+    // 一个工作线程阻塞时，它队列里的任务被其他线程偷走执行
+    {
+        std::promise<void> release;
+        auto blocked = release.get_future().share();
+        auto outer = tpool.submit([&tpool, blocked]
+                                  {
+                                      auto inner = tpool.submit([]
+                                                                { return 42; });
+                                      const auto &ret = inner.get(); // 自己在等，只能由别人偷走执行
+                                      blocked.wait();
+                                      return ret; });
+        release.set_value();
+        assert(outer.get() == 42);
+    }
+
+    // 空闲后再提交，休眠的线程能被唤醒
+    for (int round = 0; round < 3; ++round)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::vector<raft::future<int>> results;
+        for (int i = 0; i < 8; ++i)
+            results.emplace_back(tpool.submit([i]
+                                              { return i * i; }));
+        for (int i = 0; i < 8; ++i)
+            assert(results[i].get() == i * i);
+    }
+
+    // 常驻线程都在阻塞区里等待时，线程池补充线程执行排队的任务
+    {
+        constexpr int COUNT = 12;
+        std::atomic<int> arrived{0};
+        std::promise<void> all;
+        auto all_arrived = all.get_future().share();
+        std::vector<raft::future<void>> results;
+        for (int i = 0; i < COUNT; ++i)
+            results.emplace_back(tpool.submit([&arrived, &all, all_arrived]
+                                              {
+                                                  raft::thread_pool::blocking_region blocking;
+                                                  if (arrived.fetch_add(1) + 1 == COUNT)
+                                                      all.set_value();
+                                                  all_arrived.wait(); }));
+        for (auto &r : results)
+            r.get();
+        const auto &stats = tpool.stats();
+        assert(stats.grown > 0);
+        assert(stats.threads >= COUNT);
+    }
+
+    // 任务积压时增加线程，空闲超时后减回常驻的线程数
+    {
+        using queue_type = raft::work_stealing_queue<std::function<void()> *>;
+        using group_type = raft::worker_group<queue_type>;
+        group_type::Options options;
+        options.min_threads = 1;
+        options.max_threads = 4;
+        options.idle_timeout = std::chrono::milliseconds(50);
+        options.tick = std::chrono::milliseconds(5);
+
+        queue_type queue(group_type::slots(options));
+        group_type group(queue, [&queue](int index)
+                         {
+                             while (auto task = queue.take(index))
+                             {
+                                 (**task)();
+                                 delete *task;
+                             } }, options);
+
+        std::atomic<int> done{0};
+        for (int i = 0; i < 8; ++i)
+            queue.put(new std::function<void()>([&done]
+                                                {
+                                                    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                                                    done.fetch_add(1); }));
+        while (done.load() < 8)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        assert(group.stats().grown > 0);
+
+        const auto &deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (group.stats().threads > options.min_threads && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        assert(group.stats().threads == options.min_threads);
+        assert(group.stats().shrunk > 0);
+
+        // 减少后仍能正常执行
+        std::promise<int> ret;
+        queue.put(new std::function<void()>([&ret]
+                                            { ret.set_value(7); }));
+        assert(ret.get_future().get() == 7);
+
+        queue.stop();
+        group.stop();
+    }
+
+    // 单生产者单消费者通道：满时放入失败，按顺序取出
+    {
+        raft::spsc_queue<int> channel(4);
+        for (int i = 0; i < 4; ++i)
+            assert(channel.try_push(i));
+        assert(!channel.try_push(4));
+        for (int i = 0; i < 4; ++i)
+            assert(channel.try_pop().value() == i);
+        assert(!channel.try_pop());
+
+        constexpr int COUNT = 100000;
+        std::thread producer([&channel]
+                             {
+                                 for (int i = 0; i < COUNT;)
+                                 {
+                                     if (channel.try_push(i))
+                                         ++i;
+                                     else
+                                         std::this_thread::yield();
+                                 } });
+        for (int i = 0; i < COUNT;)
+        {
+            if (auto e = channel.try_pop())
+                assert(e.value() == i++);
+            else
+                std::this_thread::yield();
+        }
+        producer.join();
+    }
+
+    // 分片的任务只在所属的线程执行，工作线程和外部线程发来的都一样
+    {
+        using queue_type = raft::work_stealing_queue<std::function<void()> *>;
+        using group_type = raft::worker_group<queue_type>;
+        group_type::Options options;
+        options.min_threads = 2;
+        options.max_threads = 4;
+        options.pin_threads = true;
+
+        constexpr int SHARDS = 2;
+        queue_type queue(group_type::slots(options), 0, SHARDS);
+        assert(queue.shards() == SHARDS);
+        group_type group(queue, [&queue](int index)
+                         {
+                             while (auto task = queue.take(index))
+                             {
+                                 (**task)();
+                                 delete *task;
+                             } }, options);
+
+        constexpr int COUNT = 1000;
+        std::mutex mutex;
+        std::vector<std::thread::id> owners[SHARDS];
+        std::atomic<int> done{0};
+        auto record = [&](int s)
+        {
+            return new std::function<void()>([&, s]
+                                             {
+                                                 {
+                                                     std::unique_lock<std::mutex> _(mutex);
+                                                     owners[s].push_back(std::this_thread::get_id());
+                                                 }
+                                                 done.fetch_add(1); });
+        };
+        for (int i = 0; i < COUNT; ++i)
+        {
+            const auto &s = i % SHARDS;
+            if (i % 3 == 0)
+            {
+                assert(queue.put_to(s, record(s)));
+            }
+            else
+            {
+                // 由普通任务转发，走工作线程到分片的通道
+                queue.put(new std::function<void()>([&queue, &record, s]
+                                                    { queue.put_to(s, record(s)); }));
+            }
+        }
+        while (done.load() < COUNT)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        for (int s = 0; s < SHARDS; ++s)
+        {
+            assert(!owners[s].empty());
+            for (const auto &id : owners[s])
+                assert(id == owners[s].front());
+        }
+        assert(owners[0].front() != owners[1].front());
+
+        queue.stop();
+        group.stop();
+        assert(!queue.put_to(0, nullptr));
+    }
+
+    // 只有分片所属的线程空闲时不减少线程，减少等到不属于分片的线程空闲
+    {
+        using queue_type = raft::work_stealing_queue<std::function<void()> *>;
+        using group_type = raft::worker_group<queue_type>;
+        group_type::Options options;
+        options.min_threads = 2;
+        options.max_threads = 4;
+        options.idle_timeout = std::chrono::milliseconds(50);
+        options.tick = std::chrono::milliseconds(5);
+
+        constexpr int SHARDS = 2;
+        static thread_local int worker_index = -1;
+        queue_type queue(group_type::slots(options), 0, SHARDS);
+        group_type group(queue, [&queue](int index)
+                         {
+                             worker_index = index;
+                             while (auto task = queue.take(index))
+                             {
+                                 (**task)();
+                                 delete *task;
+                             } }, options);
+
+        // 三个任务占住两个分片线程，积压后增加一个不属于分片的线程
+        std::promise<void> shard_release;
+        std::promise<void> general_release;
+        std::shared_future<void> shard_done = shard_release.get_future().share();
+        std::shared_future<void> general_done = general_release.get_future().share();
+        std::atomic<int> arrived{0};
+        for (int i = 0; i < 3; ++i)
+            queue.put(new std::function<void()>([&, shard_done, general_done]
+                                                {
+                                                    arrived.fetch_add(1);
+                                                    if (worker_index < SHARDS)
+                                                        shard_done.wait();
+                                                    else
+                                                        general_done.wait(); }));
+        while (arrived.load() < 3)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        assert(group.stats().threads == 3);
+
+        // 分片线程空闲超过idle_timeout，不属于分片的线程还在忙，不发出退出
+        shard_release.set_value();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        assert(queue.retiring() == 0 && group.stats().shrunk == 0 && group.stats().threads == 3);
+
+        general_release.set_value();
+        const auto &deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (group.stats().threads > options.min_threads && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        assert(group.stats().threads == options.min_threads && group.stats().shrunk == 1);
+
+        // 常驻的线程都属于分片时，只由不属于分片的线程执行的任务等来一个新线程，不在分片线程上执行
+        constexpr int COUNT = 20;
+        std::atomic<int> done{0};
+        std::atomic<int> on_shard{0};
+        for (int i = 0; i < COUNT; ++i)
+            assert(queue.put_general(new std::function<void()>([&]
+                                                               {
+                                                                   if (worker_index < SHARDS)
+                                                                       on_shard.fetch_add(1);
+                                                                   done.fetch_add(1); })));
+        while (done.load() < COUNT)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(on_shard.load() == 0 && group.stats().grown >= 2);
+
+        queue.stop();
+        group.stop();
+        assert(!queue.put_general(nullptr));
+    }
+
+    return 0;
+}
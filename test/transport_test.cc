@@ -0,0 +1,291 @@
+#include "raft.h"
+#include "tcp_transport.h"
+
+#include <assert.h>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// 收到的消息，按到达顺序
+struct inbox
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<raft::message> msgs;
+
+    raft::transport::handler handler()
+    {
+        return [this](raft::message msg)
+        {
+            std::unique_lock<std::mutex> _(mutex);
+            msgs.push_back(std::move(msg));
+            cv.notify_all();
+        };
+    }
+
+    bool wait(size_t n, std::chrono::milliseconds timeout = std::chrono::seconds(5))
+    {
+        std::unique_lock<std::mutex> _(mutex);
+        return cv.wait_for(_, timeout, [&]
+                           { return msgs.size() >= n; });
+    }
+};
+
+raft::message RoundTrip(const raft::message &msg)
+{
+    std::string head;
+    std::vector<raft::buffer> contents;
+    raft::Encode(msg, head, contents);
+    for (const auto &c : contents)
+        head.append(c.data(), c.size());
+    const raft::buffer data(std::move(head));
+    raft::message ret;
+    assert(raft::Decode(data, ret));
+    assert(!raft::Decode(data.slice(0, data.size() - 1), ret) || contents.empty());
+    return ret;
+}
+
+int main()
+{
+    raft::thread_pool::Options pool_options;
+    pool_options.min_threads = 4;
+    pool_options.shards = 4;
+    raft::thread_pool::get(pool_options);
+
+    // 编码后解码得到同样的消息
+    {
+        raft::AppendEntriesArgs args;
+        args.term = 3;
+        args.leader_id = 2;
+        args.pre_log_index = 10;
+        args.pre_log_term = 2;
+        args.commit_index = 9;
+        args.epoch = 7;
+        args.log_vec = {raft::Log{11, 3, true, "ToLeader:2"}, raft::Log{12, 3, false, ""}, raft::Log{13, 3, false, std::string(1000, 'a')}};
+        const auto &msg = RoundTrip(args);
+        const auto &ret = std::get<raft::AppendEntriesArgs>(msg);
+        assert(ret.term == 3 && ret.leader_id == 2 && ret.pre_log_index == 10 && ret.pre_log_term == 2 && ret.commit_index == 9 && ret.epoch == 7);
+        assert(ret.log_vec.size() == 3);
+        for (size_t i = 0; i < 3; ++i)
+        {
+            assert(ret.log_vec[i].index == args.log_vec[i].index && ret.log_vec[i].term == args.log_vec[i].term);
+            assert(ret.log_vec[i].is_server == args.log_vec[i].is_server && ret.log_vec[i].content == args.log_vec[i].content);
+        }
+
+        const auto &vote_msg = RoundTrip(raft::VoteReply{4, 5, true});
+        const auto &vote = std::get<raft::VoteReply>(vote_msg);
+        assert(vote.id == 4 && vote.term == 5 && vote.vote_granted);
+
+        raft::AppendEntriesReply reply;
+        reply.id = 3;
+        reply.conflict_term = -1;
+        reply.conflict_index = 42;
+        const auto &reply_msg = RoundTrip(reply);
+        const auto &r = std::get<raft::AppendEntriesReply>(reply_msg);
+        assert(r.id == 3 && r.conflict_term == -1 && r.conflict_index == 42 && !r.success);
+
+        const auto &read_msg = RoundTrip(raft::ReadIndexReply{2, 7, 9, true, 1 << 20, 2});
+        const auto &read = std::get<raft::ReadIndexReply>(read_msg);
+        assert(read.id == 2 && read.term == 7 && read.seq == 9 && read.success && read.index == 1 << 20 && read.leader_id == 2);
+
+        raft::message bad;
+        assert(!raft::Decode(std::string("\x7f", 1), bad));
+        assert(!raft::Decode(std::string("\x02\x01", 2), bad)); // 不认识的版本
+    }
+
+    // 同一批日志的索引和任期差分编码，头很小；解出的内容引用接收的数据，不复制
+    {
+        raft::AppendEntriesArgs args;
+        args.term = 100000;
+        args.pre_log_index = 1 << 30;
+        args.pre_log_term = 99999;
+        for (int i = 1; i <= 100; ++i)
+            args.log_vec.push_back(raft::Log{args.pre_log_index + i, i < 50 ? 99999 : 100000, i == 1, std::string(i, 'x')});
+
+        std::string head;
+        std::vector<raft::buffer> contents;
+        raft::Encode(args, head, contents);
+        assert(head.size() < 32 + 4 * args.log_vec.size());
+        for (const auto &c : contents)
+            head.append(c.data(), c.size());
+        const raft::buffer data(std::move(head));
+
+        raft::message msg;
+        assert(raft::Decode(data, msg));
+        const auto &ret = std::get<raft::AppendEntriesArgs>(msg);
+        assert(ret.term == args.term && ret.pre_log_index == args.pre_log_index && ret.log_vec.size() == args.log_vec.size());
+        for (size_t i = 0; i < args.log_vec.size(); ++i)
+        {
+            const auto &log = ret.log_vec[i];
+            assert(log.index == args.log_vec[i].index && log.term == args.log_vec[i].term && log.is_server == args.log_vec[i].is_server);
+            assert(log.content == args.log_vec[i].content);
+            assert(log.content.data() >= data.data() && log.content.data() + log.content.size() <= data.data() + data.size());
+        }
+
+        // 索引不连续，或累加后索引、任期超出int的帧不接受（差值超出int时截断，在这里正好变成+1）
+        constexpr int max = std::numeric_limits<int>::max();
+        constexpr int min = std::numeric_limits<int>::min();
+        raft::message bad;
+        for (const auto &[pre_index, pre_term, log] : {std::tuple{1, 0, raft::Log{3, 0, false, ""}}, std::tuple{max, 0, raft::Log{min, 0, false, ""}}, std::tuple{1, max, raft::Log{2, min, false, ""}}})
+        {
+            raft::AppendEntriesArgs bad_args;
+            bad_args.pre_log_index = pre_index;
+            bad_args.pre_log_term = pre_term;
+            bad_args.log_vec = {log};
+            std::string bad_head;
+            std::vector<raft::buffer> bad_contents;
+            raft::Encode(bad_args, bad_head, bad_contents);
+            assert(!raft::Decode(bad_head, bad));
+        }
+    }
+
+#ifdef __linux__
+    // 两个传输之间通过127.0.0.1收发，连续发送的消息按顺序到达，大块数据完整
+    {
+        raft::tcp_transport a;
+        raft::tcp_transport b;
+        assert(a.port() > 0 && b.port() > 0);
+        a.AddPeer(2, "127.0.0.1", b.port());
+        b.AddPeer(1, "127.0.0.1", a.port());
+
+        inbox at_a, at_b;
+        a.Bind(1, at_a.handler());
+        b.Bind(2, at_b.handler());
+
+        const auto &N = 1000;
+        for (int i = 0; i < N; ++i)
+        {
+            raft::AppendEntriesArgs args;
+            args.term = 1;
+            args.leader_id = 1;
+            args.epoch = i;
+            args.pre_log_index = i;
+            args.log_vec = {raft::Log{i + 1, 1, false, "log_" + std::to_string(i)}};
+            a.Send(2, std::move(args));
+        }
+        raft::InstallSnapshotArgs snapshot;
+        snapshot.data = std::string(4 << 20, 's');
+        snapshot.done = true;
+        a.Send(2, snapshot, raft::lane::data);
+
+        assert(at_b.wait(N + 1));
+        {
+            // 同一个分片上按发送顺序执行
+            std::unique_lock<std::mutex> _(at_b.mutex);
+            for (int i = 0; i < N; ++i)
+            {
+                const auto &args = std::get<raft::AppendEntriesArgs>(at_b.msgs[i]);
+                assert(args.epoch == i && args.log_vec.size() == 1 && args.log_vec[0].content == "log_" + std::to_string(i));
+            }
+            const auto &s = std::get<raft::InstallSnapshotArgs>(at_b.msgs[N]);
+            assert(s.done && s.data == snapshot.data);
+        }
+
+        // 应答走另一条连接
+        b.Send(1, raft::VoteReply{2, 1, true}, raft::lane::control);
+        assert(at_a.wait(1));
+
+        // 没有地址的远端直接丢弃
+        a.Send(9, raft::VoteReply{});
+    }
+
+    // 对方不在时丢弃，对方上线后重连
+    {
+        raft::tcp_transport a;
+        int port = 0;
+        {
+            raft::tcp_transport b;
+            port = b.port();
+        }
+        a.AddPeer(2, "127.0.0.1", port);
+        a.Send(2, raft::VoteReply{1, 1, true});
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        raft::tcp_transport::Options options;
+        options.port = port;
+        raft::tcp_transport b(options);
+        assert(b.port() == port);
+        inbox at_b;
+        b.Bind(2, at_b.handler());
+        bool received = false;
+        for (int i = 0; i < 20 && !received; ++i)
+        {
+            a.Send(2, raft::VoteReply{1, 1, true});
+            received = at_b.wait(1, std::chrono::milliseconds(100));
+        }
+        assert(received);
+    }
+
+    // 三个节点各自一个对象池和传输，只通过TCP通信，选出领导并同步日志
+    {
+        const auto &N = 3;
+        std::vector<std::shared_ptr<raft::objfactory<raft::server>>> factories;
+        std::vector<std::shared_ptr<raft::tcp_transport>> transports;
+        for (int i = 1; i <= N; ++i)
+        {
+            factories.push_back(std::make_shared<raft::objfactory<raft::server>>());
+            transports.push_back(std::make_shared<raft::tcp_transport>());
+        }
+
+        std::vector<std::shared_ptr<raft::server>> servers;
+        std::vector<std::shared_ptr<raft::server>> placeholders;
+        for (int i = 1; i <= N; ++i)
+        {
+            auto &factory = factories[i - 1];
+            for (int j = 1; j <= N; ++j)
+            {
+                if (j == i)
+                    continue;
+                transports[i - 1]->AddPeer(j, "127.0.0.1", transports[j - 1]->port());
+                placeholders.push_back(factory->Get(j, factory)); // 远端的server只占成员位置，不启动
+            }
+
+            raft::Config config;
+            config.transport = transports[i - 1];
+            servers.push_back(factory->Get(i, factory, config));
+        }
+        for (const auto &s : servers)
+            s->Start();
+
+        std::shared_ptr<raft::server> leader;
+        for (int i = 0; i < 100 && !leader; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            for (const auto &s : servers)
+            {
+                if (s->IsLeader())
+                    leader = s;
+            }
+        }
+        assert(leader);
+
+        for (int i = 0; i < 10; ++i)
+            assert(leader->Propose("tcp_" + std::to_string(i)).get().status == raft::ApplyResult::Status::Ok);
+        for (int i = 0; i < 50; ++i)
+        {
+            bool done = true;
+            for (const auto &s : servers)
+                done = done && s->ApplyLogVec().size() == 10;
+            if (done)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        for (const auto &s : servers)
+        {
+            const auto &log_vec = s->ApplyLogVec();
+            assert(log_vec.size() == 10);
+            for (int i = 0; i < 10; ++i)
+                assert(log_vec[i].content == "tcp_" + std::to_string(i));
+        }
+
+        for (const auto &s : servers)
+            s->Stop();
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include "wal.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <random>
+#include <string>
+#include <vector>
+
+struct Data
+{
+    int term = 0;
+    int votedfor = 0;
+    int snapshot_index = -1;
+    std::string snapshot;
+    std::vector<std::pair<int, std::string>> log_vec; // term, content，快照之内的只有任期
+};
+
+// 重新打开预写日志，按server的方式回放
+Data Load(const raft::wal::Options &options)
+{
+    Data data;
+    auto w = std::make_shared<raft::wal>(options);
+    bool ok = w->Load([&](int index, int term, raft::buffer snapshot)
+                      {
+                          data.snapshot_index = index;
+                          data.snapshot = snapshot.str();
+                          data.log_vec.assign(index + 1, std::make_pair(term, std::string())); },
+                      [&](int term, int votedfor)
+                      {
+                          data.term = term;
+                          data.votedfor = votedfor; },
+                      [&](int index, int term, bool, raft::buffer content)
+                      {
+                          if (index < data.snapshot_index)
+                              return;
+                          assert(index <= (int)data.log_vec.size());
+                          data.log_vec.resize(index);
+                          data.log_vec.emplace_back(term, content.str()); });
+    assert(ok);
+    return data;
+}
+
+// 打开预写日志用于写入，忽略已有数据
+std::shared_ptr<raft::wal> Open(const raft::wal::Options &options)
+{
+    auto w = std::make_shared<raft::wal>(options);
+    bool ok = w->Load([](int, int, raft::buffer) {}, [](int, int) {}, [](int, int, bool, raft::buffer) {});
+    assert(ok);
+    return w;
+}
+
+void Sync(std::shared_ptr<raft::wal> w)
+{
+    std::promise<void> done;
+    w->Sync([&done]
+            { done.set_value(); });
+    done.get_future().wait();
+}
+
+int main()
+{
+    raft::thread_pool::get(2);
+
+    raft::wal::Options options;
+    options.dir = (std::filesystem::temp_directory_path() / ("raft_wal_test_" + std::to_string(std::random_device{}()))).string(); // 同时运行的测试互不影响
+    std::filesystem::remove_all(options.dir);
+
+    // 空目录
+    {
+        const auto &data = Load(options);
+        assert(data.term == 0 && data.votedfor == 0 && data.log_vec.empty());
+    }
+
+    // 写入后重新加载，重复的索引截断之后的日志
+    {
+        auto w = Open(options);
+        w->SaveState(3, 2);
+        for (int i = 0; i < 10; ++i)
+            w->SaveLog(i, 1, false, "log_" + std::to_string(i));
+        w->SaveLog(5, 3, false, "new_5");
+        w->SaveState(4, 0);
+        Sync(w);
+
+        const auto &data = Load(options);
+        assert(data.term == 4 && data.votedfor == 0);
+        assert(data.log_vec.size() == 6);
+        assert(data.log_vec[4] == std::make_pair(1, std::string("log_4")));
+        assert(data.log_vec[5] == std::make_pair(3, std::string("new_5")));
+    }
+
+    // 组提交：多次写入共用一次落盘，回调按顺序全部执行
+    {
+        auto w = Open(options);
+        std::vector<std::promise<int>> done(100);
+        for (int i = 0; i < 100; ++i)
+        {
+            w->SaveLog(6 + i, 3, false, "batch_" + std::to_string(i));
+            w->Sync([&done, i]
+                    { done[i].set_value(i); });
+        }
+        for (int i = 0; i < 100; ++i)
+            assert(done[i].get_future().get() == i);
+
+        const auto &data = Load(options);
+        assert(data.log_vec.size() == 106);
+        assert(data.log_vec.back().second == "batch_99");
+    }
+
+    // 段文件写满后切换
+    {
+        auto small = options;
+        small.segment_size = 64;
+        auto w = Open(small);
+        for (int i = 0; i < 10; ++i)
+        {
+            w->SaveLog(106 + i, 4, false, std::string(40, 'a' + i));
+            Sync(w);
+        }
+
+        const auto &data = Load(options);
+        assert(data.log_vec.size() == 116);
+        assert(data.log_vec.back().second == std::string(40, 'j'));
+    }
+
+    // 末尾写了一半的记录被截掉
+    {
+        std::filesystem::path last;
+        for (const auto &entry : std::filesystem::directory_iterator(options.dir))
+        {
+            if (std::filesystem::file_size(entry.path()) > 0 && entry.path() > last)
+                last = entry.path();
+        }
+        const auto &size = std::filesystem::file_size(last);
+        {
+            std::ofstream out(last, std::ios::binary | std::ios::app);
+            const char garbage[] = "\x20\x00\x00\x00garbage";
+            out.write(garbage, sizeof(garbage) - 1);
+        }
+
+        const auto &data = Load(options);
+        assert(data.log_vec.size() == 116);
+        assert(std::filesystem::file_size(last) == size);
+    }
+
+    // 快照：删除旧快照和日志都在快照之内的段，之后的日志仍然保留
+    {
+        const auto &count = [&]
+        { return std::distance(std::filesystem::directory_iterator(options.dir), std::filesystem::directory_iterator()); };
+        const auto &before = count();
+
+        auto w = Open(options);
+        w->SaveSnapshot(100, 4, "snap_100");
+        w->SaveLog(116, 5, false, "after_snap");
+        Sync(w);
+        w->SaveSnapshot(110, 4, "snap_110");
+        Sync(w);
+        assert(count() < before);
+
+        const auto &data = Load(options);
+        assert(data.snapshot_index == 110 && data.snapshot == "snap_110");
+        assert(data.term == 4 && data.votedfor == 0);
+        assert(data.log_vec.size() == 117);
+        assert(data.log_vec[111].second == std::string(40, 'f'));
+        assert(data.log_vec[116] == std::make_pair(5, std::string("after_snap")));
+    }
+
+    // 安装不一致的快照：快照之后同索引的记录截断旧日志
+    {
+        auto w = Open(options);
+        w->SaveLog(117, 5, false, "stale_117");
+        w->SaveLog(118, 5, false, "stale_118");
+        w->SaveSnapshot(117, 6, "snap_117");
+        w->SaveLog(117, 6, true, "");
+        Sync(w);
+
+        const auto &data = Load(options);
+        assert(data.snapshot_index == 117 && data.snapshot == "snap_117");
+        assert(data.log_vec.size() == 118);
+        assert(data.log_vec[117].first == 6);
+    }
+
+    std::filesystem::remove_all(options.dir);
+    return 0;
+}